@@ -1,13 +1,28 @@
 /*
  * My implementation of Malloc
- * Segregated free-list implementation with free-lists divided
- * by size-classes of powers of two
+ * Two-level segregated fit (TLSF): free-lists are divided by size-classes of
+ * powers of two, and each of those again into sl_count sub-classes. A bitmap
+ * of the non-empty classes and one of the non-empty sub-classes in each class
+ * find a list that fits with a count-trailing-zeros, so that malloc and free
+ * take constant time.
+ *
+ * Requests of up to slab_max_size bytes don't get blocks of their own: they
+ * are objects in runs of run_size bytes, one size class to a run, found
+ * through a bitmap of free objects in the run and with no header of their own.
+ *
+ * mm_mt_malloc and friends are a thread-safe mode of the same allocator for
+ * multithreaded programs, with several such heaps and a cache of small blocks
+ * per thread; see the comment above mm_mt_init.
  */
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "memlib.h"
@@ -48,31 +63,79 @@ constexpr size_t chunk_size = 1 << 12;
 // header, footer, two pointers,
 constexpr size_t min_block_size = 4 * w_size;
 
+// sub-classes per power of two
+constexpr size_t sl_shift = 4;
+constexpr size_t sl_count = 1 << sl_shift;
+// blocks smaller than this go into class 0, in sub-classes 8 bytes apart
+constexpr size_t fl_shift = sl_shift + 3;
+constexpr size_t small_block_size = 1 << fl_shift;
+// classes go up to blocks of 1 MiB, larger ones all share the last sub-class:
+// the free-lists are at the start of the heap and count towards its size, and
+// each class adds sl_count of them
+constexpr size_t fl_count = 20 - fl_shift + 1;
+
+// runs are blocks with their payload aligned to their size, so masking an
+// object's address finds its run
+constexpr size_t run_size = 1 << 12;
+constexpr size_t slab_max_size = 64;
+// enough bits for a run of the smallest objects
+constexpr size_t run_map_words = run_size / w_size / w_bits;
+
 typedef struct free_node_t {
     struct free_node_t *prev;
     struct free_node_t *next;
 } free_node_t;
 
+// the free-lists of a heap, and bitmaps of which of them are non-empty
+typedef struct arena_t {
+    size_t fl_bitmap;            // classes with a non-empty sub-class
+    size_t sl_bitmaps[fl_count]; // non-empty sub-classes of each class
+    free_node_t *free_lists[fl_count * sl_count];
+} arena_t;
+
+// a run's header, at the start of its payload
+typedef struct run_t {
+    struct run_t *prev;
+    struct run_t *next; // in the list of runs of its class with free objects
+    size_t size;        // of its objects
+    size_t nfree;
+    size_t free_map[run_map_words]; // set for the free objects
+} run_t;
+
 static char *heap_listp;
-static free_node_t **free_lists;
+static arena_t *heap_arena;  // at the start of the heap
+static run_t **slab_classes; // after it, by object size / w_size
+// a bit for each run_size-aligned address from run_base, set for runs
+static size_t *run_map;
+static size_t run_map_size; // in words
+static uintptr_t run_base;
 
 static void *extend_heap(size_t);
-static void *coalesce(char *);
-static void *find_fit(size_t size);
-static void place(void *bp, size_t size);
+static void *coalesce(arena_t *a, char *);
+static void *find_fit(arena_t *a, size_t size);
+static void place(arena_t *a, void *bp, size_t size);
+static run_t *run_of(char *bp);
+static void *slab_malloc(size_t size);
+static void slab_free(run_t *run, char *bp);
 static void mm_heapcheck(int lineno);
 
 static inline size_t max(size_t x, size_t y) { return x > y ? x : y; }
-static inline size_t get(void *p) { return *(size_t *)p; }
+// relaxed atomics, which are plain loads and stores: in the thread-safe mode a
+// thread reads the size of a block it holds while the arena may be setting the
+// prev-alloc bit in the same header
+static inline size_t get(void *p) {
+    return __atomic_load_n((size_t *)p, __ATOMIC_RELAXED);
+}
+static inline void set(void *p, size_t val) {
+    __atomic_store_n((size_t *)p, val, __ATOMIC_RELAXED);
+}
 static inline size_t get_size(char *p) { return get(p) & ~0x7; }
 static inline void set_prev_alloc(char *p, size_t alloc) {
-    *(size_t *)p = (alloc << 1) | (*(size_t *)p & ~(0x2 | 0x4));
+    set(p, (alloc << 1) | (get(p) & ~(0x2 | 0x4)));
 }
 static inline size_t get_prev_alloc(char *p) { return get(p) & 0x2; }
 static inline size_t get_alloc(char *p) { return get(p) & 0x1; }
-static inline void put(void *p, size_t val) {
-    *(size_t *)p = (val | (*(size_t *)p & 0x2));
-}
+static inline void put(void *p, size_t val) { set(p, val | (get(p) & 0x2)); }
 static inline size_t pack(size_t size, size_t alloc) { return size | alloc; }
 static inline char *header(char *bp) { return bp - w_size; }
 static inline char *footer(char *bp) {
@@ -83,17 +146,22 @@ static char *prev_block_pointer(char *bp) {
     return bp - get_size(bp - (2 * w_size));
 }
 
-// we use log base2 to index into the array of free-lists
 static inline size_t log2_of(size_t n) {
-    size_t shift = w_bits >> 1;
-    size_t step = w_bits >> 2;
-    size_t shifted_n;
-    while ((shifted_n = (n >> shift)) != 1) {
-        shift = shifted_n ? shift + step : shift - step;
-        step = max(step >> 1, 1);
-    }
+    return w_bits - 1 - __builtin_clzl(n);
+}
 
-    return shift;
+// the index into free_lists of the sub-class a block of this size belongs to:
+// its class in the high bits, then the sl_shift bits after its leading one
+static inline size_t class_of(size_t size) {
+    if (size < small_block_size) {
+        return size >> 3;
+    }
+    size_t log2 = log2_of(size);
+    if (log2 - fl_shift + 1 >= fl_count) {
+        return fl_count * sl_count - 1;
+    }
+    return ((log2 - fl_shift + 1) << sl_shift) |
+           ((size >> (log2 - sl_shift)) & (sl_count - 1));
 }
 
 static inline void insert_into(free_node_t *node, free_node_t **list) {
@@ -104,16 +172,18 @@ static inline void insert_into(free_node_t *node, free_node_t **list) {
     }
     *list = node;
 }
-static inline void insert_node(free_node_t *node) {
+static inline void insert_node(arena_t *a, free_node_t *node) {
     assert(node);
     size_t size = get_size(header((char *)node));
-    size_t i = log2_of(size) - 1;
-    assert(i < w_bits);
+    size_t i = class_of(size);
+    assert(i < fl_count * sl_count);
     if (DEBUG) {
         printf("inserting %p into free-list\n", node);
         printf("size: %zu, class-size: %zu\n", size, i);
     }
-    insert_into(node, &free_lists[i]);
+    insert_into(node, &a->free_lists[i]);
+    a->sl_bitmaps[i >> sl_shift] |= 1UL << (i & (sl_count - 1));
+    a->fl_bitmap |= 1UL << (i >> sl_shift);
 }
 static inline void remove_node_from(free_node_t *node, free_node_t **list) {
     if (!node->next && !node->prev) { // if there are no next or prev,
@@ -128,19 +198,26 @@ static inline void remove_node_from(free_node_t *node, free_node_t **list) {
         node->prev->next = node->next;
     }
 }
-static inline void remove_node(free_node_t *node) {
+static inline void remove_node(arena_t *a, free_node_t *node) {
     assert(node);
     size_t size = get_size(header((char *)node));
-    size_t i = log2_of(size) - 1;
-    assert(i < w_bits);
+    size_t i = class_of(size);
+    assert(i < fl_count * sl_count);
     if (DEBUG) {
         printf("removing %p from free list\n", node);
         printf("size: %zu, class-size: %zu\n", size, i);
     }
-    remove_node_from(node, &free_lists[i]);
+    remove_node_from(node, &a->free_lists[i]);
+    if (!a->free_lists[i]) {
+        size_t fl = i >> sl_shift;
+        a->sl_bitmaps[fl] &= ~(1UL << (i & (sl_count - 1)));
+        if (!a->sl_bitmaps[fl]) {
+            a->fl_bitmap &= ~(1UL << fl);
+        }
+    }
 }
 
-static inline void split(void *bp, size_t size, size_t csize) {
+static inline void split(arena_t *a, void *bp, size_t size, size_t csize) {
     if ((csize - size) >= min_block_size) {
         put(header(bp), pack(size, 1));
         bp = next_block_pointer(bp);
@@ -148,23 +225,66 @@ static inline void split(void *bp, size_t size, size_t csize) {
         put(footer(bp), pack(csize - size, 0));
         set_prev_alloc(header(next_block_pointer(bp)), 0);
         free_node_t *new_node = (free_node_t *)bp;
-        insert_node(new_node);
+        insert_node(a, new_node);
     } else {
         put(header(bp), pack(csize, 1));
     }
 }
+
+// the size of the block for a request of size bytes: the payload and a
+// header, aligned, and no smaller than a free block
+static inline size_t adjust_size(size_t size) {
+    if (size <= 3 * w_size) {
+        return min_block_size;
+    }
+    size_t adj_size = ((w_size + size - 1) | 0x7) + 1; // size + header
+    assert(!(adj_size % 0x8) && "is aligned");
+    assert(adj_size >= min_block_size && "is at least minimum block size");
+    return adj_size;
+}
+
+static void free_block(arena_t *a, char *bp) {
+    size_t size = get_size(header(bp));
+    set_prev_alloc(header(next_block_pointer(bp)), 0);
+
+    put(header(bp), pack(size, 0));
+    put(footer(bp), pack(size, 0));
+    bp = coalesce(a, bp);
+    insert_node(a, (free_node_t *)bp);
+}
+
+// a block of adj_size from the heap's free-lists, or from growing the heap
+static char *malloc_block(size_t adj_size) {
+    char *bp;
+    if ((bp = find_fit(heap_arena, adj_size)) != NULL) {
+        place(heap_arena, bp, adj_size);
+        return bp;
+    }
+
+    size_t ext_size = max(adj_size, chunk_size);
+    if ((bp = extend_heap(ext_size)) == NULL) {
+        return NULL;
+    }
+    place(heap_arena, bp, adj_size);
+    return bp;
+}
 /*
  * mm_init - initialize the malloc package.
  */
 int mm_init(void) {
-    size_t free_list_size = sizeof(free_node_t *) * w_bits;
-    if ((heap_listp = mem_sbrk(free_list_size + (3 * w_size))) == (void *)-1)
+    size_t slab_classes_size = sizeof(run_t *) * (slab_max_size / w_size + 1);
+    if ((heap_listp = mem_sbrk(sizeof(arena_t) + slab_classes_size +
+                               (3 * w_size))) == (void *)-1)
         return -1;
-    free_lists = (free_node_t **)heap_listp;
-    for (size_t i = 0; i < w_bits; i++) {
-        free_lists[i] = NULL;
-    }
-    heap_listp += free_list_size;
+    heap_arena = (arena_t *)heap_listp;
+    memset(heap_arena, 0, sizeof(arena_t));
+    heap_listp += sizeof(arena_t);
+    slab_classes = (run_t **)heap_listp;
+    memset(slab_classes, 0, slab_classes_size);
+    heap_listp += slab_classes_size;
+    run_map = NULL;
+    run_map_size = 0;
+    run_base = (uintptr_t)mem_heap_lo() & ~(run_size - 1);
     put(heap_listp, pack(2 * w_size, 1)); // prologue headers
     set_prev_alloc(heap_listp, 1);
     put(heap_listp + w_size, pack(2 * w_size, 1));
@@ -182,8 +302,9 @@ int mm_init(void) {
 }
 
 /*
- * mm_malloc - allocate a memory block using a first-fit policy.
- * Extend the heap as needed.
+ * mm_malloc - allocate a memory block using a good-fit policy: the first
+ * block of the smallest non-empty sub-class above the size. Extend the heap
+ * as needed. Requests of up to slab_max_size bytes are objects in a run.
  */
 void *mm_malloc(size_t size) {
     heapcheck(__LINE__);
@@ -193,30 +314,16 @@ void *mm_malloc(size_t size) {
     if (size == 0) {
         return NULL;
     }
-
-    size_t adj_size;
-    if (size <= 3 * w_size) {
-        adj_size = min_block_size;
-    } else {
-        adj_size = ((w_size + size - 1) | 0x7) + 1; // size + header
-        assert(!(adj_size % 0x8) && "is aligned");
-        assert(adj_size >= min_block_size && "is at least minimum block size");
-        if (DEBUG) {
-            printf("adjusted size: %zu\n", adj_size);
-        }
+    if (size <= slab_max_size) {
+        return slab_malloc(size);
     }
 
-    char *bp;
-    if ((bp = find_fit(adj_size)) != NULL) {
-        place(bp, adj_size);
-        return bp;
+    size_t adj_size = adjust_size(size);
+    if (DEBUG) {
+        printf("adjusted size: %zu\n", adj_size);
     }
 
-    size_t ext_size = max(adj_size, chunk_size);
-    if ((bp = extend_heap(ext_size)) == NULL) {
-        return NULL;
-    }
-    place(bp, adj_size);
+    char *bp = malloc_block(adj_size);
     heapcheck(__LINE__);
     return bp;
 }
@@ -229,13 +336,12 @@ void mm_free(void *bp) {
     if (DEBUG)
         printf("freeing %p\n", bp);
     heapcheck(__LINE__);
-    size_t size = get_size(header(bp));
-    set_prev_alloc(header(next_block_pointer(bp)), 0);
-
-    put(header(bp), pack(size, 0));
-    put(footer(bp), pack(size, 0));
-    bp = coalesce(bp);
-    insert_node(bp);
+    run_t *run = run_of(bp);
+    if (run) {
+        slab_free(run, bp);
+    } else {
+        free_block(heap_arena, bp);
+    }
     heapcheck(__LINE__);
 }
 
@@ -254,6 +360,19 @@ void *mm_realloc(void *bp, size_t size) {
     heapcheck(__LINE__);
     void *oldptr = bp;
 
+    run_t *run = run_of(bp);
+    if (run) {
+        if (size <= run->size) {
+            return bp;
+        }
+        void *newptr = mm_malloc(size);
+        if (newptr == NULL)
+            return NULL;
+        memcpy(newptr, bp, run->size);
+        slab_free(run, bp);
+        return newptr;
+    }
+
     size_t block_size = get_size(header(oldptr));
     if (size + w_size < block_size) {
         return oldptr;
@@ -267,7 +386,7 @@ void *mm_realloc(void *bp, size_t size) {
     if (!next_alloc && size + w_size <= block_size + next_size) {
         block_size += next_size;
         put(header(bp), pack(block_size, 1));
-        remove_node((free_node_t *)next_bp);
+        remove_node(heap_arena, (free_node_t *)next_bp);
         set_prev_alloc(header(next_block_pointer(bp)), 1);
         heapcheck(__LINE__);
         return bp;
@@ -285,6 +404,292 @@ void *mm_realloc(void *bp, size_t size) {
     return newptr;
 }
 
+/*
+ * The thread-safe mode. Threads are handed out narenas arenas round-robin,
+ * each with its own lock and free-lists. An arena's heap is a set of
+ * segments, mmap'd at an alignment of their size, and each segment starts
+ * with a pointer to its arena, so masking a block's address finds the arena
+ * it belongs to. Blocks larger than huge_block_size get a mapping to
+ * themselves that they give back when freed.
+ *
+ * Each thread also keeps up to cache_fill freed blocks of each size up to
+ * cache_max_size, still marked allocated, and hands them out again without
+ * locking. Past that, a thread frees a block of its own arena under the
+ * arena's lock. A block of another arena is pushed onto that arena's
+ * lock-free list of remote frees. The next thread to take the arena's lock
+ * takes the whole list, keeping what fits in its cache, so that a thread
+ * allocating what others free mostly gets its blocks back without locking.
+ */
+constexpr size_t segment_size = 1 << 22;
+constexpr size_t huge_block_size = segment_size >> 2;
+constexpr size_t cache_max_size = 256;
+constexpr size_t cache_fill = 32;
+
+typedef struct mt_arena_t {
+    arena_t arena;
+    pthread_mutex_t lock;
+    _Atomic(free_node_t *) remote_frees; // linked through next
+} mt_arena_t;
+
+typedef struct segment_t {
+    mt_arena_t *arena; // NULL for a huge block's
+    size_t size;
+} segment_t;
+
+// indexed by block size / 8, linked through next
+typedef struct thread_cache_t {
+    mt_arena_t *arena;
+    free_node_t *blocks[cache_max_size / 8 + 1];
+    size_t counts[cache_max_size / 8 + 1];
+} thread_cache_t;
+
+static mt_arena_t *arenas;
+static size_t narenas;
+static atomic_size_t next_arena;
+static pthread_key_t cache_key;
+static __thread thread_cache_t thread_cache;
+
+static inline segment_t *segment_of(void *bp) {
+    return (segment_t *)((uintptr_t)bp & ~(segment_size - 1));
+}
+
+// maps size bytes at an alignment of segment_size
+static void *map_aligned(size_t size) {
+    char *p = mmap(NULL, size + segment_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *start = (char *)(((uintptr_t)p + segment_size - 1) &
+                           ~(segment_size - 1));
+    if (start > p) {
+        munmap(p, start - p);
+    }
+    munmap(start + size, p + segment_size - start);
+    return start;
+}
+
+// maps a segment for the arena, laid out like the heap: a prologue, a free
+// block filling the rest, and an epilogue
+static char *add_segment(mt_arena_t *m) {
+    segment_t *seg = map_aligned(segment_size);
+    if (!seg) {
+        return NULL;
+    }
+    seg->arena = m;
+    seg->size = segment_size;
+    char *prologue = (char *)(seg + 1);
+    put(prologue, pack(2 * w_size, 1));
+    set_prev_alloc(prologue, 1);
+    put(prologue + w_size, pack(2 * w_size, 1));
+
+    char *bp = prologue + 3 * w_size;
+    size_t size = (char *)seg + segment_size - w_size - header(bp);
+    put(header(bp), pack(size, 0));
+    set_prev_alloc(header(bp), 1);
+    put(footer(bp), pack(size, 0));
+    put(header(next_block_pointer(bp)), pack(0, 1));
+    insert_node(&m->arena, (free_node_t *)bp);
+    return bp;
+}
+
+// keeps a freed block in the cache if it is small and there is room
+static bool cache_block(thread_cache_t *cache, free_node_t *node) {
+    size_t size = get_size(header((char *)node));
+    size_t i = size >> 3;
+    if (size > cache_max_size || cache->counts[i] == cache_fill) {
+        return false;
+    }
+    node->next = cache->blocks[i];
+    cache->blocks[i] = node;
+    cache->counts[i]++;
+    return true;
+}
+
+// a block from the cache for a request of adj_size, if it has one
+static char *cached_block(thread_cache_t *cache, size_t adj_size) {
+    size_t i = adj_size >> 3;
+    if (adj_size > cache_max_size || !cache->blocks[i]) {
+        return NULL;
+    }
+    free_node_t *node = cache->blocks[i];
+    cache->blocks[i] = node->next;
+    cache->counts[i]--;
+    return (char *)node;
+}
+
+// takes the lock of the thread's arena, and the blocks other threads freed
+static void lock_arena(thread_cache_t *cache) {
+    mt_arena_t *m = cache->arena;
+    pthread_mutex_lock(&m->lock);
+    free_node_t *node =
+        atomic_exchange_explicit(&m->remote_frees, NULL, memory_order_acquire);
+    while (node) {
+        free_node_t *next = node->next;
+        if (!cache_block(cache, node)) {
+            free_block(&m->arena, (char *)node);
+        }
+        node = next;
+    }
+}
+
+// queues a block for its arena to free
+static void free_remote(mt_arena_t *m, free_node_t *node) {
+    free_node_t *head =
+        atomic_load_explicit(&m->remote_frees, memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&m->remote_frees, &head,
+                                                    node, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// runs as a thread exits, to give back the blocks it kept
+static void flush_cache(void *arg) {
+    thread_cache_t *cache = arg;
+    mt_arena_t *m = cache->arena;
+    lock_arena(cache);
+    for (size_t i = 0; i <= cache_max_size / 8; i++) {
+        while (cache->blocks[i]) {
+            free_node_t *node = cache->blocks[i];
+            cache->blocks[i] = node->next;
+            if (segment_of(node)->arena == m) {
+                free_block(&m->arena, (char *)node);
+            } else {
+                free_remote(segment_of(node)->arena, node);
+            }
+        }
+        cache->counts[i] = 0;
+    }
+    pthread_mutex_unlock(&m->lock);
+    cache->arena = NULL;
+}
+
+// the calling thread's cache, which picks it an arena on first use
+static thread_cache_t *my_cache(void) {
+    thread_cache_t *cache = &thread_cache;
+    if (!cache->arena) {
+        cache->arena = &arenas[atomic_fetch_add(&next_arena, 1) % narenas];
+        pthread_setspecific(cache_key, cache);
+    }
+    return cache;
+}
+
+/*
+ * mm_mt_init - set up n arenas for the thread-safe mode, before any thread
+ * calls mm_mt_malloc.
+ */
+int mm_mt_init(size_t n) {
+    if (n == 0) {
+        return -1;
+    }
+    arenas = mmap(NULL, n * sizeof(mt_arena_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arenas == MAP_FAILED) {
+        return -1;
+    }
+    narenas = n;
+    for (size_t i = 0; i < n; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        atomic_init(&arenas[i].remote_frees, NULL);
+    }
+    return pthread_key_create(&cache_key, flush_cache) ? -1 : 0;
+}
+
+/*
+ * mm_mt_malloc - allocate a block from the thread's cache, or else from its
+ * arena, which grows by a segment as needed.
+ */
+void *mm_mt_malloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    size_t adj_size = adjust_size(size);
+    if (adj_size > huge_block_size) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t map_size = (sizeof(segment_t) + size + page - 1) & ~(page - 1);
+        segment_t *seg = map_aligned(map_size);
+        if (!seg) {
+            return NULL;
+        }
+        seg->arena = NULL;
+        seg->size = map_size;
+        return seg + 1;
+    }
+
+    thread_cache_t *cache = my_cache();
+    char *bp = cached_block(cache, adj_size);
+    if (bp) {
+        return bp;
+    }
+    mt_arena_t *m = cache->arena;
+    lock_arena(cache);
+    // the blocks other threads freed may have brought one
+    if (!(bp = cached_block(cache, adj_size))) {
+        if (!(bp = find_fit(&m->arena, adj_size))) {
+            bp = add_segment(m);
+        }
+        if (bp) {
+            place(&m->arena, bp, adj_size);
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+    return bp;
+}
+
+/*
+ * mm_mt_free - keep a small block in the thread's cache while there is room,
+ * or else give it back to its arena.
+ */
+void mm_mt_free(void *bp) {
+    if (!bp) {
+        return;
+    }
+    segment_t *seg = segment_of(bp);
+    if (!seg->arena) {
+        munmap(seg, seg->size);
+        return;
+    }
+    thread_cache_t *cache = my_cache();
+    if (cache_block(cache, bp)) {
+        return;
+    }
+    mt_arena_t *m = seg->arena;
+    if (m != cache->arena) {
+        free_remote(m, bp);
+        return;
+    }
+    lock_arena(cache);
+    free_block(&m->arena, bp);
+    pthread_mutex_unlock(&m->lock);
+}
+
+/*
+ * mm_mt_realloc - unlike mm_realloc, this does not grow a block into a free
+ * neighbour, as that would need the lock of the arena the block came from.
+ */
+void *mm_mt_realloc(void *bp, size_t size) {
+    if (!bp) {
+        return mm_mt_malloc(size);
+    }
+    if (size == 0) {
+        mm_mt_free(bp);
+        return NULL;
+    }
+    segment_t *seg = segment_of(bp);
+    size_t usable = seg->arena ? get_size(header(bp)) - w_size
+                               : seg->size - sizeof(segment_t);
+    if (size <= usable) {
+        return bp;
+    }
+    void *newptr = mm_mt_malloc(size);
+    if (newptr) {
+        memcpy(newptr, bp, usable);
+        mm_mt_free(bp);
+    }
+    return newptr;
+}
+
 static void *extend_heap(size_t size) {
     heapcheck(__LINE__);
     char *bp;
@@ -296,14 +701,14 @@ static void *extend_heap(size_t size) {
     put(footer(bp), pack(size, 0));
     // new epilogue
     put(header(next_block_pointer(bp)), pack(0, 1));
-    set_prev_alloc(next_block_pointer(bp), 0);
-    bp = coalesce(bp);
-    insert_node((free_node_t *)bp);
+    set_prev_alloc(header(next_block_pointer(bp)), 0);
+    bp = coalesce(heap_arena, bp);
+    insert_node(heap_arena, (free_node_t *)bp);
     heapcheck(__LINE__);
     return bp;
 }
 
-static void *coalesce(char *bp) {
+static void *coalesce(arena_t *a, char *bp) {
     if (DEBUG) {
         printf("coalescing %p\n", bp);
     }
@@ -320,12 +725,12 @@ static void *coalesce(char *bp) {
         put(header(bp), pack(size, 0));
         put(footer(bp), pack(size, 0));
         free_node_t *neighbour_node = (free_node_t *)next_bp;
-        remove_node(neighbour_node);
+        remove_node(a, neighbour_node);
     } else if (!prev_alloc && next_alloc) {
         char *prev_bp = prev_block_pointer(bp);
         size += get_size(footer(prev_bp));
         free_node_t *prev_node = (free_node_t *)prev_bp;
-        remove_node(prev_node);
+        remove_node(a, prev_node);
         put(footer(bp), pack(size, 0));
         put(header(prev_block_pointer(bp)), pack(size, 0));
         bp = prev_block_pointer(bp);
@@ -334,42 +739,218 @@ static void *coalesce(char *bp) {
         char *prev_bp = prev_block_pointer(bp);
         size += get_size(footer(prev_bp)) + get_size(header(next_bp));
         free_node_t *prev_node = (free_node_t *)prev_bp;
-        remove_node(prev_node);
+        remove_node(a, prev_node);
         put(header(prev_block_pointer(bp)), pack(size, 0));
         put(footer(next_block_pointer(bp)), pack(size, 0));
         free_node_t *next_node = (free_node_t *)next_bp;
-        remove_node(next_node);
+        remove_node(a, next_node);
         bp = prev_block_pointer(bp);
     }
 
     return bp;
 }
 
-static void *find_fit(size_t size) {
-    size_t i = log2_of(size) - 1;
-    while (i < w_bits) {
-        for (free_node_t *node = free_lists[i]; node; node = node->next) {
-            if (size <= get_size(header((char *)node))) {
-                return node;
-            }
+// the first free block in the smallest non-empty sub-class from i on
+static free_node_t *first_from(arena_t *a, size_t i) {
+    size_t fl = i >> sl_shift;
+    size_t sl_map = a->sl_bitmaps[fl] & (~0UL << (i & (sl_count - 1)));
+    if (!sl_map) {
+        size_t fl_map = a->fl_bitmap & (~0UL << 1 << fl);
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = a->sl_bitmaps[fl];
+    }
+    return a->free_lists[(fl << sl_shift) | __builtin_ctzl(sl_map)];
+}
+
+static void *find_fit(arena_t *a, size_t size) {
+    size_t i = class_of(size);
+    free_node_t *node;
+    // rounding the size up to the next sub-class means any block there fits,
+    // unless the size is in the last one, which has no upper bound
+    if (i < fl_count * sl_count - 1) {
+        if (size >= small_block_size) {
+            i = class_of(size + (1UL << (log2_of(size) - sl_shift)) - 1);
+        }
+        if ((node = first_from(a, i))) {
+            return node;
+        }
+    }
+    // rather than grow the heap, look for one in the size's own sub-class
+    for (node = a->free_lists[class_of(size)]; node; node = node->next) {
+        if (size <= get_size(header((char *)node))) {
+            return node;
         }
-        i++;
     }
     return NULL;
 }
 
-static void place(void *bp, size_t size) {
+static void place(arena_t *a, void *bp, size_t size) {
     if (DEBUG)
         printf("allocating %p with size %zu \n", bp, size);
     heapcheck(__LINE__);
     size_t block_size = get_size(header(bp));
 
     free_node_t *node = (free_node_t *)bp;
-    remove_node(node);
-    split(bp, size, block_size);
+    remove_node(a, node);
+    split(a, bp, size, block_size);
     set_prev_alloc(header(next_block_pointer(bp)), 1);
 }
 
+// the run an object is in, or NULL if bp is a block's payload
+static run_t *run_of(char *bp) {
+    uintptr_t start = (uintptr_t)bp & ~(run_size - 1);
+    size_t i = (start - run_base) / run_size;
+    if (i / w_bits < run_map_size && run_map[i / w_bits] & (1UL << i % w_bits))
+        return (run_t *)start;
+    return NULL;
+}
+
+// marks the block at bp as a run, or not, growing the map to cover it
+static int mark_run(char *bp, bool is_run) {
+    size_t i = ((uintptr_t)bp - run_base) / run_size;
+    if (i / w_bits >= run_map_size) {
+        size_t size = max(2 * run_map_size, i / w_bits + 1);
+        size_t *map = (size_t *)malloc_block(adjust_size(size * w_size));
+        if (map == NULL)
+            return -1;
+        memset(map, 0, size * w_size);
+        if (run_map) {
+            memcpy(map, run_map, run_map_size * w_size);
+            free_block(heap_arena, (char *)run_map);
+        }
+        run_map = map;
+        run_map_size = size;
+    }
+    if (is_run)
+        run_map[i / w_bits] |= 1UL << i % w_bits;
+    else
+        run_map[i / w_bits] &= ~(1UL << i % w_bits);
+    return 0;
+}
+
+// carves an allocated block of run_size, with its payload aligned to
+// run_size, from the end of a free block; what is left in front stays free
+static char *run_block(void) {
+    // a block this size has an aligned payload at least a free block from
+    // its start
+    char *bp = find_fit(heap_arena, 2 * run_size + min_block_size);
+    if (bp == NULL) {
+        // grow the heap just enough to end it with a run, taking in the free
+        // block at its end, so that runs carved one after another tile it
+        char *end = (char *)mem_heap_hi() + 1;
+        char *start = end;
+        if (!get_prev_alloc(header(end)))
+            start -= get_size(end - 2 * w_size);
+        char *run_bp = (char *)(((uintptr_t)start + run_size - 1) &
+                                ~(run_size - 1));
+        if (run_bp > start && run_bp < start + min_block_size)
+            run_bp += run_size;
+        while (run_bp + run_size < end + min_block_size)
+            run_bp += run_size;
+        if ((bp = extend_heap(run_bp + run_size - end)) == NULL)
+            return NULL;
+    }
+    remove_node(heap_arena, (free_node_t *)bp);
+    size_t csize = get_size(header(bp));
+
+    char *run_bp =
+        (char *)(((uintptr_t)bp + csize - run_size) & ~(run_size - 1));
+    size_t lead = run_bp - bp;
+    size_t tail = csize - lead - run_size;
+    assert((lead == 0 || lead >= min_block_size) && "leaves a free block");
+    size_t size = tail >= min_block_size ? run_size : run_size + tail;
+    if (lead > 0) {
+        put(header(bp), pack(lead, 0));
+        put(footer(bp), pack(lead, 0));
+        insert_node(heap_arena, (free_node_t *)bp);
+        set(header(run_bp), pack(size, 1));
+    } else {
+        put(header(run_bp), pack(size, 1));
+    }
+    if (tail >= min_block_size) {
+        bp = next_block_pointer(run_bp);
+        set(header(bp), pack(tail, 0) | 0x2);
+        put(footer(bp), pack(tail, 0));
+        insert_node(heap_arena, (free_node_t *)bp);
+    } else {
+        set_prev_alloc(header(next_block_pointer(run_bp)), 1);
+    }
+    return run_bp;
+}
+
+static inline void link_run(run_t *run) {
+    run_t **list = &slab_classes[run->size / w_size];
+    run->prev = NULL;
+    run->next = *list;
+    if (*list)
+        (*list)->prev = run;
+    *list = run;
+}
+
+static inline void unlink_run(run_t *run) {
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        slab_classes[run->size / w_size] = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+}
+
+// a run of free objects of size bytes, linked into its class
+static run_t *new_run(size_t size) {
+    char *bp = run_block();
+    if (bp == NULL)
+        return NULL;
+    if (mark_run(bp, true) < 0) {
+        free_block(heap_arena, bp);
+        return NULL;
+    }
+    run_t *run = (run_t *)bp;
+    run->size = size;
+    run->nfree = (run_size - w_size - sizeof(run_t)) / size;
+    memset(run->free_map, 0, sizeof(run->free_map));
+    for (size_t i = 0; i < run->nfree / w_bits; i++)
+        run->free_map[i] = ~0UL;
+    if (run->nfree % w_bits)
+        run->free_map[run->nfree / w_bits] = (1UL << run->nfree % w_bits) - 1;
+    link_run(run);
+    return run;
+}
+
+// the first free object in a run of the request's class
+static void *slab_malloc(size_t size) {
+    size = (size + 0x7) & ~0x7;
+    run_t *run = slab_classes[size / w_size];
+    if (run == NULL && (run = new_run(size)) == NULL)
+        return NULL;
+    size_t i = 0;
+    while (!run->free_map[i])
+        i++;
+    size_t bit = __builtin_ctzl(run->free_map[i]);
+    run->free_map[i] &= ~(1UL << bit);
+    if (--run->nfree == 0)
+        unlink_run(run);
+    return (char *)(run + 1) + (i * w_bits + bit) * size;
+}
+
+// gives an object back to its run, and the run back to the heap once it is
+// empty, unless it is the only one of its class with room
+static void slab_free(run_t *run, char *bp) {
+    size_t i = (bp - (char *)(run + 1)) / run->size;
+    if (run->nfree++ == 0)
+        link_run(run);
+    run->free_map[i / w_bits] |= 1UL << i % w_bits;
+    if (run->nfree == (run_size - w_size - sizeof(run_t)) / run->size &&
+        (run->prev || run->next)) {
+        unlink_run(run);
+        mark_run((char *)run, false);
+        free_block(heap_arena, (char *)run);
+    }
+}
+
 static void assert_none_allocated_in(free_node_t *free_list, int lineno) {
     for (free_node_t *node = free_list; node != NULL; node = node->next) {
         if (DEBUG) {
@@ -388,7 +969,7 @@ static void assert_not_found_in(free_node_t *free_list, char *bp) {
 }
 static void assert_found_in(free_node_t *free_list, char *bp) {
     size_t size = get_size(header(bp));
-    size_t i = log2_of(size);
+    size_t i = class_of(size);
     for (free_node_t *node = free_list; node != NULL; node = node->next) {
         if ((char *)node == bp)
             return;
@@ -403,7 +984,7 @@ static void mm_heapcheck(int lineno) {
     }
     for (char *bp = heap_listp; get_size(header(bp)) > 0;
          bp = next_block_pointer(bp)) {
-        size_t i = log2_of(get_size(header(bp))) - 1;
+        size_t i = class_of(get_size(header(bp)));
         if (!get_alloc(header(bp))) {
             assertf(get_size(header(bp)) == get_size(footer(bp)),
                     "lineno: %d, hd: %zu, ft: %zu, addr: %p", lineno,
@@ -411,13 +992,31 @@ static void mm_heapcheck(int lineno) {
             assertf(get_alloc(header(bp)) == get_alloc(footer(bp)),
                     "lineno: %d, hd: %zu, ft: %zu, addr: %p", lineno,
                     get_alloc(header(bp)), get_alloc(footer(bp)), bp);
-            assert_found_in(free_lists[i], bp);
+            assert_found_in(heap_arena->free_lists[i], bp);
         }
         if (get_alloc(header(bp))) {
-            assert_not_found_in(free_lists[i], bp);
+            assert_not_found_in(heap_arena->free_lists[i], bp);
         }
     }
-    for (size_t i = 0; i < w_bits; i++) {
-        assert_none_allocated_in(free_lists[i], lineno);
+    arena_t *a = heap_arena;
+    for (size_t i = 0; i < fl_count * sl_count; i++) {
+        assert_none_allocated_in(a->free_lists[i], lineno);
+        size_t fl = i >> sl_shift;
+        size_t sl_bit = 1UL << (i & (sl_count - 1));
+        assertf(!a->free_lists[i] == !(a->sl_bitmaps[fl] & sl_bit),
+                "lineno: %d, sub-class: %zu", lineno, i);
+        assertf(!a->sl_bitmaps[fl] == !(a->fl_bitmap & (1UL << fl)),
+                "lineno: %d, class: %zu", lineno, fl);
+    }
+    for (size_t c = 1; c <= slab_max_size / w_size; c++) {
+        for (run_t *run = slab_classes[c]; run; run = run->next) {
+            assertf(run_of((char *)(run + 1)) == run, "lineno: %d, run: %p",
+                    lineno, run);
+            assertf(get_alloc(header((char *)run)) &&
+                        get_size(header((char *)run)) >= run_size,
+                    "lineno: %d, run: %p", lineno, run);
+            assertf(run->size == c * w_size && run->nfree > 0,
+                    "lineno: %d, run: %p", lineno, run);
+        }
     }
 }
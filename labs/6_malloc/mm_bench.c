@@ -0,0 +1,226 @@
+/*
+ * mm_bench - throughput of the thread-safe mode of mm.c against the C
+ * library's malloc as the number of threads grows.
+ *
+ * larson: each thread holds SLOTS blocks of 16 to 256 bytes and keeps
+ * replacing a random one. Between rounds the threads pass their slots on to
+ * the next thread, so most blocks are freed by a thread other than the one
+ * that allocated them, as in a server handing work between threads.
+ * producer/consumer: half the threads allocate blocks and pass them through
+ * a ring to a partner thread, which frees them.
+ *
+ * mm.c is pulled in whole, and needs the lab's memlib for its other mode:
+ *     gcc -O2 -o mm_bench mm_bench.c memlib.c -lpthread
+ *     ./mm_bench [-a arenas] [-t max_threads]
+ * There are 8 arenas per core, as glibc allows on 64-bit systems, unless -a
+ * says otherwise.
+ */
+#include "mm.c"
+
+#include <sched.h>
+#include <time.h>
+
+#define MAX_THREADS 64
+#define SLOTS 1024
+#define ROUNDS 8
+#define REPLACES 200000 // per thread and round
+#define RING_SIZE 1024
+#define HANDOFFS 1000000 // per producer
+#define MIN_BLOCK 16
+#define MAX_BLOCK 256
+
+typedef struct allocator_t {
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    {"mm", mm_mt_malloc, mm_mt_free},
+    {"glibc", malloc, free},
+};
+
+// the allocator being measured, and the threads sharing each run
+static const allocator_t *alloc;
+static size_t nthreads;
+
+static void **slots[MAX_THREADS];
+static pthread_barrier_t round_barrier;
+
+typedef struct ring_t {
+    void *blocks[RING_SIZE];
+    atomic_size_t head; // pushed by the producer
+    atomic_size_t tail; // popped by the consumer
+} ring_t;
+
+static ring_t rings[MAX_THREADS / 2];
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static inline size_t random_size(unsigned long *seed) {
+    *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+    return MIN_BLOCK + (*seed >> 33) % (MAX_BLOCK - MIN_BLOCK + 1);
+}
+
+// allocates a block and touches it, as its user would
+static inline void *new_block(unsigned long *seed) {
+    size_t size = random_size(seed);
+    char *p = alloc->malloc(size);
+    if (!p) {
+        fprintf(stderr, "%s: out of memory\n", alloc->name);
+        exit(1);
+    }
+    p[0] = p[size - 1] = 1;
+    return p;
+}
+
+static void *larson_thread(void *vargp) {
+    size_t id = (size_t)vargp;
+    unsigned long seed = id + 1;
+    for (size_t j = 0; j < SLOTS; j++) {
+        slots[id][j] = new_block(&seed);
+    }
+    for (size_t round = 0; round < ROUNDS; round++) {
+        pthread_barrier_wait(&round_barrier);
+        void **mine = slots[(id + round) % nthreads];
+        for (size_t k = 0; k < REPLACES; k++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            size_t j = (seed >> 33) % SLOTS;
+            alloc->free(mine[j]);
+            mine[j] = new_block(&seed);
+        }
+    }
+    pthread_barrier_wait(&round_barrier);
+    for (size_t j = 0; j < SLOTS; j++) {
+        alloc->free(slots[id][j]);
+    }
+    return NULL;
+}
+
+// even threads produce into ring id / 2, odd ones consume from it
+static void *handoff_thread(void *vargp) {
+    size_t id = (size_t)vargp;
+    ring_t *ring = &rings[id / 2];
+    unsigned long seed = id + 1;
+    for (size_t k = 0; k < HANDOFFS; k++) {
+        if (id % 2 == 0) {
+            void *p = new_block(&seed);
+            size_t head =
+                atomic_load_explicit(&ring->head, memory_order_relaxed);
+            while (head - atomic_load_explicit(&ring->tail,
+                                               memory_order_acquire) ==
+                   RING_SIZE) {
+                sched_yield();
+            }
+            ring->blocks[head % RING_SIZE] = p;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        } else {
+            size_t tail =
+                atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            while (atomic_load_explicit(&ring->head, memory_order_acquire) ==
+                   tail) {
+                sched_yield();
+            }
+            alloc->free(ring->blocks[tail % RING_SIZE]);
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+// runs fn on n threads, each given its index, and returns the seconds taken
+static double run_threads(size_t n, void *(*fn)(void *)) {
+    pthread_t tids[MAX_THREADS];
+    struct timespec start, end;
+    nthreads = n;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, fn, (void *)i)) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_s(&start, &end);
+}
+
+static void bench_larson(size_t max_threads) {
+    printf("larson, Mpairs/s (a free and a malloc each)\n%10s", "threads");
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(*allocators); a++) {
+        printf(" %10s", allocators[a].name);
+    }
+    printf("\n");
+    for (size_t n = 1; n <= max_threads; n <<= 1) {
+        printf("%10zu", n);
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(*allocators); a++) {
+            alloc = &allocators[a];
+            pthread_barrier_init(&round_barrier, NULL, n);
+            double s = run_threads(n, larson_thread);
+            pthread_barrier_destroy(&round_barrier);
+            printf(" %10.2f", n * ROUNDS * REPLACES / s / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+static void bench_handoff(size_t max_threads) {
+    printf("\nproducer/consumer, Mblocks/s\n%10s", "threads");
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(*allocators); a++) {
+        printf(" %10s", allocators[a].name);
+    }
+    printf("\n");
+    for (size_t n = 2; n <= max_threads; n <<= 1) {
+        printf("%10zu", n);
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(*allocators); a++) {
+            alloc = &allocators[a];
+            for (size_t r = 0; r < n / 2; r++) {
+                atomic_init(&rings[r].head, 0);
+                atomic_init(&rings[r].tail, 0);
+            }
+            double s = run_threads(n, handoff_thread);
+            printf(" %10.2f", n / 2 * HANDOFFS / s / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t narenas = 8 * cores, max_threads = 16;
+    int c;
+    while ((c = getopt(argc, argv, "a:t:")) != EOF) {
+        switch (c) {
+        case 'a':
+            narenas = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            max_threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a arenas] [-t max_threads]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (max_threads < 2 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "max_threads must be from 2 to %d\n", MAX_THREADS);
+        exit(1);
+    }
+    if (mm_mt_init(narenas) < 0) {
+        fprintf(stderr, "mm_mt_init failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < max_threads; i++) {
+        slots[i] = calloc(SLOTS, sizeof(void *));
+    }
+    printf("%ld cores, %zu arenas\n\n", cores, narenas);
+    bench_larson(max_threads);
+    bench_handoff(max_threads);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * cache_bench - lookup latency of the proxy's object cache as the number of
+ * cached entries grows, and hit throughput of the sharded cache as the number
+ * of threads grows.
+ *
+ * The cache lives in proxy.c, which is linked in with its main renamed:
+ *     gcc -O2 -c -Dmain=proxy_main proxy.c
+ *     gcc -O2 -o cache_bench cache_bench.c proxy.o csapp.c -lpthread
+ */
+#include "proxy.h"
+#include <assert.h>
+
+#define LOOKUPS 1000000
+#define OBJECT_SIZE 16
+#define URL_LEN 64
+#define HOT_OBJECTS 4096
+#define MAX_THREADS 16
+
+static char (*hot_urls)[URL_LEN];
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+static void bench_lookup_latency(void) {
+    char content[OBJECT_SIZE] = {0};
+    printf("%10s %12s\n", "entries", "ns/lookup");
+    for (unsigned int n = 16; n <= 1 << 16; n <<= 2) {
+        struct cache c;
+        // entries are charged by their slab chunks, with room to spare
+        init_cache(&c, n * 4 * SLAB_MIN_CHUNK, OBJECT_SIZE);
+        init_slab(n * 4 * SLAB_MIN_CHUNK);
+        // urls are built up front to keep sprintf out of the timed loop
+        char (*urls)[URL_LEN] = Malloc(n * URL_LEN);
+        unsigned long *hashes = Malloc(n * sizeof(*hashes));
+        for (unsigned int i = 0; i < n; i++) {
+            sprintf(urls[i], "http://bench.local/object/%u", i);
+            hashes[i] = hash_url(urls[i]);
+            insert(new_entry(urls[i], content, OBJECT_SIZE), &c);
+        }
+
+        struct timespec start, end;
+        unsigned long hits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned long i = 0; i < LOOKUPS; i++) {
+            unsigned long j = (i * 7919) % n;
+            hits += get(urls[j], hashes[j], &c) != NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        assert(hits == LOOKUPS);
+        printf("%10u %12.1f\n", n, elapsed_ns(&start, &end) / LOOKUPS);
+
+        while (c.head) {
+            struct cache_entry *entry = c.head;
+            remove_entry(entry, &c);
+            release_entry(entry);
+        }
+        Free(c.buckets);
+        free_slab();
+        Free(urls);
+        Free(hashes);
+    }
+}
+
+static void *hit_thread(void *vargp) {
+    unsigned long seed = (unsigned long)vargp;
+    for (unsigned long i = 0; i < LOOKUPS; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        struct cache_entry *entry =
+            cache_get(hot_urls[(seed >> 33) % HOT_OBJECTS]);
+        if (!entry) {
+            app_error("expected a cache hit");
+        }
+        release_entry(entry);
+    }
+    return NULL;
+}
+
+static void bench_hit_throughput(void) {
+    char content[OBJECT_SIZE] = {0};
+    init_shards(2 * HOT_OBJECTS * SLAB_MAX_CHUNK * CACHE_SHARDS, OBJECT_SIZE);
+    hot_urls = Malloc(HOT_OBJECTS * URL_LEN);
+    for (unsigned int i = 0; i < HOT_OBJECTS; i++) {
+        sprintf(hot_urls[i], "http://bench.local/hot/%u", i);
+        cache_put(new_entry(hot_urls[i], content, OBJECT_SIZE));
+    }
+
+    printf("\n%10s %12s  (%ld cores)\n", "threads", "Mhits/s",
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (unsigned long n = 1; n <= MAX_THREADS; n <<= 1) {
+        pthread_t tids[MAX_THREADS];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned long i = 0; i < n; i++) {
+            Pthread_create(&tids[i], NULL, hit_thread, (void *)(i + 1));
+        }
+        for (unsigned long i = 0; i < n; i++) {
+            Pthread_join(tids[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%10lu %12.2f\n", n,
+               n * LOOKUPS / elapsed_ns(&start, &end) * 1e3);
+    }
+    Free(hot_urls);
+}
+
+int main(void) {
+    bench_lookup_latency();
+    bench_hit_throughput();
+    return 0;
+}
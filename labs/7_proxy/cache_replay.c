@@ -0,0 +1,219 @@
+/*
+ * cache_replay - replays an access log through the proxy's cache and reports
+ * the hit ratio and byte hit ratio of each admission and eviction policy.
+ *
+ * The log is either in Common Log Format, of which successful GETs count, or
+ * has one "url size" pair per line. Every request looks the url up in the
+ * cache, and a miss caches an object of the logged size, the same way the
+ * proxy caches a response after relaying it. Along with the hit ratios, the
+ * memory overhead per object is reported: what the slab spends on the
+ * objects cached at the end, beyond their content, divided by their number.
+ *     gcc -O2 -c -Dmain=proxy_main proxy.c
+ *     gcc -O2 -o cache_replay cache_replay.c proxy.o csapp.c -lpthread
+ *     ./cache_replay [-c capacity] [-m max_object_size] [-A policy]
+ *                    [-E policy] <log>
+ * Without -A or -E, every combination is replayed.
+ */
+#include "proxy.h"
+
+struct access {
+    char *url;
+    unsigned int size;
+};
+
+static struct access *accesses;
+static size_t naccesses;
+static char *body; // what every object holds
+
+// picks the url and size out of a log line, returns -1 if it does not count
+static int parse_access(char *line, char **url, unsigned long *size) {
+    char *request = strchr(line, '"');
+    if (!request) {
+        *url = strtok(line, " \t\n");
+        char *bytes = strtok(NULL, " \t\n");
+        if (!*url || !bytes) {
+            return -1;
+        }
+        *size = strtoul(bytes, NULL, 10);
+        return 0;
+    }
+    // host ident user [date] "GET url HTTP/1.0" status bytes
+    char *end = strchr(request + 1, '"');
+    if (!end) {
+        return -1;
+    }
+    *end = '\0';
+    char *method = strtok(request + 1, " ");
+    *url = strtok(NULL, " ");
+    int status;
+    if (!method || strcmp(method, "GET") || !*url ||
+        sscanf(end + 1, "%d %lu", &status, size) != 2 || status != 200) {
+        return -1;
+    }
+    return 0;
+}
+
+static void load_log(char *path) {
+    FILE *log = fopen(path, "r");
+    if (!log) {
+        unix_error("fopen error");
+    }
+    size_t cap = 1024;
+    accesses = Malloc(cap * sizeof(*accesses));
+    char line[MAXLINE];
+    while (fgets(line, sizeof(line), log)) {
+        char *url;
+        unsigned long size;
+        if (parse_access(line, &url, &size) < 0 || !size) {
+            continue;
+        }
+        if (naccesses == cap) {
+            cap *= 2;
+            accesses = Realloc(accesses, cap * sizeof(*accesses));
+        }
+        accesses[naccesses].url = strdup(url);
+        accesses[naccesses++].size = size;
+    }
+    fclose(log);
+}
+
+// empties the shards again, so the next policy starts out cold
+static void drain_shards(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache *cache = &shards[i].cache;
+        for (unsigned long b = 0; b < cache->nbuckets; b++) {
+            struct cache_entry *entry = cache->buckets[b];
+            while (entry) {
+                struct cache_entry *next = entry->bucket_next;
+                release_entry(entry);
+                entry = next;
+            }
+        }
+        Free(cache->buckets);
+        free(cache->heap);
+        free(cache->sketch);
+        pthread_rwlock_destroy(&shards[i].lock);
+    }
+    free_slab();
+}
+
+// counts the objects cached, and the slab bytes in use beyond their content
+static unsigned long overhead(unsigned long long *bytes) {
+    unsigned long objects = 0;
+    unsigned long long content = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache *cache = &shards[i].cache;
+        for (unsigned long b = 0; b < cache->nbuckets; b++) {
+            for (struct cache_entry *entry = cache->buckets[b]; entry;
+                 entry = entry->bucket_next) {
+                objects++;
+                content += entry->content_len;
+            }
+        }
+    }
+    *bytes = (unsigned long long)(slab.npages - slab.free_pages) * SLAB_PAGE -
+             content;
+    return objects;
+}
+
+static void replay(FILE *out, unsigned int capacity,
+                   unsigned int max_object_size) {
+    init_shards(capacity, max_object_size);
+    max_object_size = shards[0].cache.max_object_size;
+    unsigned long hits = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    for (size_t i = 0; i < naccesses; i++) {
+        struct access *a = &accesses[i];
+        bytes += a->size;
+        struct cache_entry *entry = cache_get(a->url);
+        if (entry) {
+            hits++;
+            hit_bytes += a->size;
+            release_entry(entry);
+        } else if (a->size <= max_object_size) {
+            struct cache_entry *entry = new_entry(a->url, body, a->size);
+            if (entry) {
+                cache_put(entry);
+            }
+        }
+    }
+    unsigned long long overhead_bytes;
+    unsigned long objects = overhead(&overhead_bytes);
+    drain_shards();
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s%s", cache_policy->name,
+             use_tinylfu ? "+tinylfu" : "");
+    fprintf(out, "%-16s %10zu %10.4f %15.4f %8lu %13.1f\n", name, naccesses,
+            (double)hits / naccesses, (double)hit_bytes / bytes, objects,
+            objects ? (double)overhead_bytes / objects : 0);
+}
+
+static void replay_usage(char *prog) {
+    fprintf(stderr,
+            "usage: %s [-c capacity] [-m max_object_size] [-A policy] "
+            "[-E policy] <log>\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    unsigned int capacity = 1 << 20, max_object_size = 100 * (1 << 10);
+    int admission = -1; // every one
+    const struct cache_policy *eviction = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "c:m:A:E:")) != EOF) {
+        switch (c) {
+        case 'c':
+            capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_object_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'A':
+            if (!strcmp(optarg, "all") || !strcmp(optarg, "tinylfu")) {
+                admission = !strcmp(optarg, "tinylfu");
+            } else {
+                replay_usage(argv[0]);
+            }
+            break;
+        case 'E':
+            if (!(eviction = find_policy(optarg))) {
+                replay_usage(argv[0]);
+            }
+            break;
+        default:
+            replay_usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || capacity < CACHE_SHARDS) {
+        replay_usage(argv[0]);
+    }
+    load_log(argv[optind]);
+    if (!naccesses) {
+        app_error("no requests in the log");
+    }
+    body = Calloc(max_object_size ? max_object_size : 1, 1);
+
+    // the cache reports evictions on stdout, which would drown the results
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!freopen("/dev/null", "w", stdout)) {
+        unix_error("freopen error");
+    }
+    fprintf(out, "%-16s %10s %10s %15s %8s %13s\n", "policy", "requests",
+            "hit ratio", "byte hit ratio", "objects", "overhead/obj");
+    size_t npolicies = sizeof(eviction_policies) / sizeof(*eviction_policies);
+    for (size_t i = 0; i < npolicies; i++) {
+        if (eviction && eviction != &eviction_policies[i]) {
+            continue;
+        }
+        cache_policy = &eviction_policies[i];
+        for (int tinylfu = 0; tinylfu <= 1; tinylfu++) {
+            if (admission < 0 || admission == tinylfu) {
+                use_tinylfu = tinylfu;
+                replay(out, capacity, max_object_size);
+            }
+        }
+    }
+    return 0;
+}
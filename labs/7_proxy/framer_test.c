@@ -0,0 +1,144 @@
+/*
+ * framer_test - checks where the proxy's origin response framer ends a
+ * response, and whether it lets the connection be pooled.
+ *
+ * Every response is fed in one go, a byte at a time and split in two at
+ * every point, with the bytes of a next response on the same connection
+ * after it, and each way has to stop at the same place in the same state:
+ *     gcc -g -fsanitize=address,undefined -c -Dmain=proxy_main proxy.c
+ *     gcc -g -fsanitize=address,undefined -o framer_test framer_test.c \
+ *         proxy.o csapp.c -lpthread
+ *     ./framer_test
+ */
+#include "proxy.h"
+
+// what comes after a response on a kept-alive connection
+#define NEXT "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"
+
+struct framer_case {
+    const char *name;
+    const char *response;
+    bool eof;          // the origin closes the connection after it
+    bool complete;     // the response ends, on its own or at the close
+    bool delimited;    // without the close
+    bool keep_alive;
+};
+
+static const struct framer_case cases[] = {
+    {"content-length", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+     false, true, true, true},
+    {"empty body", "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", false, true,
+     true, true},
+    {"http/1.0", "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nhi", false,
+     true, true, false},
+    {"http/1.0 keep-alive",
+     "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 2\r\n"
+     "\r\nhi",
+     false, true, true, true},
+    {"connection close",
+     "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nhi",
+     false, true, true, false},
+    {"bare newlines", "HTTP/1.1 200 OK\nContent-Length: 3\n\nabc", false,
+     true, true, true},
+    {"chunked",
+     "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+     "5\r\nhello\r\n1a;ext=1\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\n\r\n",
+     false, true, true, true},
+    {"chunked trailers",
+     "HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n"
+     "3\r\nabc\r\n0\r\nExpires: 0\r\nX-Checksum: 1\r\n\r\n",
+     false, true, true, true},
+    {"chunked over length",
+     "HTTP/1.1 200 OK\r\nContent-Length: 99\r\n"
+     "Transfer-Encoding: chunked\r\n\r\n2\r\nhi\r\n0\r\n\r\n",
+     false, true, true, true},
+    {"continue",
+     "HTTP/1.1 100 Continue\r\n\r\n"
+     "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok",
+     false, true, true, true},
+    {"no content", "HTTP/1.1 204 No Content\r\n\r\n", false, true, true,
+     true},
+    {"not modified",
+     "HTTP/1.1 304 Not Modified\r\nContent-Length: 100\r\n\r\n", false, true,
+     true, true},
+    {"until close", "HTTP/1.1 200 OK\r\n\r\nthe whole rest", true, true, false,
+     false},
+    {"cut short", "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nhello", true,
+     false, true, true},
+    {"cut short chunked",
+     "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel", true,
+     false, true, true},
+};
+
+static int failures;
+
+static void fail(const struct framer_case *c, const char *how,
+                 const char *what, long got, long want) {
+    fprintf(stderr, "%s, %s: %s is %ld, not %ld\n", c->name, how, what, got,
+            want);
+    failures++;
+}
+
+// feeds the response and what follows it in pieces that end at the splits
+static void check(const struct framer_case *c, const char *how,
+                  size_t *splits, size_t nsplits) {
+    static char stream[MAXBUF];
+    size_t len = strlen(c->response);
+    size_t total = c->eof ? len : len + strlen(NEXT);
+    memcpy(stream, c->response, len);
+    memcpy(stream + len, NEXT, total - len);
+
+    struct framer f;
+    framer_init(&f);
+    size_t used = 0, from = 0;
+    for (size_t i = 0; i <= nsplits; i++) {
+        size_t to = i < nsplits ? splits[i] : total;
+        // bytes after the end of the response are not consumed, and the
+        // relay hands them back for the next response
+        if (used == from) {
+            used += framer_feed(&f, stream + from, to - from);
+        }
+        from = to;
+    }
+    bool complete = c->eof ? framer_eof(&f) : f.state == FRAME_DONE;
+    if (complete != c->complete) {
+        fail(c, how, "complete", complete, c->complete);
+    }
+    if (c->complete && used != len) {
+        fail(c, how, "bytes used", used, len);
+    }
+    if (!c->complete && used != total) {
+        fail(c, how, "bytes used", used, total);
+    }
+    if (f.delimited != c->delimited) {
+        fail(c, how, "delimited", f.delimited, c->delimited);
+    }
+    if (f.keep_alive != c->keep_alive) {
+        fail(c, how, "keep_alive", f.keep_alive, c->keep_alive);
+    }
+    bool reusable = c->complete && c->delimited && c->keep_alive;
+    if (framer_reusable(&f) != reusable) {
+        fail(c, how, "reusable", framer_reusable(&f), reusable);
+    }
+}
+
+int main(void) {
+    static size_t splits[MAXBUF];
+    size_t ncases = sizeof(cases) / sizeof(*cases);
+    for (size_t i = 0; i < ncases; i++) {
+        const struct framer_case *c = &cases[i];
+        size_t total = strlen(c->response) + (c->eof ? 0 : strlen(NEXT));
+        check(c, "whole", NULL, 0);
+        for (size_t at = 1; at < total; at++) {
+            check(c, "split", &at, 1);
+            splits[at - 1] = at;
+        }
+        check(c, "bytewise", splits, total - 1);
+    }
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("%zu responses framed\n", ncases);
+    return 0;
+}
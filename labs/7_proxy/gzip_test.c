@@ -0,0 +1,183 @@
+/*
+ * gzip_test - round-trips bodies through the proxy's gzip compressor.
+ *
+ * Random bytes, text and long repeats of every size up to a few hundred KB
+ * are compressed with gzip_compress and have to come back the same from
+ * gzip_inflate and from gzip -d, which also checks the CRC. Text bodies
+ * cached compressed by compress_response have to come back the same from
+ * inflate_reply too, while entries it could not have made get a 500:
+ *     gcc -g -fsanitize=address,undefined -c -Dmain=proxy_main proxy.c
+ *     gcc -g -fsanitize=address,undefined -o gzip_test gzip_test.c proxy.o \
+ *         csapp.c -lpthread
+ *     ./gzip_test [bodies] [seed]
+ */
+#include "proxy.h"
+
+#define MAX_BODY (256 << 10)
+
+static const char *words[] = {
+    "the",   "proxy", "caches", "responses", "from", "origin", "servers",
+    "and",   "serves", "them",  "again",     "to",   "clients", "<div>",
+    "</div>", "{\"id\":", "},",  "\n",        "\t",   "HTTP/1.1", "200",
+};
+
+static unsigned long seed;
+
+static unsigned long next_random(void) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return seed >> 33;
+}
+
+// a body of len bytes of one of the kinds a cache sees
+static void make_body(char *body, size_t len, int kind) {
+    size_t nwords = sizeof(words) / sizeof(*words);
+    size_t n = 0;
+    switch (kind) {
+    case 0: // random bytes, which do not compress
+        for (n = 0; n < len; n++) {
+            body[n] = next_random();
+        }
+        break;
+    case 1: // text
+        while (n < len) {
+            const char *w = words[next_random() % nwords];
+            for (size_t i = 0; w[i] && n < len; i++) {
+                body[n++] = w[i];
+            }
+            if (n < len) {
+                body[n++] = ' ';
+            }
+        }
+        break;
+    default: // one byte over and over, so matches overlap what they copy
+        memset(body, 'a' + next_random() % 26, len);
+        break;
+    }
+}
+
+// whether gzip -d turns gz back into body
+static bool external_gunzip(char *gz, size_t gz_len, char *body, size_t len) {
+    char path[] = "/tmp/gzip_testXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || rio_writen(fd, gz, gz_len) != (ssize_t)gz_len) {
+        unix_error("mkstemp error");
+    }
+    Close(fd);
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "gzip -dc < %s", path);
+    FILE *p = popen(cmd, "r");
+    static char out[MAX_BODY + 1];
+    size_t n = fread(out, 1, sizeof(out), p);
+    bool same = !pclose(p) && n == len && !memcmp(out, body, len);
+    unlink(path);
+    return same;
+}
+
+// whether a hit on the compressed response inflates back to body
+static bool inflated_hit(char *body, size_t len) {
+    char *response = Malloc(len + 128);
+    size_t n = sprintf(response,
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\n"
+                       "\r\n",
+                       len);
+    memcpy(response + n, body, len);
+    n += len;
+    struct freshness f;
+    freshness_init(&f);
+    size_t variant_len;
+    char *variant = compress_response(response, n, &f, &variant_len);
+    Free(response);
+    if (!variant) {
+        return true; // kept as it is
+    }
+    struct cache_entry *entry =
+        new_entry("http://gzip.test/body", variant, variant_len);
+    Free(variant);
+    if (!entry) {
+        app_error("new_entry failed");
+    }
+    struct reply r;
+    inflate_reply(&r, entry);
+    release_entry(entry);
+    // the head gains Vary, so only the body has to be the same
+    char *hit_body = strstr(r.head, "\r\n\r\n") + 4;
+    bool same = r.head_len == (size_t)(hit_body - r.head) + len &&
+                !memcmp(hit_body, body, len);
+    Free(r.head);
+    return same;
+}
+
+// whether a hit on a compressed entry that is not well formed gets a 500
+static bool refused_hit(const char *content) {
+    char *copy = strdup(content);
+    struct cache_entry *entry =
+        new_entry("http://gzip.test/broken", copy, strlen(copy));
+    free(copy);
+    if (!entry) {
+        app_error("new_entry failed");
+    }
+    entry->compressed = true;
+    struct reply r;
+    inflate_reply(&r, entry);
+    release_entry(entry);
+    bool refused = !strncmp(r.head, "HTTP/1.1 500 ", 13) &&
+                   r.head_len == strlen(r.head);
+    Free(r.head);
+    return refused;
+}
+
+static const char *broken[] = {
+    "",
+    "HT",
+    "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc",
+    "HTTP/1.1 404 Not Found\r\nContent-Length: 20\r\n\r\n"
+    "01234567890123456789",
+    "HTTP/1.1 200 OK\r\nContent-Length: 20\r\n\r\n01234567890123456789",
+};
+
+int main(int argc, char **argv) {
+    long bodies = argc > 1 ? atol(argv[1]) : 300;
+    seed = argc > 2 ? atol(argv[2]) : time(NULL);
+    printf("seed %lu\n", seed);
+    init_shards(4 * MAX_BODY, MAX_BODY);
+    static char body[MAX_BODY], gz[2 * MAX_BODY + 64], out[MAX_BODY];
+    long failures = 0;
+    for (long b = 0; b < bodies; b++) {
+        int kind = b % 3;
+        // every size class from nothing up, small ones more often
+        size_t len = next_random() % (1UL << (next_random() % 19));
+        make_body(body, len, kind);
+        size_t gz_len = gzip_compress(body, len, gz, sizeof(gz));
+        const char *failed = NULL;
+        if (!gz_len) {
+            failed = "gzip_compress";
+        } else if (gzip_inflate(gz, gz_len, out, len) < 0 ||
+                   memcmp(out, body, len)) {
+            failed = "gzip_inflate";
+        } else if (!external_gunzip(gz, gz_len, body, len)) {
+            failed = "gzip -d";
+        } else if (kind && !inflated_hit(body, len)) {
+            failed = "inflate_reply";
+        }
+        if (failed) {
+            fprintf(stderr, "%s failed on body %ld, kind %d, %zu bytes\n",
+                    failed, b, kind, len);
+            failures++;
+        }
+    }
+    for (size_t i = 0; i < sizeof(broken) / sizeof(*broken); i++) {
+        if (!refused_hit(broken[i])) {
+            fprintf(stderr, "broken entry %zu was not refused\n", i);
+            failures++;
+        }
+    }
+    if (failures) {
+        fprintf(stderr, "%ld of %ld bodies failed\n", failures, bodies);
+        return 1;
+    }
+    printf("%ld bodies round-tripped\n", bodies);
+    return 0;
+}
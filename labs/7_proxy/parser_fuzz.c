@@ -0,0 +1,147 @@
+/*
+ * parser_fuzz - fuzzes the proxy's request parser.
+ *
+ * The parser is linked in from proxy.c compiled with its main renamed. With
+ * libFuzzer, LLVMFuzzerTestOneInput is the target:
+ *     clang -g -fsanitize=fuzzer,address -c -Dmain=proxy_main proxy.c
+ *     clang -g -fsanitize=fuzzer,address -DLIBFUZZER -o parser_fuzz \
+ *         parser_fuzz.c proxy.o csapp.c -lpthread
+ * Otherwise main mutates a few seed requests by itself, which is best run
+ * under the sanitizers:
+ *     gcc -g -fsanitize=address,undefined -c -Dmain=proxy_main proxy.c
+ *     gcc -g -fsanitize=address,undefined -o parser_fuzz parser_fuzz.c \
+ *         proxy.o csapp.c -lpthread
+ *     ./parser_fuzz [iterations] [seed]
+ *
+ * Every input is parsed in one go and again fed in piece by piece, which
+ * has to give the same result, and a complete head must only be sliced
+ * within itself. The header handling built on the parser runs on every head
+ * that parses.
+ */
+#include "proxy.h"
+
+static void check_slice(struct request *r, struct slice s) {
+    if (s.off + s.len > r->pos) {
+        fprintf(stderr, "slice %zu+%zu past the end of the head at %zu\n",
+                s.off, s.len, r->pos);
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+    const char *buf = (const char *)data;
+    struct request whole, pieces;
+    request_init(&whole);
+    int rc = parse_request(&whole, buf, size);
+
+    // split points follow from the input, so that failures reproduce
+    request_init(&pieces);
+    int piece_rc = 0;
+    size_t len = 0;
+    while (piece_rc == 0 && len < size) {
+        len += 1 + (len < size ? data[len] % 7 : 0);
+        len = len < size ? len : size;
+        piece_rc = parse_request(&pieces, buf, len);
+    }
+    if (piece_rc != rc || memcmp(&whole, &pieces, sizeof(whole))) {
+        fprintf(stderr, "parsing in pieces gave %d, in one go %d\n", piece_rc,
+                rc);
+        abort();
+    }
+    if (rc != 1) {
+        return 0;
+    }
+
+    check_slice(&whole, whole.method);
+    check_slice(&whole, whole.uri);
+    check_slice(&whole, whole.version);
+    for (int i = 0; i < whole.nheaders; i++) {
+        check_slice(&whole, whole.headers[i].name);
+        check_slice(&whole, whole.headers[i].value);
+    }
+    char uri[MAX_URL_LEN], out[MAXLINE];
+    struct headers hdr;
+    char *uri_path;
+    if (slice_copy(uri, sizeof(uri), buf, whole.uri) == 0 &&
+        (uri_path = uri_path_of(uri)) &&
+        scan_headers(&whole, buf, &hdr) == 0 &&
+        strlen(uri_path) + strlen(hdr.host) + 256 < sizeof(out)) {
+        client_keep_alive(&whole, buf, &hdr);
+        build_origin_request(out, uri_path, &hdr);
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+static const char *seeds[] = {
+    "GET http://localhost:8080/index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive, Upgrade\r\n"
+    "\r\n",
+    "GET / HTTP/1.0\r\n\r\n",
+    "\r\nGET http://example.com HTTP/1.1\nHost: example.com\n\n",
+    "POST http://example.com/form HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Content-Length: 3\r\n"
+    "Proxy-Connection: close\r\n"
+    "User-Agent: fuzz \t \r\n"
+    "\r\nabc",
+};
+
+// characters that move the parser between states
+static const char interesting[] = " \r\n:\t/,";
+
+static size_t mutate(char *buf, size_t len, size_t cap) {
+    int rounds = 1 + rand() % 4;
+    for (int i = 0; i < rounds; i++) {
+        size_t at = len ? rand() % len : 0;
+        switch (rand() % 5) {
+        case 0: // flip a byte
+            if (len) {
+                buf[at] ^= 1 << (rand() % 8);
+            }
+            break;
+        case 1: // insert a delimiter
+            if (len < cap) {
+                memmove(buf + at + 1, buf + at, len - at);
+                buf[at] = interesting[rand() % (sizeof(interesting) - 1)];
+                len++;
+            }
+            break;
+        case 2: // delete a byte
+            if (len) {
+                memmove(buf + at, buf + at + 1, len - at - 1);
+                len--;
+            }
+            break;
+        case 3: { // repeat a stretch, making lines and heads long
+            size_t n = rand() % 64;
+            n = at + n <= len ? n : len - at;
+            n = len + n <= cap ? n : cap - len;
+            memmove(buf + at + n, buf + at, len - at);
+            len += n;
+            break;
+        }
+        case 4: // cut it short
+            len = at;
+            break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    srand(argc > 2 ? atoi(argv[2]) : time(NULL));
+    static char buf[MAXLINE];
+    for (long i = 0; i < iterations; i++) {
+        const char *seed = seeds[rand() % (sizeof(seeds) / sizeof(*seeds))];
+        size_t len = strlen(seed);
+        memcpy(buf, seed, len);
+        len = mutate(buf, len, sizeof(buf));
+        LLVMFuzzerTestOneInput((unsigned char *)buf, len);
+    }
+    printf("%ld inputs parsed\n", iterations);
+    return 0;
+}
+#endif
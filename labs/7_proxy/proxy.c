@@ -1,70 +1,613 @@
-#include "csapp.h"
+#include "proxy.h"
 #include <assert.h>
+#include <ctype.h>
 #include <bits/pthreadtypes.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_URL_LEN 2048
+// normally from fcntl.h, but only with _GNU_SOURCE, see splice_fds
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#define SPLICE_F_MORE 4
+#endif
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
-struct headers {
-    char host[MAX_URL_LEN];
-    char const *user_agent;
-    char const *connection;
-    char const *proxy_connection;
+
+struct cache_shard shards[CACHE_SHARDS];
+struct slab slab;
+
+/*
+ * The optional disk tier is a file mapped into memory and written as a
+ * circular log: every cacheable response is appended as a record, and room
+ * for it is made by dropping the oldest records. The superblock keeps the
+ * ends of the log, so at startup the index is rebuilt by walking the log,
+ * and a record whose checksum does not match ends it. Hits are written out
+ * straight from the mapping, so they come from the page cache.
+ */
+struct disk_super {
+    char magic[8];
+    unsigned long capacity; // bytes for records
+    unsigned long head;     // where the next record goes
+    unsigned long tail;     // the oldest record
+    unsigned long used;
 };
 
-struct destination {
-    char *host;
-    char *port;
+// followed by the url, with its NUL, and the content
+struct disk_record {
+    unsigned int magic;
+    unsigned int url_len;
+    unsigned long content_len;
+    unsigned long checksum; // of the url and content
+    unsigned int delimited;
+    unsigned int compressed;
 };
 
-struct request {
-    char method[MAXLINE];
-    char uri[MAX_URL_LEN];
-    char *version;
+struct disk_entry {
+    unsigned long hash;
+    unsigned long off;
+    unsigned int refs; // views of it being written out
+    bool stale;        // a newer copy has been stored
+    time_t expires;    // as for cache entries, kept up to date in memory
+    atomic_bool revalidating; // for its views, which come and go
+    struct disk_entry *next;
 };
 
-struct cache_entry {
-    char *url;
-    void *content;
-    unsigned int content_len;
-    struct cache_entry *next;
-    struct cache_entry *prev;
+struct disk_tier {
+    pthread_mutex_t lock;
+    bool detached; // left to a new proxy, see disk_detach
+    char *map;
+    struct disk_super *super;
+    char *records;
+    size_t max_object_size;
+    struct disk_entry **buckets;
+    unsigned long nbuckets;
+    unsigned long nentries;
 };
-struct cache {
-    unsigned int capacity_bytes;
-    unsigned int used_bytes;
-    unsigned int max_object_size;
-    struct cache_entry *head;
-    struct cache_entry *tail;
+
+static struct disk_tier *disk; // NULL unless enabled
+
+// responses that cannot be cached are moved between sockets with splice
+static bool use_splice = true;
+// pooled origin connections are non-blocking, as the event loop uses them
+static bool pool_nonblocking = false;
+// limits for persistent client connections, which a reload may change
+static atomic_int client_idle_timeout = 15; /* seconds */
+static atomic_int max_client_requests = 100;
+// how long past its expiry an entry is served while it is revalidated
+static atomic_int stale_while_revalidate = 0; /* seconds */
+// compressible responses are cached gzip compressed
+static atomic_bool compress_cache = false;
+// set once a new proxy has taken over the listeners, see drain
+static atomic_bool draining = false;
+static int stop_fd = -1; // wakes the thread accepting clients for that
+static atomic_int open_clients; // client connections, which draining awaits
+
+/*
+ * Metrics. Every thread counts into a block of its own, which only it writes,
+ * so counting is a plain load and store that never contends. The admin port
+ * sums the blocks when it is scraped. When a thread exits, as the threaded
+ * server's connection threads do, its block is folded into retired_metrics.
+ */
+enum metric {
+    METRIC_REQUESTS,
+    METRIC_HITS,
+    METRIC_MISSES,
+    METRIC_COALESCED, // misses that followed another request's fetch
+    METRIC_EVICTIONS,
+    METRIC_REVALIDATIONS,
+    METRIC_CLIENT_BYTES_IN,
+    METRIC_CLIENT_BYTES_OUT,
+    METRIC_ORIGIN_BYTES_IN,
+    METRIC_ORIGIN_BYTES_OUT,
+    METRIC_ORIGIN_CONNECTS,
+    METRIC_LOG_DROPPED,
+    METRIC_SHED,
+    METRIC_COMPRESSED,
+    METRIC_COMPRESSION_SAVED,
+    METRIC_INFLATED,
+    METRIC_BAD_REQUESTS,
+    METRIC_CLIENT_ERRORS,
+    METRIC_ACCEPT_ERRORS,
+    METRIC_DNS_ERRORS,
+    METRIC_CONNECT_ERRORS,
+    METRIC_ORIGIN_ERRORS,
+    NMETRICS,
 };
 
-static struct cache cache;
-static sem_t cache_mutex;
+enum histogram {
+    HIST_REQUEST,
+    HIST_CONNECT,
+    NHISTOGRAMS,
+};
 
-void init_cache(struct cache *cache, unsigned int capacity,
-                unsigned int max_object_size) {
-    cache->capacity_bytes = capacity;
-    cache->used_bytes = 0;
-    cache->max_object_size = max_object_size;
-    cache->head = NULL;
-    cache->tail = NULL;
+struct metric_info {
+    const char *name;
+    const char *help;
+};
+
+static const struct metric_info metric_info[NMETRICS] = {
+    {"proxy_requests_total", "Requests served."},
+    {"proxy_cache_hits_total", "Requests served from the cache."},
+    {"proxy_cache_misses_total", "Requests fetched from the origin."},
+    {"proxy_cache_coalesced_total",
+     "Requests that followed a fetch of the same url."},
+    {"proxy_cache_evictions_total", "Entries evicted from memory."},
+    {"proxy_cache_revalidations_total", "Stale entries revalidated."},
+    {"proxy_client_received_bytes_total", "Request bytes from clients."},
+    {"proxy_client_sent_bytes_total", "Response bytes to clients."},
+    {"proxy_origin_received_bytes_total", "Response bytes from origins."},
+    {"proxy_origin_sent_bytes_total", "Request bytes to origins."},
+    {"proxy_origin_connects_total", "Connections opened to origins."},
+    {"proxy_access_log_dropped_total",
+     "Access log lines dropped because the writer fell behind."},
+    {"proxy_shed_connections_total",
+     "Connections turned away with a 503 as the accept queue was full."},
+    {"proxy_cache_compressed_total", "Responses cached gzip compressed."},
+    {"proxy_cache_compression_saved_bytes_total",
+     "Bytes compressing responses saved in the cache."},
+    {"proxy_cache_inflated_total",
+     "Hits on compressed entries decompressed for the client."},
+    {"proxy_client_bad_requests_total",
+     "Request heads that did not parse, or named no usable url."},
+    {"proxy_client_errors_total",
+     "Client connections that failed reading a request or writing a "
+     "response."},
+    {"proxy_accept_errors_total", "Client connections that failed to accept."},
+    {"proxy_origin_dns_errors_total", "Origin names that did not resolve."},
+    {"proxy_origin_connect_errors_total",
+     "Connections to origins that failed to open."},
+    {"proxy_origin_errors_total",
+     "Origin connections that failed writing a request or reading a "
+     "response."},
+};
+
+static const struct metric_info histogram_info[NHISTOGRAMS] = {
+    {"proxy_request_duration_seconds",
+     "Time from a request's head to the end of its response."},
+    {"proxy_origin_connect_duration_seconds",
+     "Time to connect to an origin."},
+};
+
+// bucket i counts durations of up to 2^i us, the last one any longer
+struct histogram_counts {
+    atomic_ulong buckets[HIST_BUCKETS];
+    atomic_ulong sum_us;
+};
+
+struct metrics {
+    atomic_ulong counters[NMETRICS];
+    struct histogram_counts histograms[NHISTOGRAMS];
+    unsigned long seed; // for sampling the access log
+    struct metrics *prev;
+    struct metrics *next;
+};
+
+static struct metrics *live_metrics;
+static struct metrics retired_metrics;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static __thread struct metrics *thread_metrics;
+
+unsigned long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// only the owning thread writes its block, so no atomic add is needed
+void add_relaxed(atomic_ulong *v, unsigned long n) {
+    atomic_store_explicit(
+        v, atomic_load_explicit(v, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+// adds the counts of m to into, under metrics_lock
+void metrics_fold(struct metrics *into, struct metrics *m) {
+    for (int i = 0; i < NMETRICS; i++) {
+        add_relaxed(&into->counters[i], atomic_load(&m->counters[i]));
+    }
+    for (int h = 0; h < NHISTOGRAMS; h++) {
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            add_relaxed(&into->histograms[h].buckets[i],
+                        atomic_load(&m->histograms[h].buckets[i]));
+        }
+        add_relaxed(&into->histograms[h].sum_us,
+                    atomic_load(&m->histograms[h].sum_us));
+    }
+}
+
+// runs as a thread exits
+void metrics_retire(void *arg) {
+    struct metrics *m = arg;
+    pthread_mutex_lock(&metrics_lock);
+    if (m->prev) {
+        m->prev->next = m->next;
+    } else {
+        live_metrics = m->next;
+    }
+    if (m->next) {
+        m->next->prev = m->prev;
+    }
+    metrics_fold(&retired_metrics, m);
+    pthread_mutex_unlock(&metrics_lock);
+    Free(m);
+}
+
+void metrics_create_key(void) {
+    pthread_key_create(&metrics_key, metrics_retire);
+}
+
+// the calling thread's block, made on first use
+struct metrics *my_metrics(void) {
+    struct metrics *m = thread_metrics;
+    if (m) {
+        return m;
+    }
+    pthread_once(&metrics_once, metrics_create_key);
+    m = Calloc(1, sizeof(*m));
+    m->seed = (unsigned long)m ^ monotonic_ns();
+    pthread_setspecific(metrics_key, m);
+    pthread_mutex_lock(&metrics_lock);
+    m->next = live_metrics;
+    if (live_metrics) {
+        live_metrics->prev = m;
+    }
+    live_metrics = m;
+    pthread_mutex_unlock(&metrics_lock);
+    return thread_metrics = m;
+}
+
+void metric_add(enum metric metric, unsigned long n) {
+    add_relaxed(&my_metrics()->counters[metric], n);
+}
+
+// what the calling thread has counted of metric so far
+unsigned long metric_own(enum metric metric) {
+    return atomic_load_explicit(&my_metrics()->counters[metric],
+                                memory_order_relaxed);
+}
+
+void metric_observe(enum histogram histogram, unsigned long ns) {
+    struct histogram_counts *h = &my_metrics()->histograms[histogram];
+    unsigned long us = ns / 1000;
+    int i = us <= 1 ? 0 : 64 - __builtin_clzl(us - 1);
+    add_relaxed(&h->buckets[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1], 1);
+    add_relaxed(&h->sum_us, us);
+}
+
+// writes every metric in the Prometheus text format
+void write_metrics(FILE *out) {
+    struct metrics total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&metrics_lock);
+    metrics_fold(&total, &retired_metrics);
+    for (struct metrics *m = live_metrics; m; m = m->next) {
+        metrics_fold(&total, m);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    for (int i = 0; i < NMETRICS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+                metric_info[i].name, metric_info[i].help, metric_info[i].name,
+                metric_info[i].name, atomic_load(&total.counters[i]));
+    }
+    for (int h = 0; h < NHISTOGRAMS; h++) {
+        const char *name = histogram_info[h].name;
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name,
+                histogram_info[h].help, name);
+        unsigned long count = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            count += atomic_load(&total.histograms[h].buckets[i]);
+            if (i < HIST_BUCKETS - 1) {
+                fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name,
+                        (1UL << i) / 1e6, count);
+            } else {
+                fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+            }
+        }
+        fprintf(out, "%s_sum %g\n%s_count %lu\n", name,
+                atomic_load(&total.histograms[h].sum_us) / 1e6, name, count);
+    }
+}
+
+/*
+ * The access log. A sampled request formats its line and copies it into a
+ * ring, and a thread of its own writes the ring out, so a slow disk never
+ * holds up a request. Lines that find the ring full are dropped and counted.
+ */
+static FILE *access_log; // NULL unless enabled
+static atomic_ulong access_log_sample = 1; // one in this many requests
+static char (*access_log_ring)[ACCESS_LOG_LINE];
+static unsigned long access_log_head, access_log_tail;
+static pthread_mutex_t access_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t access_log_queued = PTHREAD_COND_INITIALIZER;
+
+void access_log_push(const char *line) {
+    pthread_mutex_lock(&access_log_lock);
+    bool full = access_log_tail - access_log_head == ACCESS_LOG_RING;
+    if (!full) {
+        strcpy(access_log_ring[access_log_tail++ % ACCESS_LOG_RING], line);
+        pthread_cond_signal(&access_log_queued);
+    }
+    pthread_mutex_unlock(&access_log_lock);
+    if (full) {
+        metric_add(METRIC_LOG_DROPPED, 1);
+    }
+}
+
+void *access_log_thread(void *vargp) {
+    (void)vargp;
+    while (1) {
+        pthread_mutex_lock(&access_log_lock);
+        while (access_log_head == access_log_tail) {
+            pthread_cond_wait(&access_log_queued, &access_log_lock);
+        }
+        unsigned long head = access_log_head, tail = access_log_tail;
+        pthread_mutex_unlock(&access_log_lock);
+        // the lines up to tail stay put until head moves past them
+        for (; head != tail; head++) {
+            fputs(access_log_ring[head % ACCESS_LOG_RING], access_log);
+        }
+        fflush(access_log);
+        pthread_mutex_lock(&access_log_lock);
+        access_log_head = tail;
+        pthread_mutex_unlock(&access_log_lock);
+    }
+    return NULL;
+}
+
+void init_access_log(char *path) {
+    if (!(access_log = fopen(path, "a"))) {
+        unix_error("fopen error");
+    }
+    access_log_ring = Malloc(ACCESS_LOG_RING * sizeof(*access_log_ring));
+    pthread_t tid;
+    Pthread_create(&tid, NULL, access_log_thread, NULL);
+    Pthread_detach(tid);
+}
+
+// copies s to out as the inside of a JSON string, cut short to fit size
+void json_escape(char *out, size_t size, const char *s) {
+    size_t len = 0;
+    for (; *s && len + 7 < size; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out[len++] = '\\';
+            out[len++] = c;
+        } else if (c < 0x20) {
+            len += sprintf(out + len, "\\u%04x", c);
+        } else {
+            out[len++] = c;
+        }
+    }
+    out[len] = '\0';
+}
+
+enum cache_result {
+    CACHE_HIT,
+    CACHE_MISS,
+    CACHE_COALESCED,
+};
+
+// one request as it is served, for the metrics and the access log
+struct trace {
+    unsigned long start; // ns, 0 while no request is being served
+    char method[16];
+    enum cache_result cache;
+    int status;          // 0 if the response failed before it was known
+    unsigned long bytes; // sent to the client
+};
+
+// the status code at the start of a response
+int status_of(const char *buf, size_t len) {
+    char line[16];
+    len = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, buf, len);
+    line[len] = '\0';
+    int status;
+    return sscanf(line, "HTTP/1.%*d %d", &status) == 1 ? status : 0;
+}
+
+void trace_start(struct trace *t, const char *method, size_t method_len,
+                 size_t head_len) {
+    t->start = monotonic_ns();
+    snprintf(t->method, sizeof(t->method), "%.*s", (int)method_len, method);
+    t->cache = CACHE_MISS;
+    t->status = 0;
+    t->bytes = 0;
+    metric_add(METRIC_CLIENT_BYTES_IN, head_len);
+}
+
+void trace_end(struct trace *t, const char *url) {
+    static const char *results[] = {"hit", "miss", "coalesced"};
+    static const enum metric result_metrics[] = {METRIC_HITS, METRIC_MISSES,
+                                                 METRIC_COALESCED};
+    unsigned long ns = monotonic_ns() - t->start;
+    t->start = 0;
+    metric_add(METRIC_REQUESTS, 1);
+    metric_add(result_metrics[t->cache], 1);
+    metric_observe(HIST_REQUEST, ns);
+    if (!access_log) {
+        return;
+    }
+    struct metrics *m = my_metrics();
+    m->seed = m->seed * 6364136223846793005UL + 1442695040888963407UL;
+    if ((m->seed >> 33) %
+        atomic_load_explicit(&access_log_sample, memory_order_relaxed)) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char method[sizeof(t->method) * 6], escaped[ACCESS_LOG_LINE / 2];
+    json_escape(method, sizeof(method), t->method);
+    json_escape(escaped, sizeof(escaped), url);
+    char line[ACCESS_LOG_LINE];
+    snprintf(line, sizeof(line),
+             "{\"time\":%ld.%03ld,\"method\":\"%s\",\"url\":\"%s\","
+             "\"status\":%d,\"cache\":\"%s\",\"bytes\":%lu,"
+             "\"duration_us\":%lu}\n",
+             (long)now.tv_sec, now.tv_nsec / 1000000, method, escaped,
+             t->status, results[t->cache], t->bytes, ns / 1000);
+    access_log_push(line);
+}
+
+/*
+ * Listening sockets: the proxy's own, for a new proxy to take over, and
+ * those it took over from an old one, see hand_over.
+ */
+static int *listeners; // ours, in the order they were opened
+static int nlisteners;
+static int *inherited; // from the old proxy, until they are taken
+static int ninherited;
+
+// the port a listener is bound to
+int listener_port(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (SA *)&addr, &len) < 0) {
+        return -1;
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    }
+    return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+}
+
+void add_listener(int fd) {
+    listeners = Realloc(listeners, (nlisteners + 1) * sizeof(*listeners));
+    listeners[nlisteners++] = fd;
+}
+
+// an inherited listener on port, or -1 if there is none left
+int take_listener(int port) {
+    for (int i = 0; i < ninherited; i++) {
+        int fd = inherited[i];
+        if (listener_port(fd) == port) {
+            inherited[i] = inherited[--ninherited];
+            add_listener(fd);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The admin port only listens on the loopback interface. It answers
+ * GET /metrics, one request per connection.
+ */
+int open_admin_listenfd(int port) {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0), optval = 1;
+    if (listenfd < 0) {
+        return -1;
+    }
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+void serve_admin(int fd) {
+    struct timeval timeout = {.tv_sec = 5};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    char line[MAXLINE], method[16], path[256];
+    if (rio_readlineb(&rio, line, MAXLINE) <= 0 ||
+        sscanf(line, "%15s %255s", method, path) != 2) {
+        close(fd);
+        return;
+    }
+    while (rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n")) {
+    }
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+    if (!strcmp(method, "GET") && !strcmp(path, "/metrics")) {
+        fprintf(out, "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "\r\n");
+        write_metrics(out);
+    } else {
+        fprintf(out, "HTTP/1.0 404 Not Found\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "\r\n"
+                     "Not found, try /metrics\n");
+    }
+    fclose(out);
+}
+
+void *admin_thread(void *vargp) {
+    int listenfd = (int)(long)vargp;
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd >= 0) {
+            serve_admin(fd);
+        }
+    }
+    return NULL;
+}
+
+void init_admin(int port) {
+    long listenfd = take_listener(port);
+    if (listenfd < 0) {
+        if ((listenfd = open_admin_listenfd(port)) < 0) {
+            unix_error("open_admin_listenfd error");
+        }
+        add_listener(listenfd);
+    }
+    pthread_t tid;
+    Pthread_create(&tid, NULL, admin_thread, (void *)listenfd);
+    Pthread_detach(tid);
+}
+
+#define INITIAL_BUCKETS 64
+
+// FNV-1a
+unsigned long hash_url(char *url) {
+    unsigned long hash = 14695981039346656037UL;
+    for (unsigned char *c = (unsigned char *)url; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211UL;
+    }
+    return hash;
 }
 
 void move_up(struct cache_entry *entry, struct cache *cache) {
@@ -89,217 +632,5843 @@ void move_up(struct cache_entry *entry, struct cache *cache) {
         cache->head = entry;
     }
 }
-void free_entry(struct cache_entry *entry) {
-    free(entry->url);
-    free(entry->content);
-    free(entry);
-}
-struct cache_entry *new_entry(char *url, void *content, size_t content_len) {
-    struct cache_entry *entry = Malloc(sizeof(*entry));
-    entry->url = Malloc(strlen(url));
-    strcpy(entry->url, url);
-    entry->content = Malloc(content_len);
-    memcpy(entry->content, content, content_len);
-    entry->content_len = content_len;
-    entry->next = NULL;
+
+void list_push(struct cache_entry **head, struct cache_entry **tail,
+               struct cache_entry *entry) {
     entry->prev = NULL;
-    return entry;
+    entry->next = *head;
+    if (*head) {
+        (*head)->prev = entry;
+    } else {
+        *tail = entry;
+    }
+    *head = entry;
 }
-void insert(struct cache_entry *entry, struct cache *cache) {
-    assert(entry);
-    assert(entry->content_len <= cache->max_object_size);
-    assert(entry->content_len <= cache->capacity_bytes);
-    if (!cache->head) {
-        puts("Empty cache, inserting first object");
-        // no head means empty.
-        // this means the entry is the new tail and head
-        cache->head = entry;
-        cache->tail = entry;
-        cache->used_bytes += entry->content_len;
-        assert(cache->head);
-        assert(cache->tail);
-        return;
+
+void list_unlink(struct cache_entry **head, struct cache_entry **tail,
+                 struct cache_entry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        *head = entry->next;
     }
-    while (cache->used_bytes + entry->content_len > cache->capacity_bytes) {
-        puts("Reducing cache size");
-        cache->used_bytes -= cache->tail->content_len;
-        struct cache_entry *old_tail = cache->tail;
-        cache->tail = old_tail->prev;
-        cache->tail->next = NULL;
-        free_entry(old_tail);
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        *tail = entry->prev;
     }
-    cache->head->prev = entry;
-    entry->next = cache->head;
-    cache->head = entry;
-    assert(cache->head);
-    assert(cache->tail);
 }
 
-struct cache_entry *get(char *url, struct cache *cache) {
-    for (struct cache_entry *entry = cache->head; entry; entry = entry->next) {
-        if (!strcmp(entry->url, url)) {
-            move_up(entry, cache);
-            V(&cache_mutex);
-            return entry;
-        }
+// counts hits up to max, which is all the precision the policies need
+void count_hit(struct cache_entry *entry, unsigned int max) {
+    unsigned int freq =
+        atomic_load_explicit(&entry->freq, memory_order_relaxed);
+    if (freq < max) {
+        atomic_store_explicit(&entry->freq, freq + 1, memory_order_relaxed);
     }
-    return NULL;
 }
 
-int parse_request(char *request_line, struct request *out) {
-    char ignored[MAXLINE];
-    int num = sscanf(request_line, "%s %s %s", out->method, out->uri, ignored);
-    return num;
+/*
+ * LRU, approximated the way CLOCK does. Hits only set the entry's referenced
+ * bit, and eviction gives referenced entries at the tail a second chance at
+ * the head.
+ */
+void lru_add(struct cache *cache, struct cache_entry *entry) {
+    list_push(&cache->head, &cache->tail, entry);
 }
 
-void parse_host(char *host_header, struct destination *out) {
-    out->host = strtok(host_header, ":");
-    char *port = strtok(NULL, ":");
-    out->port = port ? port : "80";
+void lru_remove(struct cache *cache, struct cache_entry *entry) {
+    list_unlink(&cache->head, &cache->tail, entry);
 }
 
-void read_requesthdr(rio_t *rio, struct headers *hdr) {
-    char buf[MAXLINE];
-    Rio_readlineb(rio, buf, MAXLINE);
+struct cache_entry *lru_victim(struct cache *cache) {
+    while (atomic_exchange(&cache->tail->referenced, false)) {
+        // hit since it was last looked at, give it another round
+        move_up(cache->tail, cache);
+    }
+    return cache->tail;
+}
 
-    while (strcmp(buf, "\r\n")) {
-        sscanf(buf, "Host: %s", hdr->host);
-        Rio_readlineb(rio, buf, MAXLINE);
+void lru_hit(struct cache_entry *entry) {
+    // only written when it changes to keep hot entries from bouncing between
+    // cores
+    if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
     }
-    if (!*hdr->host) {
-        strcpy(hdr->host, "www.cs.cmu.com");
+}
+
+/*
+ * GreedyDual-Size-Frequency. An entry is worth L + hits / size, where L is
+ * the worth of the last entry evicted, so small and frequently hit objects
+ * stay while entries that stop getting hits age out as L rises. The cheapest
+ * entry is found with a min-heap. Hits only count, so an entry's worth is
+ * brought up to date lazily, once it reaches the top of the heap.
+ */
+double gdsf_worth(struct cache *cache, struct cache_entry *entry) {
+    unsigned int freq =
+        atomic_load_explicit(&entry->freq, memory_order_relaxed);
+    return cache->inflation +
+           (double)freq / (entry->content_len ? entry->content_len : 1);
+}
+
+void heap_swap(struct cache *cache, unsigned int i, unsigned int j) {
+    struct cache_entry *entry = cache->heap[i];
+    cache->heap[i] = cache->heap[j];
+    cache->heap[j] = entry;
+    cache->heap[i]->heap_index = i;
+    cache->heap[j]->heap_index = j;
+}
+
+void heap_sift(struct cache *cache, unsigned int i) {
+    while (i > 0 && cache->heap[i]->worth < cache->heap[(i - 1) / 2]->worth) {
+        heap_swap(cache, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        unsigned int min = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < cache->nheap &&
+            cache->heap[left]->worth < cache->heap[min]->worth) {
+            min = left;
+        }
+        if (right < cache->nheap &&
+            cache->heap[right]->worth < cache->heap[min]->worth) {
+            min = right;
+        }
+        if (min == i) {
+            return;
+        }
+        heap_swap(cache, i, min);
+        i = min;
     }
-    hdr->connection = "close";
-    hdr->proxy_connection = "close";
-    hdr->user_agent = user_agent_hdr;
 }
 
-void forward(int clientfd) {
-    // read request headers
-    // if no host header, attach www.cmu.edu host header
-    // always attach user-agent: <user_agent_hdr>
-    // always attach connection: close
-    // always attach proxy-connection: close
-    // forward request as http/1.0 to server
-    // forward server response to client
-    char client_buf[MAXLINE], from_server_buf[MAXLINE], to_server_buf[MAXLINE];
-    rio_t client_rio, server_rio;
-    rio_readinitb(&client_rio, clientfd);
-    if (rio_readlineb(&client_rio, client_buf, MAXLINE) < 0) {
-        printf("Error while reading request from client: %s\n",
-               strerror(errno));
-        close(clientfd);
-        return;
+void gdsf_add(struct cache *cache, struct cache_entry *entry) {
+    if (cache->nheap == cache->heap_cap) {
+        cache->heap_cap = cache->heap_cap ? 2 * cache->heap_cap : 64;
+        cache->heap =
+            Realloc(cache->heap, cache->heap_cap * sizeof(*cache->heap));
     }
-    struct request request;
-    if (parse_request(client_buf, &request) != 3) {
-        printf("invalid format: %s", client_buf);
-        Close(clientfd);
-        return;
+    atomic_store_explicit(&entry->freq, 1, memory_order_relaxed);
+    entry->worth_freq = 1;
+    entry->worth = gdsf_worth(cache, entry);
+    entry->heap_index = cache->nheap;
+    cache->heap[cache->nheap++] = entry;
+    heap_sift(cache, entry->heap_index);
+}
+
+void gdsf_remove(struct cache *cache, struct cache_entry *entry) {
+    unsigned int i = entry->heap_index;
+    heap_swap(cache, i, --cache->nheap);
+    if (i < cache->nheap) {
+        heap_sift(cache, i);
     }
-    P(&cache_mutex);
-    struct cache_entry *entry = get(request.uri, &cache);
-    V(&cache_mutex);
-    if (entry) {
-        puts("Cached entry found!");
-        rio_writen(clientfd, entry->content, entry->content_len);
-        close(clientfd);
-        return;
+}
+
+struct cache_entry *gdsf_victim(struct cache *cache) {
+    while (1) {
+        struct cache_entry *top = cache->heap[0];
+        unsigned int freq =
+            atomic_load_explicit(&top->freq, memory_order_relaxed);
+        if (freq == top->worth_freq) {
+            return top;
+        }
+        // hit since it was placed, so it sinks to where it belongs now
+        top->worth_freq = freq;
+        top->worth = gdsf_worth(cache, top);
+        heap_sift(cache, 0);
     }
+}
 
-    char *uri_path = strchr(request.uri, '/');
-    uri_path = strchr(uri_path + 1, '/');
-    uri_path = strchr(uri_path + 1, '/');
-    request.version = "HTTP/1.0";
-    struct headers hdr;
-    memset(&hdr, 0, sizeof(hdr));
-    read_requesthdr(&client_rio, &hdr);
+void gdsf_hit(struct cache_entry *entry) {
+    atomic_fetch_add_explicit(&entry->freq, 1, memory_order_relaxed);
+}
 
-    struct destination dest;
-    parse_host(hdr.host, &dest);
-    int serverfd = open_clientfd(dest.host, dest.port);
-    if (serverfd < 0) {
-        printf("Error connecting to %s on port %s: %s\n", dest.host, dest.port,
-               strerror(errno));
-        close(clientfd);
-        return;
+void gdsf_evict(struct cache *cache, struct cache_entry *entry) {
+    cache->inflation = entry->worth;
+    gdsf_remove(cache, entry);
+}
+
+/*
+ * S3-FIFO. New entries go through a small FIFO that holds a tenth of the
+ * bytes, and only those hit while in it move on to the main FIFO, so objects
+ * that are requested once leave quickly. The main FIFO reinserts entries
+ * that were hit, as CLOCK does. Recently evicted one-hit entries are
+ * remembered in a ghost ring, and go straight to main if they come back.
+ */
+bool ghost_contains(struct cache *cache, unsigned long hash) {
+    for (int i = 0; i < GHOST_ENTRIES; i++) {
+        if (cache->ghost[i] == hash) {
+            return true;
+        }
     }
+    return false;
+}
 
-    puts("FROM CLIENT TO SERVER");
-    sprintf(to_server_buf,
-            "GET %s HTTP/1.0\r\n"
-            "Host: %s\r\n"
-            "Connection: close\r\n"
-            "Proxy-Connection: close\r\n"
-            "User-Agent: %s\r\n"
-            "\r\n",
-            uri_path, hdr.host, user_agent_hdr);
-    printf("%s", to_server_buf);
-    if (rio_writen(serverfd, to_server_buf, strlen(to_server_buf)) < 0) {
-        printf("Failed to write complete request to server: %s\n",
-               strerror(errno));
-        close(serverfd);
-        close(clientfd);
+void s3fifo_add(struct cache *cache, struct cache_entry *entry) {
+    atomic_store_explicit(&entry->freq, 0, memory_order_relaxed);
+    entry->small = !ghost_contains(cache, entry->hash);
+    if (entry->small) {
+        list_push(&cache->small_head, &cache->small_tail, entry);
+        cache->small_bytes += entry->size;
+    } else {
+        list_push(&cache->head, &cache->tail, entry);
     }
+}
 
-    rio_readinitb(&server_rio, serverfd);
-    int read;
-    while ((read = rio_readnb(&server_rio, from_server_buf, MAXLINE)) != 0) {
-        if (read <= cache.max_object_size) {
-            P(&cache_mutex);
-            struct cache_entry *entry =
-                new_entry(request.uri, from_server_buf, read);
-            insert(entry, &cache);
-            V(&cache_mutex);
-        }
-        if (rio_writen(clientfd, from_server_buf, read) < 0) {
-            printf("Failed to write complete server response to client: %s\n",
-                   strerror(errno));
-            close(serverfd);
-            close(clientfd);
-            return;
-        }
+void s3fifo_remove(struct cache *cache, struct cache_entry *entry) {
+    if (entry->small) {
+        list_unlink(&cache->small_head, &cache->small_tail, entry);
+        cache->small_bytes -= entry->size;
+    } else {
+        list_unlink(&cache->head, &cache->tail, entry);
     }
+}
 
-    puts("Request complete");
+struct cache_entry *s3fifo_victim(struct cache *cache) {
+    while (1) {
+        struct cache_entry *entry;
+        if (cache->small_tail &&
+            (cache->small_bytes > cache->capacity_bytes / 10 || !cache->tail)) {
+            entry = cache->small_tail;
+            if (!atomic_load_explicit(&entry->freq, memory_order_relaxed)) {
+                return entry;
+            }
+            s3fifo_remove(cache, entry);
+            entry->small = false;
+            list_push(&cache->head, &cache->tail, entry);
+        } else {
+            entry = cache->tail;
+            unsigned int freq =
+                atomic_load_explicit(&entry->freq, memory_order_relaxed);
+            if (!freq) {
+                return entry;
+            }
+            move_up(entry, cache);
+        }
+        atomic_store_explicit(&entry->freq, 0, memory_order_relaxed);
+    }
+}
 
-    close(serverfd);
-    close(clientfd);
+void s3fifo_hit(struct cache_entry *entry) {
+    count_hit(entry, 3);
 }
 
-void sigchld_handler(int sig) {
-    while (waitpid(-1, 0, WNOHANG) > 0) {
+void s3fifo_evict(struct cache *cache, struct cache_entry *entry) {
+    if (entry->small) {
+        cache->ghost[cache->ghost_next++ % GHOST_ENTRIES] = entry->hash;
     }
-    return;
+    s3fifo_remove(cache, entry);
 }
 
-void *forward_thread(void *vargp) {
-    int clientfd = *(int *)vargp;
-    Free(vargp);
-    Pthread_detach(pthread_self());
-    forward(clientfd);
+const struct cache_policy eviction_policies[EVICTION_POLICIES] = {
+    {"lru", lru_add, lru_remove, lru_victim, lru_remove, lru_hit},
+    {"gdsf", gdsf_add, gdsf_remove, gdsf_victim, gdsf_evict, gdsf_hit},
+    {"s3fifo", s3fifo_add, s3fifo_remove, s3fifo_victim, s3fifo_evict,
+     s3fifo_hit},
+};
+
+const struct cache_policy *find_policy(char *name) {
+    for (size_t i = 0;
+         i < sizeof(eviction_policies) / sizeof(*eviction_policies); i++) {
+        if (!strcmp(eviction_policies[i].name, name)) {
+            return &eviction_policies[i];
+        }
+    }
     return NULL;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage; %s <port>\n", argv[0]);
+/*
+ * TinyLFU admission. Every lookup is counted in a count-min sketch of 4-bit
+ * counters, which are halved every SKETCH_SAMPLE lookups so that the counts
+ * follow what is popular now. When the cache is full, a new entry is only
+ * admitted if it has been asked for more often than the entry it would
+ * evict, so a scan of objects that are requested once cannot flush the hot
+ * set. Counting races with other readers and may lose the odd increment.
+ */
+unsigned int sketch_index(unsigned long hash, int row) {
+    unsigned long h = (hash + row) * 0x9E3779B97F4A7C15UL;
+    return (h >> 32) & (SKETCH_WIDTH - 1);
+}
+
+void sketch_record(struct frequency_sketch *sketch, unsigned long hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        atomic_uchar *counter = &sketch->counters[row][sketch_index(hash, row)];
+        unsigned char n = atomic_load_explicit(counter, memory_order_relaxed);
+        if (n < 15) {
+            atomic_store_explicit(counter, n + 1, memory_order_relaxed);
+        }
     }
-    int listenfd = Open_listenfd(argv[1]);
-    sigset_t mask;
-    Sigemptyset(&mask);
-    Sigaddset(&mask, SIGPIPE);
-    Sigprocmask(SIG_BLOCK, &mask, NULL);
-    Signal(SIGCHLD, sigchld_handler);
-    init_cache(&cache, 1 << 20, 100 * (1 << 10));
+    if (atomic_fetch_add_explicit(&sketch->additions, 1,
+                                  memory_order_relaxed) +
+            1 ==
+        SKETCH_SAMPLE) {
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            for (int i = 0; i < SKETCH_WIDTH; i++) {
+                atomic_uchar *counter = &sketch->counters[row][i];
+                atomic_store_explicit(
+                    counter,
+                    atomic_load_explicit(counter, memory_order_relaxed) / 2,
+                    memory_order_relaxed);
+            }
+        }
+        atomic_store_explicit(&sketch->additions, 0, memory_order_relaxed);
+    }
+}
 
-    pthread_t tid;
-    sem_init(&cache_mutex, 0, 1);
+unsigned int sketch_estimate(struct frequency_sketch *sketch,
+                             unsigned long hash) {
+    unsigned int min = 15;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned int n = atomic_load_explicit(
+            &sketch->counters[row][sketch_index(hash, row)],
+            memory_order_relaxed);
+        min = n < min ? n : min;
+    }
+    return min;
+}
+
+void slab_resize(size_t budget);
+
+// sets up an empty slab, its budget set with slab_resize
+void init_slab(size_t budget) {
+    pthread_mutex_init(&slab.lock, NULL);
+    // the budget can grow in place, so chunks never move
+    slab.base = mmap(NULL, SLAB_RESERVE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slab.base == MAP_FAILED) {
+        unix_error("mmap error");
+    }
+    slab.npages = 0;
+    slab.limit = 0;
+    slab.pages = NULL;
+    slab.free_page = -1;
+    atomic_init(&slab.free_pages, 0);
+    slab.nclasses = 0;
+    unsigned int size = SLAB_MIN_CHUNK;
     while (1) {
-        struct sockaddr_storage clientaddr;
-        unsigned clientlen = sizeof(clientaddr);
-        int *connfdp = Malloc(sizeof(*connfdp));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, forward_thread, connfdp);
+        size = size < SLAB_MAX_CHUNK ? size : SLAB_MAX_CHUNK;
+        struct slab_class *class = &slab.classes[slab.nclasses++];
+        class->size = size;
+        class->chunks = SLAB_PAGE / size;
+        class->partial = -1;
+        if (size == SLAB_MAX_CHUNK) {
+            break;
+        }
+        size = (size * 5 / 4 + 15) & ~15; // a multiple of 16
+    }
+    slab.chunks = 0;
+    slab.chunk_bytes = 0;
+    slab_resize(budget);
+}
+
+void free_slab(void) {
+    munmap(slab.base, SLAB_RESERVE);
+    Free(slab.pages);
+    pthread_mutex_destroy(&slab.lock);
+}
+
+void partial_push(struct slab_class *class, long page) {
+    slab.pages[page].prev = -1;
+    slab.pages[page].next = class->partial;
+    if (class->partial >= 0) {
+        slab.pages[class->partial].prev = page;
+    }
+    class->partial = page;
+}
+
+void partial_unlink(struct slab_class *class, long page) {
+    struct slab_page *p = &slab.pages[page];
+    if (p->prev >= 0) {
+        slab.pages[p->prev].next = p->next;
+    } else {
+        class->partial = p->next;
+    }
+    if (p->next >= 0) {
+        slab.pages[p->next].prev = p->prev;
+    }
+}
+
+/*
+ * Sets the budget. Growing it maps more of the reserve. Shrinking it gives
+ * the free pages past it back to the kernel at once, and the pages in use
+ * there once they empty, while new chunks only come from pages within it.
+ */
+void slab_resize(size_t budget) {
+    unsigned long limit = (budget + SLAB_PAGE - 1) / SLAB_PAGE;
+    assert(limit <= SLAB_RESERVE / SLAB_PAGE);
+    pthread_mutex_lock(&slab.lock);
+    if (limit > slab.npages) {
+        if (mprotect(slab.base + slab.npages * SLAB_PAGE,
+                     (limit - slab.npages) * SLAB_PAGE,
+                     PROT_READ | PROT_WRITE) < 0) {
+            unix_error("mprotect error");
+        }
+        slab.pages = Realloc(slab.pages, limit * sizeof(*slab.pages));
+        for (unsigned long i = slab.npages; i < limit; i++) {
+            slab.pages[i].class = -2;
+        }
+        slab.npages = limit;
+    }
+    // the free pages are stacked anew, the lowest on top, and only pages
+    // within the budget are partial
+    slab.free_page = -1;
+    unsigned long free_pages = 0;
+    for (long i = slab.npages - 1; i >= 0; i--) {
+        struct slab_page *p = &slab.pages[i];
+        bool inside = (unsigned long)i < limit;
+        bool was_inside = (unsigned long)i < slab.limit;
+        if (p->class >= 0 && p->used < slab.classes[p->class].chunks &&
+            inside != was_inside) {
+            if (inside) {
+                partial_push(&slab.classes[p->class], i);
+            } else {
+                partial_unlink(&slab.classes[p->class], i);
+            }
+        } else if (p->class == -1 && !inside) {
+            madvise(slab.base + i * SLAB_PAGE, SLAB_PAGE, MADV_DONTNEED);
+            p->class = -2;
+        } else if (p->class < 0 && inside) {
+            p->class = -1;
+            p->next = slab.free_page;
+            slab.free_page = i;
+            free_pages++;
+        }
+    }
+    atomic_store(&slab.free_pages, free_pages);
+    slab.limit = limit;
+    pthread_mutex_unlock(&slab.lock);
+}
+
+// cuts a free page into chunks of the class
+void carve_page(int class) {
+    struct slab_class *sc = &slab.classes[class];
+    long page = slab.free_page;
+    struct slab_page *p = &slab.pages[page];
+    slab.free_page = p->next;
+    atomic_fetch_sub_explicit(&slab.free_pages, 1, memory_order_relaxed);
+    char *base = slab.base + page * SLAB_PAGE;
+    p->class = class;
+    p->used = 0;
+    p->free = NULL;
+    for (int i = sc->chunks - 1; i >= 0; i--) {
+        *(void **)(base + i * sc->size) = p->free;
+        p->free = base + i * sc->size;
+    }
+    partial_push(sc, page);
+}
+
+/*
+ * Returns a chunk of at least size bytes, which must not be more than
+ * SLAB_MAX_CHUNK, and stores how large it really is in chunk_size. Returns
+ * NULL once the budget is used up.
+ */
+void *slab_alloc(size_t size, unsigned int *chunk_size) {
+    assert(size <= SLAB_MAX_CHUNK);
+    pthread_mutex_lock(&slab.lock);
+    int class = 0;
+    while (slab.classes[class].size < size) {
+        class++;
+    }
+    struct slab_class *sc = &slab.classes[class];
+    if (sc->partial < 0 && slab.free_page >= 0) {
+        carve_page(class);
+    }
+    void *chunk = NULL;
+    if (sc->partial >= 0) {
+        struct slab_page *p = &slab.pages[sc->partial];
+        chunk = p->free;
+        p->free = *(void **)chunk;
+        if (++p->used == sc->chunks) {
+            partial_unlink(sc, sc->partial);
+        }
+        *chunk_size = sc->size;
+        slab.chunks++;
+        slab.chunk_bytes += sc->size;
+    }
+    pthread_mutex_unlock(&slab.lock);
+    return chunk;
+}
+
+void slab_free(void *chunk) {
+    pthread_mutex_lock(&slab.lock);
+    long page = ((char *)chunk - slab.base) / SLAB_PAGE;
+    struct slab_page *p = &slab.pages[page];
+    struct slab_class *sc = &slab.classes[p->class];
+    slab.chunks--;
+    slab.chunk_bytes -= sc->size;
+    bool inside = (unsigned long)page < slab.limit;
+    if (p->used-- == sc->chunks && inside) {
+        partial_push(sc, page);
+    }
+    if (p->used) {
+        *(void **)chunk = p->free;
+        p->free = chunk;
+    } else if (!inside) {
+        // the budget has shrunk since the page was carved, and the page
+        // was left off the partial list to drain
+        madvise(slab.base + page * SLAB_PAGE, SLAB_PAGE, MADV_DONTNEED);
+        p->class = -2;
+    } else {
+        partial_unlink(sc, page);
+        p->class = -1;
+        p->next = slab.free_page;
+        slab.free_page = page;
+        atomic_fetch_add_explicit(&slab.free_pages, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&slab.lock);
+}
+
+// freshness after RFC 9111, as laid out with struct freshness in proxy.h
+void freshness_init(struct freshness *f) {
+    memset(f, 0, sizeof(*f));
+    f->max_age = -1;
+}
+
+// parses an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT", 0 if not one
+time_t parse_http_date(const char *value) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    char month[4];
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, month,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return 0;
+    }
+    char *m = strstr(months, month);
+    if (strlen(month) != 3 || !m || (m - months) % 3) {
+        return 0;
+    }
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    time_t t = timegm(&tm);
+    return t > 0 ? t : 0;
+}
+
+void scan_cache_control(struct freshness *f, char *value) {
+    char *save;
+    for (char *d = strtok_r(value, ",", &save); d;
+         d = strtok_r(NULL, ",", &save)) {
+        d += strspn(d, " \t");
+        if (!strncasecmp(d, "s-maxage=", 9)) {
+            f->max_age = atol(d + 9);
+            f->shared_max_age = true;
+        } else if (!strncasecmp(d, "max-age=", 8) && !f->shared_max_age) {
+            f->max_age = atol(d + 8);
+        } else if (!strncasecmp(d, "no-store", 8) ||
+                   !strncasecmp(d, "private", 7)) {
+            f->no_store = true;
+        } else if (!strncasecmp(d, "no-cache", 8)) {
+            f->no_cache = true;
+        } else if (!strncasecmp(d, "must-revalidate", 15) ||
+                   !strncasecmp(d, "proxy-revalidate", 16)) {
+            f->must_revalidate = true;
+        } else if (!strncasecmp(d, "no-transform", 12)) {
+            f->no_transform = true;
+        }
+    }
+}
+
+bool field_is(const char *name, size_t len, const char *field) {
+    return len == strlen(field) && !strncasecmp(name, field, len);
+}
+
+void scan_freshness_field(struct freshness *f, const char *name, size_t len,
+                          char *value) {
+    if (field_is(name, len, "Cache-Control")) {
+        scan_cache_control(f, value);
+    } else if (field_is(name, len, "Expires")) {
+        f->expires = parse_http_date(value);
+        f->expires = f->expires ? f->expires : 1;
+    } else if (field_is(name, len, "Date")) {
+        f->date = parse_http_date(value);
+    } else if (field_is(name, len, "Age")) {
+        f->age = atol(value);
+    } else if (field_is(name, len, "Last-Modified")) {
+        f->last_modified = parse_http_date(value);
+        snprintf(f->last_modified_value, sizeof(f->last_modified_value), "%s",
+                 value);
+    } else if (field_is(name, len, "ETag")) {
+        snprintf(f->etag, sizeof(f->etag), "%s", value);
+    }
+}
+
+/*
+ * Picks what freshness depends on out of the response head at the start of
+ * a stored response. Scanning another head into the same f, such as that of
+ * a 304, updates what it sends.
+ */
+void scan_freshness(const char *head, size_t len, struct freshness *f) {
+    if (len < 5 || strncmp(head, "HTTP/", 5)) {
+        return;
+    }
+    const char *end = head + len;
+    const char *line = memchr(head, '\n', len); // past the status line
+    while (line && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            break;
+        }
+        size_t n = eol - line;
+        while (n && isspace((unsigned char)line[n - 1])) {
+            n--;
+        }
+        if (!n) {
+            break;
+        }
+        const char *colon = memchr(line, ':', n);
+        if (colon) {
+            const char *v = colon + 1 + strspn(colon + 1, " \t");
+            char value[256];
+            if (v < line + n) {
+                snprintf(value, sizeof(value), "%.*s", (int)(line + n - v), v);
+                scan_freshness_field(f, line, colon - line, value);
+            }
+        }
+        line = eol;
+    }
+}
+
+// when a response received at now goes stale, 0 if it never does
+time_t freshness_expiry(struct freshness *f, time_t now) {
+    time_t date = f->date ? f->date : now;
+    long lifetime;
+    if (f->no_cache) {
+        lifetime = 0;
+    } else if (f->max_age >= 0) {
+        lifetime = f->max_age;
+    } else if (f->expires) {
+        lifetime = f->expires - date;
+    } else if (f->last_modified && f->last_modified < date) {
+        lifetime = (date - f->last_modified) / 10;
+        lifetime = lifetime < HEURISTIC_MAX_AGE ? lifetime : HEURISTIC_MAX_AGE;
+    } else {
+        return 0;
+    }
+    long age = now > date ? now - date : 0;
+    age = age > f->age ? age : f->age;
+    time_t expires = now + lifetime - age;
+    return expires > 0 ? expires : 1;
+}
+
+// the expiry of a stored response, or of a response just received
+time_t response_expiry(const char *content, size_t len) {
+    struct freshness f;
+    freshness_init(&f);
+    scan_freshness(content, len, &f);
+    return freshness_expiry(&f, time(NULL));
+}
+
+bool entry_fresh(struct cache_entry *entry, time_t now) {
+    time_t expires =
+        atomic_load_explicit(&entry->expires, memory_order_relaxed);
+    return !expires || now < expires;
+}
+
+unsigned long hash_bytes(unsigned long hash, const void *data, size_t len) {
+    for (const unsigned char *c = data; len--; c++) {
+        hash ^= *c;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+struct disk_record *record_at(unsigned long off) {
+    return (struct disk_record *)(disk->records + off);
+}
+
+char *record_url(struct disk_record *rec) {
+    return (char *)(rec + 1);
+}
+
+char *record_content(struct disk_record *rec) {
+    return record_url(rec) + rec->url_len;
+}
+
+unsigned long record_size(size_t url_len, size_t content_len) {
+    size_t size = sizeof(struct disk_record) + url_len + content_len;
+    return (size + DISK_ALIGN - 1) & ~(DISK_ALIGN - 1);
+}
+
+unsigned long record_checksum(struct disk_record *rec) {
+    unsigned long hash = hash_bytes(14695981039346656037UL, record_url(rec),
+                                    rec->url_len);
+    return hash_bytes(hash, record_content(rec), rec->content_len);
+}
+
+struct disk_entry **disk_bucket(unsigned long hash) {
+    return &disk->buckets[hash & (disk->nbuckets - 1)];
+}
+
+// adds the record at off to the index, where it hides older copies
+void disk_index(unsigned long off, time_t expires) {
+    char *url = record_url(record_at(off));
+    unsigned long hash = hash_url(url);
+    struct disk_entry **bucket = disk_bucket(hash);
+    for (struct disk_entry *e = *bucket; e; e = e->next) {
+        if (e->hash == hash && !e->stale &&
+            !strcmp(record_url(record_at(e->off)), url)) {
+            e->stale = true;
+        }
+    }
+    struct disk_entry *e = Calloc(1, sizeof(*e));
+    e->hash = hash;
+    e->off = off;
+    e->expires = expires;
+    e->next = *bucket;
+    *bucket = e;
+    disk->nentries++;
+}
+
+// drops the oldest record, returns -1 if a view of it is being written out
+int disk_drop_tail(void) {
+    struct disk_super *super = disk->super;
+    struct disk_record *rec = record_at(super->tail);
+    unsigned long size = super->capacity - super->tail;
+    if (rec->magic == DISK_RECORD) {
+        size = record_size(rec->url_len, rec->content_len);
+        struct disk_entry **link = disk_bucket(hash_url(record_url(rec)));
+        while (*link && (*link)->off != super->tail) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            struct disk_entry *e = *link;
+            if (e->refs) {
+                return -1;
+            }
+            *link = e->next;
+            Free(e);
+            disk->nentries--;
+        }
+    }
+    super->tail = (super->tail + size) % super->capacity;
+    super->used -= size;
+    return 0;
+}
+
+// frees size bytes at the head, returns -1 if a pinned record is in the way
+int disk_make_room(unsigned long size) {
+    struct disk_super *super = disk->super;
+    while (1) {
+        if (!super->used) {
+            super->head = super->tail = 0;
+        }
+        if (super->tail < super->head || !super->used) {
+            // free from the head to the end, and from the start to the tail
+            if (super->capacity - super->head >= size) {
+                return 0;
+            }
+            record_at(super->head)->magic = DISK_WRAP;
+            super->used += super->capacity - super->head;
+            super->head = 0;
+        } else if (super->tail - super->head >= size) {
+            return 0;
+        } else if (disk_drop_tail() < 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Appends a copy of the response to the log. Objects larger than an eighth
+ * of the log are not kept, so that one cannot flush out all the others.
+ */
+void disk_put(char *url, void *content, size_t content_len, bool delimited,
+              bool compressed, time_t expires) {
+    size_t url_len = strlen(url) + 1;
+    unsigned long size = record_size(url_len, content_len);
+    if (content_len > disk->max_object_size) {
+        return;
+    }
+    pthread_mutex_lock(&disk->lock);
+    struct disk_super *super = disk->super;
+    if (!disk->detached && disk_make_room(size) == 0) {
+        struct disk_record *rec = record_at(super->head);
+        rec->magic = 0; // until it is complete
+        rec->url_len = url_len;
+        rec->content_len = content_len;
+        rec->delimited = delimited;
+        rec->compressed = compressed;
+        memcpy(record_url(rec), url, url_len);
+        memcpy(record_content(rec), content, content_len);
+        rec->checksum = record_checksum(rec);
+        rec->magic = DISK_RECORD;
+        disk_index(super->head, expires);
+        super->head = (super->head + size) % super->capacity;
+        super->used += size;
+    }
+    pthread_mutex_unlock(&disk->lock);
+}
+
+void disk_unpin(struct disk_entry *e) {
+    pthread_mutex_lock(&disk->lock);
+    e->refs--;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+// the record has been revalidated, the log itself is left as it is
+void disk_refresh(struct disk_entry *e, time_t expires) {
+    pthread_mutex_lock(&disk->lock);
+    e->expires = expires;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+// returns a pinned view of the newest copy of url, or NULL
+struct cache_entry *disk_get(char *url, unsigned long hash) {
+    pthread_mutex_lock(&disk->lock);
+    struct disk_entry *e = disk->detached ? NULL : *disk_bucket(hash);
+    while (e && (e->stale || e->hash != hash ||
+                 strcmp(record_url(record_at(e->off)), url))) {
+        e = e->next;
+    }
+    time_t expires = 0;
+    if (e) {
+        e->refs++;
+        expires = e->expires;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    if (!e) {
+        return NULL;
+    }
+    struct disk_record *rec = record_at(e->off);
+    struct cache_entry *view = Calloc(1, sizeof(*view));
+    view->url = record_url(rec);
+    view->hash = hash;
+    view->content_len = rec->content_len;
+    view->mapped = record_content(rec);
+    view->disk = e;
+    view->delimited = rec->delimited;
+    view->compressed = rec->compressed;
+    atomic_init(&view->expires, expires);
+    atomic_init(&view->refs, 1);
+    return view;
+}
+
+/*
+ * Stops using the disk tier, so that a new proxy can open it, see hand_over.
+ * Views already pinned go on being written out, though should the new proxy
+ * wrap around the log onto them meanwhile, they are overwritten.
+ */
+void disk_detach(void) {
+    pthread_mutex_lock(&disk->lock);
+    disk->detached = true;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+// rebuilds the index from the log, which ends at the first broken record
+void disk_rebuild(void) {
+    struct disk_super *super = disk->super;
+    unsigned long off = super->tail, walked = 0;
+    while (walked < super->used) {
+        struct disk_record *rec = record_at(off);
+        unsigned long size = super->capacity - off;
+        if (rec->magic != DISK_WRAP) {
+            if (rec->magic != DISK_RECORD || size < sizeof(*rec) ||
+                !rec->url_len || rec->url_len > MAX_URL_LEN ||
+                rec->content_len > size ||
+                record_size(rec->url_len, rec->content_len) > size ||
+                record_url(rec)[rec->url_len - 1] ||
+                rec->checksum != record_checksum(rec)) {
+                super->head = off;
+                super->used = walked;
+                break;
+            }
+            size = record_size(rec->url_len, rec->content_len);
+            // a record without a Date counts as received now
+            disk_index(off, response_expiry(record_content(rec),
+                                            rec->content_len));
+        }
+        walked += size;
+        off = (off + size) % super->capacity;
+    }
+}
+
+// whether the superblock describes a log of this capacity
+bool disk_super_valid(struct disk_super *super, unsigned long capacity) {
+    return !memcmp(super->magic, DISK_MAGIC, sizeof(super->magic)) &&
+           super->capacity == capacity && super->head < capacity &&
+           super->tail < capacity && !(super->head % DISK_ALIGN) &&
+           !(super->tail % DISK_ALIGN) && super->used <= capacity;
+}
+
+// maps the log at path, formatting it unless it holds one of this capacity
+void disk_open(char *path, unsigned long capacity, size_t max_object_size) {
+    capacity &= ~(unsigned long)(DISK_ALIGN - 1);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        unix_error("disk_open error");
+    }
+    bool fresh = st.st_size != (off_t)(DISK_HEADER + capacity);
+    if (fresh && ftruncate(fd, DISK_HEADER + capacity) < 0) {
+        unix_error("ftruncate error");
+    }
+    char *map = mmap(NULL, DISK_HEADER + capacity, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        unix_error("mmap error");
+    }
+    Close(fd);
+
+    disk = Calloc(1, sizeof(*disk));
+    pthread_mutex_init(&disk->lock, NULL);
+    disk->map = map;
+    disk->super = (struct disk_super *)map;
+    disk->records = map + DISK_HEADER;
+    disk->max_object_size = capacity / 8 < max_object_size ? capacity / 8
+                                                           : max_object_size;
+    disk->nbuckets = 256;
+    while (disk->nbuckets < capacity / (16 << 10)) {
+        disk->nbuckets *= 2;
+    }
+    disk->buckets = Calloc(disk->nbuckets, sizeof(*disk->buckets));
+    struct disk_super *super = disk->super;
+    if (fresh || !disk_super_valid(super, capacity)) {
+        memset(super, 0, sizeof(*super));
+        memcpy(super->magic, DISK_MAGIC, sizeof(super->magic));
+        super->capacity = capacity;
+    }
+    disk_rebuild();
+    printf("Disk tier %s: %lu objects in %lu bytes\n", path, disk->nentries,
+           super->used);
+}
+
+// set from the command line before the cache is set up
+const struct cache_policy *cache_policy = &eviction_policies[0];
+bool use_tinylfu = false;
+
+void init_cache(struct cache *cache, unsigned int capacity,
+                unsigned int max_object_size) {
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity_bytes = capacity;
+    cache->max_object_size = max_object_size;
+    cache->policy = cache_policy;
+    if (use_tinylfu) {
+        cache->sketch = Calloc(1, sizeof(*cache->sketch));
+    }
+    cache->nbuckets = INITIAL_BUCKETS;
+    cache->buckets = Calloc(cache->nbuckets, sizeof(*cache->buckets));
+}
+
+struct cache_entry **bucket_of(unsigned long hash, struct cache *cache) {
+    // nbuckets is always a power of two
+    return &cache->buckets[hash & (cache->nbuckets - 1)];
+}
+
+void grow_buckets(struct cache *cache) {
+    struct cache_entry **old = cache->buckets;
+    unsigned long old_nbuckets = cache->nbuckets;
+    cache->nbuckets *= 2;
+    cache->buckets = Calloc(cache->nbuckets, sizeof(*cache->buckets));
+    for (unsigned long i = 0; i < old_nbuckets; i++) {
+        struct cache_entry *entry = old[i];
+        while (entry) {
+            struct cache_entry *next = entry->bucket_next;
+            struct cache_entry **bucket = bucket_of(entry->hash, cache);
+            entry->bucket_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    Free(old);
+}
+
+struct cache_entry *find(char *url, unsigned long hash, struct cache *cache) {
+    for (struct cache_entry *entry = *bucket_of(hash, cache); entry;
+         entry = entry->bucket_next) {
+        if (entry->hash == hash && !strcmp(entry->url, url)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void free_entry(struct cache_entry *entry) {
+    if (entry->mapped) {
+        if (entry->disk) {
+            disk_unpin(entry->disk);
+        } else {
+            Free(entry->mapped);
+        }
+        Free(entry);
+        return;
+    }
+    for (unsigned int i = 0; entry->chained && i < entry->npieces; i++) {
+        slab_free(entry->pieces[i]);
+    }
+    slab_free(entry);
+}
+void pin_entry(struct cache_entry *entry) {
+    atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+}
+void release_entry(struct cache_entry *entry) {
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1) {
+        free_entry(entry);
+    }
+}
+
+// unlinks entry from the hash table, the policy has let go of it already
+void unlink_entry(struct cache_entry *entry, struct cache *cache) {
+    struct cache_entry **link = bucket_of(entry->hash, cache);
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    cache->used_bytes -= entry->size;
+    cache->nentries--;
+}
+
+void remove_entry(struct cache_entry *entry, struct cache *cache) {
+    cache->policy->remove(cache, entry);
+    unlink_entry(entry, cache);
+}
+
+/*
+ * Whether TinyLFU lets an object of size bytes in at the expense of the next
+ * victim. The cache counts as full once either the shard or the slab is.
+ */
+bool admit(unsigned long hash, size_t size, struct cache *cache) {
+    if (!cache->sketch || !cache->nentries ||
+        (cache->used_bytes + size <= cache->capacity_bytes &&
+         atomic_load_explicit(&slab.free_pages, memory_order_relaxed))) {
+        return true;
+    }
+    struct cache_entry *victim = cache->policy->victim(cache);
+    return sketch_estimate(cache->sketch, hash) >
+           sketch_estimate(cache->sketch, victim->hash);
+}
+
+// evicts the entry the policy picks, the cache must not be empty
+void evict(struct cache *cache) {
+    struct cache_entry *victim = cache->policy->victim(cache);
+    metric_add(METRIC_EVICTIONS, 1);
+    cache->policy->evict(cache, victim);
+    unlink_entry(victim, cache);
+    release_entry(victim);
+}
+
+/*
+ * Takes over the caller's reference to entry. Returns whether the entry was
+ * cached; one that does not fit is released right away.
+ */
+bool insert(struct cache_entry *entry, struct cache *cache) {
+    assert(entry);
+    // the limits may have shrunk since the caller checked, see resize_cache
+    if (entry->content_len > cache->max_object_size ||
+        entry->size > cache->capacity_bytes) {
+        release_entry(entry);
+        return false;
+    }
+    struct cache_entry *old = find(entry->url, entry->hash, cache);
+    if (old) {
+        // a newer copy replaces the old one
+        remove_entry(old, cache);
+        release_entry(old);
+    }
+    while (cache->used_bytes + entry->size > cache->capacity_bytes) {
+        evict(cache);
+    }
+    cache->policy->add(cache, entry);
+    cache->used_bytes += entry->size;
+
+    if (++cache->nentries > cache->nbuckets) {
+        grow_buckets(cache);
+    }
+    struct cache_entry **bucket = bucket_of(entry->hash, cache);
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    return true;
+}
+
+// safe to call with only a read lock on the cache
+struct cache_entry *get(char *url, unsigned long hash, struct cache *cache) {
+    if (cache->sketch) {
+        sketch_record(cache->sketch, hash);
+    }
+    struct cache_entry *entry = find(url, hash, cache);
+    if (entry) {
+        cache->policy->hit(entry);
+    }
+    return entry;
+}
+
+/*
+ * Every shard gets an equal part of the capacity, and no object may be larger
+ * than a shard. The slab holds the whole capacity.
+ */
+void init_shards(unsigned int capacity, unsigned int max_object_size) {
+    unsigned int shard_capacity = capacity / CACHE_SHARDS;
+    if (max_object_size > shard_capacity) {
+        max_object_size = shard_capacity;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        init_cache(&shards[i].cache, shard_capacity, max_object_size);
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+    init_slab(capacity);
+}
+
+struct cache_shard *shard_of(unsigned long hash) {
+    // the low bits pick the bucket within the shard
+    return &shards[(hash >> 32) % CACHE_SHARDS];
+}
+
+// evicts an entry from shard to free slab memory, if it has any
+bool shard_evict(struct cache_shard *shard) {
+    pthread_rwlock_wrlock(&shard->lock);
+    bool evicted = shard->cache.nentries > 0;
+    if (evicted) {
+        evict(&shard->cache);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return evicted;
+}
+
+/*
+ * The shards charge entries by the size of their chunks and together never
+ * use more than the slab holds, but partly used pages and entries still
+ * pinned by readers can leave the slab without a chunk to fit. The shards
+ * then evict in turn, starting with the one hash belongs to, until one
+ * fits. Returns NULL if none does even with every shard empty.
+ */
+void *cache_alloc(size_t size, unsigned long hash, unsigned int *chunk_size) {
+    size_t start = shard_of(hash) - shards;
+    void *chunk;
+    int empty = 0; // shards in a row with nothing left to evict
+    for (size_t i = start; !(chunk = slab_alloc(size, chunk_size)); i++) {
+        if (shard_evict(&shards[i % CACHE_SHARDS])) {
+            empty = 0;
+        } else if (++empty == CACHE_SHARDS) {
+            return NULL;
+        }
+    }
+    return chunk;
+}
+
+bool cache_admits(unsigned long hash, size_t size) {
+    struct cache_shard *shard = shard_of(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    bool admitted = admit(hash, size, &shard->cache);
+    pthread_rwlock_unlock(&shard->lock);
+    return admitted;
+}
+
+/*
+ * Changes the capacity and largest object of the running cache, splitting
+ * them over the shards as init_shards does. Shards over their new capacity
+ * evict down to it at once.
+ */
+void resize_cache(unsigned int capacity, unsigned int max_object_size) {
+    unsigned int shard_capacity = capacity / CACHE_SHARDS;
+    if (max_object_size > shard_capacity) {
+        max_object_size = shard_capacity;
+    }
+    // the slab always has room for what the shards may hold
+    bool grow = capacity > slab.limit * SLAB_PAGE;
+    if (grow) {
+        slab_resize(capacity);
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache *cache = &shards[i].cache;
+        pthread_rwlock_wrlock(&shards[i].lock);
+        cache->capacity_bytes = shard_capacity;
+        cache->max_object_size = max_object_size;
+        while (cache->used_bytes > cache->capacity_bytes) {
+            evict(cache);
+        }
+        pthread_rwlock_unlock(&shards[i].lock);
+    }
+    if (!grow) {
+        slab_resize(capacity);
+    }
+}
+
+// hands every entry of cache over to another policy, and admission with it
+void cache_set_policy(struct cache *cache, const struct cache_policy *policy,
+                      bool tinylfu) {
+    // LRU and S3-FIFO share lists, so all entries leave before any comes in
+    const struct cache_policy *old = cache->policy;
+    for (int pass = 0; policy != old && pass < 2; pass++) {
+        for (unsigned long b = 0; b < cache->nbuckets; b++) {
+            for (struct cache_entry *entry = cache->buckets[b]; entry;
+                 entry = entry->bucket_next) {
+                if (pass == 0) {
+                    old->remove(cache, entry);
+                } else {
+                    policy->add(cache, entry);
+                }
+            }
+        }
+    }
+    cache->policy = policy;
+    if (tinylfu && !cache->sketch) {
+        cache->sketch = Calloc(1, sizeof(*cache->sketch));
+    } else if (!tinylfu && cache->sketch) {
+        free(cache->sketch);
+        cache->sketch = NULL;
+    }
+}
+
+/*
+ * Copies url and content into a new entry, with a reference for the caller.
+ * Admission is decided here, before making room for the entry, and NULL is
+ * returned for one that is not admitted or does not fit. The head chunk
+ * must hold the whole url and table of pieces.
+ */
+struct cache_entry *new_entry(char *url, void *content, size_t content_len) {
+    size_t url_len = strlen(url) + 1;
+    unsigned long hash = hash_url(url);
+    unsigned int npieces = (content_len + SLAB_MAX_CHUNK - 1) / SLAB_MAX_CHUNK;
+    size_t head = sizeof(struct cache_entry) + npieces * sizeof(char *) +
+                  url_len;
+    if (head > SLAB_MAX_CHUNK || !cache_admits(hash, head + content_len)) {
+        return NULL;
+    }
+    bool chained = head + content_len > SLAB_MAX_CHUNK;
+    unsigned int chunk_size;
+    struct cache_entry *entry =
+        cache_alloc(head + (chained ? 0 : content_len), hash, &chunk_size);
+    if (!entry) {
+        return NULL;
+    }
+    entry->pieces = (char **)(entry + 1);
+    entry->npieces = 0;
+    entry->chained = chained;
+    entry->url = (char *)(entry->pieces + npieces);
+    memcpy(entry->url, url, url_len);
+    entry->size = chunk_size;
+    entry->mapped = NULL;
+    entry->disk = NULL;
+    for (size_t off = 0; off < content_len; off += SLAB_MAX_CHUNK) {
+        size_t len = content_len - off < SLAB_MAX_CHUNK ? content_len - off
+                                                        : SLAB_MAX_CHUNK;
+        char *piece = chained ? cache_alloc(len, hash, &chunk_size)
+                              : entry->url + url_len;
+        if (!piece) {
+            free_entry(entry);
+            return NULL;
+        }
+        memcpy(piece, (char *)content + off, len);
+        entry->pieces[entry->npieces++] = piece;
+        entry->size += chained ? chunk_size : 0;
+    }
+    entry->hash = hash;
+    entry->content_len = content_len;
+    entry->delimited = false;
+    entry->compressed = false;
+    atomic_init(&entry->expires, 0);
+    atomic_init(&entry->revalidating, false);
+    atomic_init(&entry->referenced, false);
+    atomic_init(&entry->freq, 0);
+    atomic_init(&entry->refs, 1); // the cache's reference
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->bucket_next = NULL;
+    entry->small = false;
+    entry->worth = 0;
+    entry->worth_freq = 0;
+    entry->heap_index = 0;
+    return entry;
+}
+
+/*
+ * Wraps a response that is not cached in an entry of its own, to be served
+ * once like a hit. The entry takes over content, which must come from
+ * Malloc, and is not in the cache.
+ */
+struct cache_entry *uncached_entry(char *url, char *content,
+                                   size_t content_len, bool delimited) {
+    size_t url_len = strlen(url) + 1;
+    struct cache_entry *entry = Calloc(1, sizeof(*entry) + url_len);
+    entry->url = memcpy(entry + 1, url, url_len);
+    entry->hash = hash_url(url);
+    entry->content_len = content_len;
+    entry->mapped = content;
+    entry->delimited = delimited;
+    atomic_init(&entry->refs, 1);
+    return entry;
+}
+
+// points iov at the content from off up to end, returns the vectors used
+int entry_iov(struct cache_entry *entry, size_t off, size_t end,
+              struct iovec *iov, int max) {
+    if (entry->mapped) {
+        iov->iov_base = entry->mapped + off;
+        iov->iov_len = end - off;
+        return off < end && max > 0;
+    }
+    int n = 0;
+    for (; off < end && n < max; n++) {
+        size_t in = off % SLAB_MAX_CHUNK;
+        size_t len =
+            end - off < SLAB_MAX_CHUNK - in ? end - off : SLAB_MAX_CHUNK - in;
+        iov[n].iov_base = entry->pieces[off / SLAB_MAX_CHUNK] + in;
+        iov[n].iov_len = len;
+        off += len;
+    }
+    return n;
+}
+
+// copies the content from off up to end to buf
+void entry_copy(struct cache_entry *entry, size_t off, size_t end, char *buf) {
+    struct iovec iov[ENTRY_IOV];
+    while (off < end) {
+        int n = entry_iov(entry, off, end, iov, ENTRY_IOV);
+        for (int i = 0; i < n; i++) {
+            memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+            buf += iov[i].iov_len;
+            off += iov[i].iov_len;
+        }
+    }
+}
+
+// copies the start of the content, which holds the response head, to buf
+size_t entry_head(struct cache_entry *entry, char *buf, size_t size) {
+    size_t len = entry->content_len < size ? entry->content_len : size;
+    entry_copy(entry, 0, len, buf);
+    return len;
+}
+
+/*
+ * A gzip codec for the responses cached compressed. It goes for speed, as
+ * LZ4 does, rather than for the ratio zlib gets: a match is looked for only
+ * where the last 4 bytes were seen that hash the same, with no chains to
+ * search, and it all goes into one deflate block with the fixed Huffman
+ * codes, so no code tables are built. Clients decode it as any gzip.
+ */
+static const unsigned short length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short dist_base[30] = {
+    1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+    33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+void crc_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+unsigned int gzip_crc32(const unsigned char *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    unsigned int c = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+        c = crc_table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffff;
+}
+
+// deflate's bit stream, filled from the least significant bit of each byte
+struct bit_writer {
+    unsigned char *out;
+    size_t len;
+    size_t max; // past this, the output is given up on
+    unsigned long bits;
+    int nbits;
+};
+
+void put_bits(struct bit_writer *w, unsigned long value, int n) {
+    w->bits |= value << w->nbits;
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        if (w->len < w->max) {
+            w->out[w->len] = w->bits;
+        }
+        w->len++;
+        w->bits >>= 8;
+        w->nbits -= 8;
+    }
+}
+
+// Huffman codes go out from their most significant bit
+void put_code(struct bit_writer *w, unsigned int code, int n) {
+    unsigned int reversed = 0;
+    for (int i = 0; i < n; i++) {
+        reversed = reversed << 1 | (code >> i & 1);
+    }
+    put_bits(w, reversed, n);
+}
+
+// a literal/length symbol in the fixed code
+void put_symbol(struct bit_writer *w, unsigned int sym) {
+    if (sym < 144) {
+        put_code(w, 0x30 + sym, 8);
+    } else if (sym < 256) {
+        put_code(w, 0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+        put_code(w, sym - 256, 7);
+    } else {
+        put_code(w, 0xc0 + sym - 280, 8);
+    }
+}
+
+void put_match(struct bit_writer *w, size_t len, size_t dist) {
+    int i = 28;
+    while (length_base[i] > len) {
+        i--;
+    }
+    put_symbol(w, 257 + i);
+    put_bits(w, len - length_base[i], length_extra[i]);
+    int j = 29;
+    while (dist_base[j] > dist) {
+        j--;
+    }
+    put_code(w, j, 5);
+    put_bits(w, dist - dist_base[j], dist_extra[j]);
+}
+
+void put_le32(unsigned char *out, unsigned int value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+/*
+ * Compresses len bytes of in into out as a gzip member. Returns its length,
+ * or 0 if it does not fit in max bytes.
+ */
+size_t gzip_compress(const char *in, size_t len, char *out, size_t max) {
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0,
+                                             0,    0,    0, 4, 3};
+    if (max < sizeof(header) + 8) {
+        return 0;
+    }
+    memcpy(out, header, sizeof(header));
+    struct bit_writer w = {(unsigned char *)out + sizeof(header), 0,
+                           max - sizeof(header) - 8, 0, 0};
+    put_bits(&w, 3, 3); // the final block, with the fixed codes
+    // positions are kept one up, so that 0 means none
+    unsigned int *table = Calloc(1 << GZIP_HASH_BITS, sizeof(*table));
+    size_t i = 0;
+    while (i < len && w.len <= w.max) {
+        size_t match = 0, dist = 0;
+        if (i + 4 <= len) {
+            unsigned int seq;
+            memcpy(&seq, in + i, 4);
+            unsigned int h = (seq * 2654435761u) >> (32 - GZIP_HASH_BITS);
+            size_t seen = table[h];
+            table[h] = i + 1;
+            if (seen && i - (seen - 1) <= GZIP_WINDOW &&
+                !memcmp(in + seen - 1, in + i, 4)) {
+                size_t limit = len - i < GZIP_MAX_MATCH ? len - i
+                                                        : GZIP_MAX_MATCH;
+                dist = i - (seen - 1);
+                match = 4;
+                while (match < limit && in[i + match] == in[i + match - dist]) {
+                    match++;
+                }
+            }
+        }
+        if (match) {
+            put_match(&w, match, dist);
+            i += match;
+        } else {
+            put_symbol(&w, (unsigned char)in[i++]);
+        }
+    }
+    Free(table);
+    put_symbol(&w, 256); // the end of the block
+    if (w.nbits) {
+        put_bits(&w, 0, 8 - w.nbits);
+    }
+    if (w.len > w.max) {
+        return 0;
+    }
+    unsigned char *trailer = w.out + w.len;
+    put_le32(trailer, gzip_crc32((const unsigned char *)in, len));
+    put_le32(trailer + 4, len);
+    return sizeof(header) + w.len + 8;
+}
+
+struct bit_reader {
+    const unsigned char *in;
+    size_t len;
+    size_t off;
+    unsigned long bits;
+    int nbits;
+};
+
+// the next n bits, or -1 at the end of the input
+int get_bits(struct bit_reader *r, int n) {
+    while (r->nbits < n) {
+        if (r->off == r->len) {
+            return -1;
+        }
+        r->bits |= (unsigned long)r->in[r->off++] << r->nbits;
+        r->nbits += 8;
+    }
+    int value = r->bits & ((1UL << n) - 1);
+    r->bits >>= n;
+    r->nbits -= n;
+    return value;
+}
+
+// reads a Huffman code of n bits, the reverse of put_code
+int get_code(struct bit_reader *r, int n) {
+    int code = 0;
+    for (int i = 0; i < n; i++) {
+        int bit = get_bits(r, 1);
+        if (bit < 0) {
+            return -1;
+        }
+        code = code << 1 | bit;
+    }
+    return code;
+}
+
+// a literal/length symbol in the fixed code, or -1
+int get_symbol(struct bit_reader *r) {
+    int code = get_code(r, 7);
+    if (code < 0x18) {
+        return code < 0 ? -1 : 256 + code;
+    }
+    int bit = get_bits(r, 1);
+    if (bit < 0) {
+        return -1;
+    }
+    code = code << 1 | bit;
+    if (code < 0xc0) {
+        return code - 0x30;
+    }
+    if (code < 0xc8) {
+        return 280 + code - 0xc0;
+    }
+    bit = get_bits(r, 1);
+    return bit < 0 ? -1 : 144 + (code << 1 | bit) - 0x190;
+}
+
+/*
+ * Decompresses a gzip member made by gzip_compress into the out_len bytes it
+ * holds. Only the fixed Huffman codes are read, as that is all it writes.
+ * Returns -1 if the input is not such a member of out_len bytes.
+ */
+int gzip_inflate(const char *in, size_t len, char *out, size_t out_len) {
+    const unsigned char *p = (const unsigned char *)in;
+    if (len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3]) {
+        return -1;
+    }
+    struct bit_reader r = {p + 10, len - 18, 0, 0, 0};
+    if (get_bits(&r, 3) != 3) {
+        return -1;
+    }
+    size_t n = 0;
+    while (1) {
+        int sym = get_symbol(&r);
+        if (sym < 0 || sym > 285) {
+            return -1;
+        }
+        if (sym < 256) {
+            if (n == out_len) {
+                return -1;
+            }
+            out[n++] = sym;
+            continue;
+        }
+        if (sym == 256) {
+            break;
+        }
+        int extra = get_bits(&r, length_extra[sym - 257]);
+        int d = get_code(&r, 5);
+        if (extra < 0 || d < 0 || d > 29) {
+            return -1;
+        }
+        size_t match = length_base[sym - 257] + extra;
+        int dist_bits = get_bits(&r, dist_extra[d]);
+        if (dist_bits < 0) {
+            return -1;
+        }
+        size_t dist = dist_base[d] + dist_bits;
+        if (dist > n || match > out_len - n) {
+            return -1;
+        }
+        // byte by byte, as a match may overlap what it copies
+        for (size_t i = 0; i < match; i++, n++) {
+            out[n] = out[n - dist];
+        }
+    }
+    return n == out_len ? 0 : -1;
+}
+
+struct byte_range {
+    size_t first;
+    size_t last;
+};
+
+/*
+ * Parses the value of a Range header for a body of len bytes. Returns the
+ * number of satisfiable ranges, or -1 if the header is to be ignored: it is
+ * malformed, not in bytes, or asks for more than MAX_RANGES ranges.
+ */
+int parse_ranges(const char *value, size_t len, struct byte_range *ranges) {
+    if (strncasecmp(value, "bytes=", 6)) {
+        return -1;
+    }
+    const char *p = value + 6;
+    int n = 0;
+    while (1) {
+        p += strspn(p, " \t");
+        char *end;
+        size_t first, last;
+        if (*p == '-' && isdigit((unsigned char)p[1])) {
+            // the last bytes of the body, none of them for a suffix of 0
+            size_t suffix = strtoul(p + 1, &end, 10);
+            first = !suffix ? len : suffix < len ? len - suffix : 0;
+            last = len - 1;
+        } else if (isdigit((unsigned char)*p)) {
+            first = strtoul(p, &end, 10);
+            if (*end++ != '-') {
+                return -1;
+            }
+            last = len - 1;
+            if (isdigit((unsigned char)*end)) {
+                size_t given = strtoul(end, &end, 10);
+                if (given < first) {
+                    return -1;
+                }
+                last = given < last ? given : last;
+            }
+        } else {
+            return -1;
+        }
+        if (first < len) {
+            if (n == MAX_RANGES) {
+                return -1;
+            }
+            ranges[n].first = first;
+            ranges[n++].last = last;
+        }
+        p = end + strspn(end, " \t");
+        if (!*p) {
+            return n;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Finds the end of the response head at the start of a cached response that
+ * a 206 can be made from: a complete 200 whose body is framed by its
+ * Content-Length. Returns the length of the head, or 0 if it is not one.
+ */
+size_t rangeable_head(char *head, size_t len, size_t content_len) {
+    int status;
+    if (sscanf(head, "HTTP/1.%*d %d", &status) != 1 || status != 200) {
+        return 0;
+    }
+    for (size_t i = 0; i + 4 <= len; i++) {
+        if (!memcmp(head + i, "\r\n\r\n", 4)) {
+            char *line = head;
+            while ((line = memchr(line, '\n', head + i - line))) {
+                line++;
+                if (!strncasecmp(line, "Content-Length:", 15)) {
+                    return strtoul(line + 15, NULL, 10) == content_len - i - 4
+                               ? i + 4
+                               : 0;
+                }
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Appends the header lines of a cached head to out, leaving out the status
+ * line, the blank line at the end and the headers the reply replaces: the
+ * framing, and the header named by drop if it is not NULL.
+ */
+size_t copy_header_lines(char *out, char *head, size_t head_len,
+                         const char *drop) {
+    size_t len = 0;
+    char *end = head + head_len - 2;
+    // each line starts after the newline that ends the one before
+    char *nl = head_len >= 4 ? memchr(head, '\n', end - head) : NULL;
+    while (nl && nl + 1 < end) {
+        char *line = nl + 1;
+        if (!(nl = memchr(line, '\n', end - line))) {
+            break;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) &&
+            strncasecmp(line, "Content-Range:", 14) &&
+            (!drop || strncasecmp(line, drop, strlen(drop)))) {
+            memcpy(out + len, line, nl + 1 - line);
+            len += nl + 1 - line;
+        }
+    }
+    return len;
+}
+
+/*
+ * Sets up the reply to a hit on a compressed entry from a client that does
+ * not take gzip: the response as it was before compress_response, which is
+ * decompressed into the reply's head.
+ */
+void inflate_reply(struct reply *r, struct cache_entry *entry) {
+    char head[MAXLINE + 1];
+    size_t len = entry_head(entry, head, MAXLINE);
+    head[len] = '\0';
+    size_t head_len = rangeable_head(head, len, entry->content_len);
+    size_t gz_len = entry->content_len - head_len;
+    size_t body_len = 0;
+    bool inflated = false;
+    r->head = NULL;
+    // a gzip member is at least 18 bytes, and its last 4 are the length
+    if (head_len && gz_len >= 18) {
+        unsigned char trailer[4];
+        entry_copy(entry, entry->content_len - 4, entry->content_len,
+                   (char *)trailer);
+        body_len = trailer[0] | trailer[1] << 8 | trailer[2] << 16 |
+                   (size_t)trailer[3] << 24;
+        r->head = Malloc(head_len + 64 + body_len);
+        r->head_len = (char *)memchr(head, '\n', head_len) + 1 - head;
+        memcpy(r->head, head, r->head_len); // the status line
+        r->head_len += copy_header_lines(r->head + r->head_len, head,
+                                         head_len, "Content-Encoding:");
+        r->head_len += sprintf(r->head + r->head_len,
+                               "Content-Length: %zu\r\n\r\n", body_len);
+        char *gz = Malloc(gz_len);
+        entry_copy(entry, head_len, entry->content_len, gz);
+        inflated = gzip_inflate(gz, gz_len, r->head + r->head_len,
+                                body_len) == 0;
+        Free(gz);
+    }
+    if (!inflated) {
+        // no head to be found, or the body does not inflate
+        r->head = Realloc(r->head, 128);
+        r->head_len = sprintf(r->head, "HTTP/1.1 500 Internal Server Error\r\n"
+                                       "Content-Length: 0\r\n"
+                                       "\r\n");
+        body_len = 0;
+    }
+    r->head_len += body_len;
+    r->start = r->end = 0;
+    metric_add(METRIC_INFLATED, 1);
+}
+
+/*
+ * Sets up the reply to a hit. A Range the cached response can answer gets a
+ * 206 with the range, or with every range as multipart/byteranges, and a 416
+ * if none is satisfiable. If-Range must name the cached response's ETag or
+ * Last-Modified for that. A compressed entry is decompressed for clients
+ * that do not take gzip, which get all of it whatever they asked for. Anything
+ * else gets the response as it was cached.
+ */
+void plan_reply(struct reply *r, struct cache_entry *entry,
+                struct headers *hdr) {
+    char *range = hdr->range, *if_range = hdr->if_range;
+    r->head = NULL;
+    r->head_len = 0;
+    r->start = 0;
+    r->end = entry->content_len;
+    if (entry->compressed && !hdr->accept_gzip) {
+        inflate_reply(r, entry);
+        return;
+    }
+    if (!*range) {
+        return;
+    }
+    char head[MAXLINE + 1];
+    size_t len = entry_head(entry, head, MAXLINE);
+    head[len] = '\0';
+    size_t head_len = rangeable_head(head, len, entry->content_len);
+    if (!head_len) {
+        return;
+    }
+    struct freshness f;
+    freshness_init(&f);
+    scan_freshness(head, head_len, &f);
+    // a weak ETag, such as that of a compressed entry, never matches
+    if (*if_range && (!strncmp(if_range, "W/", 2) ||
+                      (strcmp(if_range, f.etag) &&
+                       strcmp(if_range, f.last_modified_value)))) {
+        return;
+    }
+    size_t body_len = entry->content_len - head_len;
+    struct byte_range ranges[MAX_RANGES];
+    int n = parse_ranges(range, body_len, ranges);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += ranges[i].last - ranges[i].first + 1;
+    }
+    if (n < 0 || total > body_len) {
+        // overlapping ranges could make the reply larger than the body
+        return;
+    }
+
+    if (!n) {
+        r->head = Malloc(128);
+        r->head_len = sprintf(r->head,
+                              "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                              "Content-Range: bytes */%zu\r\n"
+                              "Content-Length: 0\r\n"
+                              "\r\n",
+                              body_len);
+        r->start = r->end = 0;
+        return;
+    }
+    if (n == 1) {
+        size_t first = ranges[0].first, last = ranges[0].last;
+        r->head = Malloc(head_len + 256);
+        r->head_len = sprintf(r->head, "HTTP/1.1 206 Partial Content\r\n");
+        r->head_len += copy_header_lines(r->head + r->head_len, head,
+                                         head_len, NULL);
+        r->head_len += sprintf(r->head + r->head_len,
+                               "Content-Range: bytes %zu-%zu/%zu\r\n"
+                               "Content-Length: %zu\r\n"
+                               "\r\n",
+                               first, last, body_len, last - first + 1);
+        r->start = head_len + first;
+        r->end = head_len + last + 1;
+        return;
+    }
+
+    // the parts are copied out of the entry, and go after the head
+    char type[256] = "";
+    char *line = head;
+    while ((line = memchr(line, '\n', head + head_len - line))) {
+        if (!strncasecmp(++line, "Content-Type:", 13)) {
+            sscanf(line + 13, " %255[^\r\n]", type);
+            break;
+        }
+    }
+    char boundary[32];
+    sprintf(boundary, "%016lx", entry->hash);
+    size_t room = head_len + 256; // for the head, which needs the body length
+    size_t part_max = 128 + strlen(boundary) + strlen(type);
+    r->head = Malloc(room + n * part_max + total + 64);
+    char *body = r->head + room;
+    size_t body_off = 0;
+    for (int i = 0; i < n; i++) {
+        body_off += sprintf(body + body_off, i ? "\r\n--%s\r\n" : "--%s\r\n",
+                            boundary);
+        if (*type) {
+            body_off += sprintf(body + body_off, "Content-Type: %s\r\n", type);
+        }
+        body_off += sprintf(body + body_off,
+                            "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                            ranges[i].first, ranges[i].last, body_len);
+        entry_copy(entry, head_len + ranges[i].first,
+                   head_len + ranges[i].last + 1, body + body_off);
+        body_off += ranges[i].last - ranges[i].first + 1;
+    }
+    body_off += sprintf(body + body_off, "\r\n--%s--\r\n", boundary);
+
+    r->head_len = sprintf(r->head, "HTTP/1.1 206 Partial Content\r\n");
+    r->head_len +=
+        copy_header_lines(r->head + r->head_len, head, head_len,
+                          "Content-Type:");
+    r->head_len += sprintf(r->head + r->head_len,
+                           "Content-Type: multipart/byteranges; "
+                           "boundary=%s\r\n"
+                           "Content-Length: %zu\r\n"
+                           "\r\n",
+                           boundary, body_off);
+    memmove(r->head + r->head_len, body, body_off);
+    r->head_len += body_off;
+    r->start = r->end = 0;
+}
+
+size_t reply_len(struct reply *r) {
+    return r->head_len + r->end - r->start;
+}
+
+// the status code of what a hit replies with
+int reply_status(struct cache_entry *entry, struct reply *r) {
+    if (r->head) {
+        return status_of(r->head, r->head_len);
+    }
+    char head[16];
+    return status_of(head, entry_head(entry, head, sizeof(head)));
+}
+
+// points iov at the reply from off on, returns the vectors used
+int reply_iov(struct cache_entry *entry, struct reply *r, size_t off,
+              struct iovec *iov) {
+    int n = 0;
+    if (off < r->head_len) {
+        iov[n].iov_base = r->head + off;
+        iov[n++].iov_len = r->head_len - off;
+        off = 0;
+    } else {
+        off -= r->head_len;
+    }
+    return n + entry_iov(entry, r->start + off, r->end, iov + n, ENTRY_IOV - n);
+}
+
+// writes the reply from off on, with as few system calls as it can
+ssize_t write_reply(int fd, struct cache_entry *entry, struct reply *r,
+                    size_t off) {
+    struct iovec iov[ENTRY_IOV];
+    return writev(fd, iov, reply_iov(entry, r, off, iov));
+}
+
+// writes all of the reply to a client, like rio_writen
+ssize_t write_reply_all(int fd, struct cache_entry *entry, struct reply *r) {
+    size_t off = 0;
+    while (off < reply_len(r)) {
+        ssize_t n = write_reply(fd, entry, r, off);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (n > 0) {
+            metric_add(METRIC_CLIENT_BYTES_OUT, n);
+            off += n;
+        }
+    }
+    return off;
+}
+
+void cache_put(struct cache_entry *entry) {
+    struct cache_shard *shard = shard_of(entry->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    insert(entry, &shard->cache);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/*
+ * Returns the entry pinned, release it with release_entry. Misses in memory
+ * go on to the disk tier, and what is found there is brought into memory if
+ * it is admitted, or else written out from the disk tier.
+ */
+struct cache_entry *cache_get(char *url) {
+    unsigned long hash = hash_url(url);
+    struct cache_shard *shard = shard_of(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    struct cache_entry *entry = get(url, hash, &shard->cache);
+    if (entry) {
+        pin_entry(entry);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (entry || !disk || !(entry = disk_get(url, hash))) {
+        return entry;
+    }
+    struct cache_entry *copy = NULL;
+    if (entry->content_len <= shard->cache.max_object_size &&
+        (copy = new_entry(url, entry->mapped, entry->content_len))) {
+        copy->delimited = entry->delimited;
+        copy->compressed = entry->compressed;
+        atomic_store(&copy->expires, atomic_load(&entry->expires));
+        pin_entry(copy);
+        cache_put(copy);
+        release_entry(entry);
+        return copy;
+    }
+    return entry;
+}
+
+// a token of tchar as defined in RFC 9110, as used for methods and names
+bool is_tchar(char c) {
+    return isalnum((unsigned char)c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+void request_init(struct request *r) {
+    memset(r, 0, sizeof(*r));
+    r->state = PARSE_METHOD;
+}
+
+// what follows a line ending, which may be a bare LF
+void parse_line_end(struct request *r, char c, enum parse_state next) {
+    r->state = c == '\r' ? PARSE_LF : next;
+    r->after_lf = next;
+}
+
+/*
+ * Parses the request head at the start of buf, of which len bytes have been
+ * read so far. Nothing is copied: the request line and headers are recorded
+ * as slices of buf. Scanning resumes where the previous call stopped, so buf
+ * may grow or move between calls as long as its contents stay the same.
+ * Returns 1 once the head is complete, with r->pos at its end, 0 if more
+ * input is needed and -1 if the request is malformed.
+ */
+int parse_request(struct request *r, const char *buf, size_t len) {
+    for (; r->pos < len && r->state != PARSE_DONE; r->pos++) {
+        char c = buf[r->pos];
+        size_t pos = r->pos;
+        switch (r->state) {
+        case PARSE_METHOD:
+            if ((c == '\r' || c == '\n') && pos == r->mark) {
+                // empty lines ahead of a request are ignored
+                r->mark++;
+            } else if (c == ' ' && pos > r->mark) {
+                r->method = (struct slice){r->mark, pos - r->mark};
+                r->mark = pos + 1;
+                r->state = PARSE_URI;
+            } else if (!is_tchar(c)) {
+                return -1;
+            }
+            break;
+        case PARSE_URI:
+            if (c == ' ' && pos > r->mark) {
+                r->uri = (struct slice){r->mark, pos - r->mark};
+                r->mark = pos + 1;
+                r->state = PARSE_VERSION;
+            } else if ((unsigned char)c <= ' ' || c == 0x7f) {
+                return -1;
+            }
+            break;
+        case PARSE_VERSION:
+            if (c == '\r' || c == '\n') {
+                r->version = (struct slice){r->mark, pos - r->mark};
+                if (r->version.len != 8 ||
+                    strncmp(buf + r->mark, "HTTP/1.", 7) ||
+                    !isdigit((unsigned char)buf[pos - 1])) {
+                    return -1;
+                }
+                parse_line_end(r, c, PARSE_HEADER_START);
+            } else if (pos - r->mark >= 8) {
+                return -1;
+            }
+            break;
+        case PARSE_LF:
+            if (c != '\n') {
+                return -1;
+            }
+            r->state = r->after_lf;
+            break;
+        case PARSE_HEADER_START:
+            if (c == '\r' || c == '\n') {
+                parse_line_end(r, c, PARSE_DONE);
+            } else if (is_tchar(c)) {
+                r->mark = pos;
+                r->state = PARSE_NAME;
+            } else {
+                // including obsolete line folding
+                return -1;
+            }
+            break;
+        case PARSE_NAME:
+            if (c == ':') {
+                if (r->nheaders == MAX_HEADERS) {
+                    return -1;
+                }
+                r->headers[r->nheaders].name =
+                    (struct slice){r->mark, pos - r->mark};
+                r->state = PARSE_VALUE_START;
+            } else if (!is_tchar(c)) {
+                return -1;
+            }
+            break;
+        case PARSE_VALUE_START:
+            if (c == ' ' || c == '\t') {
+                break;
+            }
+            r->mark = pos;
+            r->state = PARSE_VALUE;
+            // fall through
+        case PARSE_VALUE:
+            if (c == '\r' || c == '\n') {
+                size_t end = pos;
+                while (end > r->mark &&
+                       (buf[end - 1] == ' ' || buf[end - 1] == '\t')) {
+                    end--;
+                }
+                r->headers[r->nheaders++].value =
+                    (struct slice){r->mark, end - r->mark};
+                parse_line_end(r, c, PARSE_HEADER_START);
+            } else if (((unsigned char)c < ' ' && c != '\t') || c == 0x7f) {
+                return -1;
+            }
+            break;
+        case PARSE_DONE:
+            break;
+        }
+    }
+    return r->state == PARSE_DONE;
+}
+
+bool slice_is(const char *buf, struct slice s, const char *str) {
+    return s.len == strlen(str) && !strncmp(buf + s.off, str, s.len);
+}
+
+// the value of the first header called name, if there is one
+struct slice *request_header(struct request *r, const char *buf,
+                             const char *name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < r->nheaders; i++) {
+        struct slice *n = &r->headers[i].name;
+        if (n->len == len && !strncasecmp(buf + n->off, name, len)) {
+            return &r->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+// copies s into a string of at most size bytes, or returns -1 if it is longer
+int slice_copy(char *dst, size_t size, const char *buf, struct slice s) {
+    if (s.len >= size) {
+        return -1;
+    }
+    memcpy(dst, buf + s.off, s.len);
+    dst[s.len] = '\0';
+    return 0;
+}
+
+void parse_host(char *host_header, struct destination *out) {
+    out->host = strtok(host_header, ":");
+    char *port = strtok(NULL, ":");
+    out->port = port ? port : "80";
+}
+
+// whether a comma separated header value of len bytes lists token
+bool has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    const char *end = value + len;
+    while (value < end) {
+        while (value < end && strchr(" \t,", *value)) {
+            value++;
+        }
+        const char *start = value;
+        while (value < end && !strchr(" \t,;\r\n", *value)) {
+            value++;
+        }
+        if ((size_t)(value - start) == token_len &&
+            !strncasecmp(start, token, token_len)) {
+            return true;
+        }
+        while (value < end && *value != ',') {
+            value++;
+        }
+    }
+    return false;
+}
+
+void default_headers(struct headers *hdr) {
+    if (!*hdr->host) {
+        strcpy(hdr->host, "www.cs.cmu.com");
+    }
+    hdr->connection = "keep-alive";
+    hdr->user_agent = user_agent_hdr;
+}
+
+/*
+ * Whether an Accept-Encoding value of len bytes takes coding, listed by name
+ * or as *, and not with a q of 0. A listing by name goes before *.
+ */
+bool accepts_coding(const char *value, size_t len, const char *coding) {
+    size_t coding_len = strlen(coding);
+    const char *end = value + len;
+    bool any = false;
+    while (value < end) {
+        while (value < end && strchr(" \t,", *value)) {
+            value++;
+        }
+        const char *start = value;
+        while (value < end && !strchr(" \t,;", *value)) {
+            value++;
+        }
+        size_t name_len = value - start;
+        // any digit but 0 in the parameters, as in q=0.5, makes q nonzero
+        bool zero = false;
+        for (; value < end && *value != ','; value++) {
+            if (!strncasecmp(value, "q=", 2) && value + 2 < end) {
+                zero = true;
+            } else if (zero && *value >= '1' && *value <= '9') {
+                zero = false;
+            }
+        }
+        if (name_len == coding_len && !strncasecmp(start, coding, name_len)) {
+            return !zero;
+        }
+        if (name_len == 1 && *start == '*') {
+            any = !zero;
+        }
+    }
+    return any;
+}
+
+// picks out the headers the proxy cares about, -1 if they are too long
+int scan_headers(struct request *r, const char *buf, struct headers *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    struct slice *host = request_header(r, buf, "Host");
+    if (host && slice_copy(hdr->host, sizeof(hdr->host), buf, *host) < 0) {
+        return -1;
+    }
+    struct slice *range = request_header(r, buf, "Range");
+    struct slice *if_range = request_header(r, buf, "If-Range");
+    if (range && slice_copy(hdr->range, sizeof(hdr->range), buf, *range) < 0) {
+        *hdr->range = '\0';
+    }
+    if (if_range && slice_copy(hdr->if_range, sizeof(hdr->if_range), buf,
+                               *if_range) < 0) {
+        *hdr->if_range = '\0';
+    }
+    struct slice *accept = request_header(r, buf, "Accept-Encoding");
+    hdr->accept_gzip =
+        accept && accepts_coding(buf + accept->off, accept->len, "gzip");
+    for (int i = 0; i < r->nheaders; i++) {
+        struct header *h = &r->headers[i];
+        if ((slice_is(buf, h->name, "Connection") ||
+             slice_is(buf, h->name, "Proxy-Connection")) &&
+            has_token(buf + h->value.off, h->value.len, "close")) {
+            hdr->client_close = true;
+        }
+    }
+    default_headers(hdr);
+    return 0;
+}
+
+/*
+ * Reads a request head into rp's buffer and parses it in place, so r's
+ * slices are offsets into rp->rio_buf. They stay valid until rp is read from
+ * again. Returns 1 on success, 0 if the client closed or timed out before
+ * sending anything, and -1 on errors and malformed or oversized requests.
+ */
+int read_request(rio_t *rp, struct request *r) {
+    // whatever the client pipelined is moved to the front of the buffer
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    request_init(r);
+    int rc;
+    while ((rc = parse_request(r, rp->rio_buf, rp->rio_cnt)) == 0) {
+        if (rp->rio_cnt == sizeof(rp->rio_buf)) {
+            return -1;
+        }
+        ssize_t n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                         sizeof(rp->rio_buf) - rp->rio_cnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            bool idle = n == 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+            return idle && !rp->rio_cnt ? 0 : -1;
+        }
+        rp->rio_cnt += n;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+    rp->rio_bufptr += r->pos;
+    rp->rio_cnt -= r->pos;
+    return 1;
+}
+
+/*
+ * Whether the client connection stays open after the response. Only HTTP/1.1
+ * clients get to keep theirs, as they need no Connection header in the
+ * response to know, and only after a GET, since other methods are forwarded
+ * as a GET and any request body is left unread.
+ */
+bool client_keep_alive(struct request *r, const char *buf,
+                       struct headers *hdr) {
+    return slice_is(buf, r->version, "HTTP/1.1") &&
+           slice_is(buf, r->method, "GET") && !hdr->client_close;
+}
+
+// the path of a request target, or NULL if it has none
+char *uri_path_of(char *uri) {
+    if (*uri == '/') {
+        return uri;
+    }
+    char *authority = strstr(uri, "://");
+    if (!authority) {
+        return NULL;
+    }
+    char *path = strchr(authority + 3, '/');
+    return path ? path : "/";
+}
+
+int build_origin_request(char *buf, char *uri_path, struct headers *hdr) {
+    // user_agent is a complete header line
+    return sprintf(buf,
+                   "GET %s HTTP/1.1\r\n"
+                   "Host: %s\r\n"
+                   "Connection: %s\r\n"
+                   "%s"
+                   "\r\n",
+                   uri_path, hdr->host, hdr->connection, hdr->user_agent);
+}
+
+// adds a header line to a request from build_origin_request, of len bytes
+int add_request_header(char *buf, int len, const char *name,
+                       const char *value) {
+    // ahead of the blank line that ends the request
+    return len - 2 + sprintf(buf + len - 2, "%s: %s\r\n\r\n", name, value);
+}
+
+/*
+ * A range of an object that is not cached is asked of the origin as it is,
+ * and the partial response is not cached. So is If-Range, which goes with
+ * it.
+ */
+int add_range_headers(char *buf, int len, struct headers *hdr) {
+    if (*hdr->range) {
+        len = add_request_header(buf, len, "Range", hdr->range);
+    }
+    if (*hdr->range && *hdr->if_range) {
+        len = add_request_header(buf, len, "If-Range", hdr->if_range);
+    }
+    return len;
+}
+
+/*
+ * Requests for the same uncached URL that arrive while it is being fetched
+ * share one origin request. The first miss leads the flight and appends the
+ * response to it as it relays it, and later misses follow by streaming the
+ * flight's copy, which is also the copy the leader caches. A flight stops
+ * taking followers once it is finished or its response turns out too large
+ * to cache. One whose Content-Length is too large is dropped right away, so
+ * that its followers fetch it themselves. Otherwise only a window of the
+ * response as large as the largest object cached is kept from then on, and
+ * a follower that falls further behind than that is dropped: it fetches the
+ * response itself if it has not read any of it yet, and fails otherwise.
+ */
+enum flight_state { FLIGHT_RUNNING, FLIGHT_DONE, FLIGHT_FAILED };
+
+// returned by flight_read when the leader has not relayed more yet
+#define FLIGHT_PENDING -2
+// returned by flight_read to a follower that has to fetch it itself
+#define FLIGHT_DROPPED -3
+
+struct flight_follower {
+    // lets a follower that cannot block know when there is more to read
+    void (*wake)(void *arg);
+    void *arg;
+    size_t off; // read so far
+    bool dropped;
+    struct flight_follower *next;
+};
+
+struct flight {
+    char *url;
+    pthread_mutex_t lock;
+    pthread_cond_t grown;
+    // bytes base to len of the response, in a ring of cap bytes. The ring
+    // only wraps once it holds max bytes, so until then data is the whole
+    // response from its start.
+    char *data;
+    size_t base;
+    size_t len;
+    size_t cap;
+    size_t max;
+    enum flight_state state;
+    bool delimited;
+    bool published; // in the flight table, so others can still join
+    bool abandoned; // not buffered anymore, since nobody follows
+    int refs;
+    struct flight_follower *followers;
+    struct flight *next;
+};
+
+static struct flight *flights[FLIGHT_BUCKETS];
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Joins the flight for url, or starts one if there is none, in which case
+ * *leader is set and the caller has to fetch the response. Either way the
+ * flight has to be released again.
+ */
+struct flight *flight_join(char *url, bool *leader) {
+    pthread_mutex_lock(&flights_lock);
+    struct flight **bucket = &flights[hash_url(url) % FLIGHT_BUCKETS];
+    struct flight *fl;
+    for (fl = *bucket; fl; fl = fl->next) {
+        if (!strcmp(fl->url, url)) {
+            break;
+        }
+    }
+    if ((*leader = !fl)) {
+        fl = Calloc(1, sizeof(*fl));
+        fl->url = strdup(url);
+        pthread_mutex_init(&fl->lock, NULL);
+        pthread_cond_init(&fl->grown, NULL);
+        fl->state = FLIGHT_RUNNING;
+        fl->published = true;
+        fl->next = *bucket;
+        *bucket = fl;
+    }
+    pthread_mutex_lock(&fl->lock);
+    fl->refs++;
+    pthread_mutex_unlock(&fl->lock);
+    pthread_mutex_unlock(&flights_lock);
+    return fl;
+}
+
+void flight_release(struct flight *fl) {
+    pthread_mutex_lock(&fl->lock);
+    int refs = --fl->refs;
+    pthread_mutex_unlock(&fl->lock);
+    if (refs) {
+        return;
+    }
+    pthread_mutex_destroy(&fl->lock);
+    pthread_cond_destroy(&fl->grown);
+    free(fl->data);
+    free(fl->url);
+    Free(fl);
+}
+
+// takes the flight out of the table, so that later misses start their own
+void flight_unpublish(struct flight *fl) {
+    pthread_mutex_lock(&flights_lock);
+    if (fl->published) {
+        struct flight **link = &flights[hash_url(fl->url) % FLIGHT_BUCKETS];
+        while (*link != fl) {
+            link = &(*link)->next;
+        }
+        *link = fl->next;
+        fl->published = false;
+    }
+    pthread_mutex_unlock(&flights_lock);
+}
+
+// call with fl->lock held
+void flight_wake(struct flight *fl) {
+    pthread_cond_broadcast(&fl->grown);
+    for (struct flight_follower *f = fl->followers; f; f = f->next) {
+        if (f->wake) {
+            f->wake(f->arg);
+        }
+    }
+}
+
+// call with fl->lock held
+void flight_abandon(struct flight *fl) {
+    fl->abandoned = true;
+    free(fl->data);
+    fl->data = NULL;
+    flight_wake(fl);
+}
+
+// stops buffering the response, and its followers reading it
+void flight_drop(struct flight *fl) {
+    flight_unpublish(fl);
+    pthread_mutex_lock(&fl->lock);
+    flight_abandon(fl);
+    pthread_mutex_unlock(&fl->lock);
+}
+
+/*
+ * Moves the start of the window up to at least base, and on to what the
+ * slowest follower still has to read. Followers behind base are dropped, and
+ * without any left nothing is buffered anymore. Call with fl->lock held.
+ */
+void flight_slide(struct flight *fl, size_t base) {
+    size_t start = fl->len;
+    struct flight_follower **link = &fl->followers;
+    while (*link) {
+        struct flight_follower *f = *link;
+        if (f->off < base) {
+            f->dropped = true;
+            *link = f->next;
+            if (f->wake) {
+                f->wake(f->arg);
+            }
+            continue;
+        }
+        start = f->off < start ? f->off : start;
+        link = &f->next;
+    }
+    fl->base = start;
+    if (!fl->followers) {
+        flight_abandon(fl);
+    }
+}
+
+/*
+ * Buffers n more bytes of the response, keeping at most max of them, and
+ * returns whether the whole response still is. Only the leader calls this,
+ * so it reads what only it changes without the lock.
+ */
+bool flight_append(struct flight *fl, void *data, size_t n, size_t max) {
+    if (fl->abandoned) {
+        return false;
+    }
+    if (!fl->max) {
+        // fixed for the flight, even if the limit is reloaded
+        fl->max = max > MAXLINE ? max : MAXLINE;
+    }
+    if (!fl->base && fl->len + n > fl->max) {
+        // followers joining now would find its start gone
+        flight_unpublish(fl);
+    }
+    pthread_mutex_lock(&fl->lock);
+    size_t need = fl->len + n - fl->base;
+    if (need > fl->cap && fl->cap < fl->max) {
+        size_t cap = fl->cap ? fl->cap : MAXLINE;
+        while (cap < need) {
+            cap *= 2;
+        }
+        fl->cap = cap < fl->max ? cap : fl->max;
+        fl->data = Realloc(fl->data, fl->cap);
+    }
+    if (need > fl->cap) {
+        flight_slide(fl, fl->len + n - fl->cap);
+    }
+    if (!fl->abandoned) {
+        size_t at = fl->len % fl->cap;
+        size_t first = n < fl->cap - at ? n : fl->cap - at;
+        memcpy(fl->data + at, data, first);
+        memcpy(fl->data, (char *)data + first, n - first);
+        fl->len += n;
+        flight_wake(fl);
+    }
+    bool whole = !fl->abandoned && !fl->base;
+    pthread_mutex_unlock(&fl->lock);
+    return whole;
+}
+
+/*
+ * The response will not be cached. No one else may join, and without
+ * followers there is no need to buffer it at all. Returns whether it is
+ * abandoned.
+ */
+bool flight_close_joins(struct flight *fl) {
+    flight_unpublish(fl);
+    pthread_mutex_lock(&fl->lock);
+    if (fl->refs == 1 && !fl->abandoned) {
+        flight_abandon(fl);
+    }
+    bool abandoned = fl->abandoned;
+    pthread_mutex_unlock(&fl->lock);
+    return abandoned;
+}
+
+// called by the leader, which also drops its reference
+void flight_finish(struct flight *fl, bool ok, bool delimited) {
+    flight_unpublish(fl);
+    pthread_mutex_lock(&fl->lock);
+    fl->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+    fl->delimited = delimited;
+    flight_wake(fl);
+    pthread_mutex_unlock(&fl->lock);
+    flight_release(fl);
+}
+
+/*
+ * Copies up to n bytes of the response from where follower f is to buf.
+ * Returns the number copied, 0 at the end of a complete response and -1 if
+ * the leader failed. Unless told to wait, returns FLIGHT_PENDING instead of
+ * blocking for more. A dropped follower gets FLIGHT_DROPPED if it has not
+ * read anything yet, and -1 otherwise.
+ */
+ssize_t flight_read(struct flight *fl, struct flight_follower *f, char *buf,
+                    size_t n, bool wait) {
+    pthread_mutex_lock(&fl->lock);
+    bool dropped;
+    while (!(dropped = f->dropped || fl->abandoned || f->off < fl->base) &&
+           wait && f->off == fl->len && fl->state == FLIGHT_RUNNING) {
+        pthread_cond_wait(&fl->grown, &fl->lock);
+    }
+    ssize_t rc;
+    if (dropped) {
+        rc = f->off ? -1 : FLIGHT_DROPPED;
+    } else if (f->off < fl->len) {
+        rc = fl->len - f->off < n ? fl->len - f->off : n;
+        size_t at = f->off % fl->cap;
+        size_t first = (size_t)rc < fl->cap - at ? (size_t)rc : fl->cap - at;
+        memcpy(buf, fl->data + at, first);
+        memcpy(buf + first, fl->data, rc - first);
+        f->off += rc;
+    } else if (fl->state == FLIGHT_RUNNING) {
+        rc = FLIGHT_PENDING;
+    } else {
+        rc = fl->state == FLIGHT_DONE ? 0 : -1;
+    }
+    pthread_mutex_unlock(&fl->lock);
+    return rc;
+}
+
+void flight_follow(struct flight *fl, struct flight_follower *f) {
+    pthread_mutex_lock(&fl->lock);
+    f->off = 0;
+    f->dropped = false;
+    f->next = fl->followers;
+    fl->followers = f;
+    pthread_mutex_unlock(&fl->lock);
+}
+
+// once this returns, f is not woken anymore
+void flight_unfollow(struct flight *fl, struct flight_follower *f) {
+    pthread_mutex_lock(&fl->lock);
+    struct flight_follower **link = &fl->followers;
+    while (*link && *link != f) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = f->next;
+    }
+    pthread_mutex_unlock(&fl->lock);
+}
+
+/*
+ * A response collected for the cache while it streams to the client. It is
+ * only cached once complete, and collection stops for good as soon as the
+ * response outgrows the object size limit. A response that leads a flight
+ * is collected in the flight's buffer instead of data.
+ */
+struct response_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool abandoned;
+    struct flight *flight; // led by this response, if any
+};
+
+void response_init(struct response_buf *rb) {
+    rb->data = NULL;
+    rb->len = 0;
+    rb->cap = 0;
+    rb->abandoned = false;
+    rb->flight = NULL;
+}
+
+void response_discard(struct response_buf *rb) {
+    free(rb->data);
+    rb->data = NULL;
+    rb->abandoned = true;
+    if (rb->flight) {
+        flight_close_joins(rb->flight);
+    }
+}
+
+// the response is not collected, and no request follows it either
+bool response_spliceable(struct response_buf *rb) {
+    return rb->abandoned && (!rb->flight || flight_close_joins(rb->flight));
+}
+
+// the largest object either tier keeps
+size_t max_cacheable(void) {
+    size_t max = shards[0].cache.max_object_size;
+    return disk && disk->max_object_size > max ? disk->max_object_size : max;
+}
+
+void response_append(struct response_buf *rb, void *data, size_t n) {
+    size_t max_object_size = max_cacheable();
+    if (rb->flight) {
+        if (!flight_append(rb->flight, data, n, max_object_size)) {
+            rb->abandoned = true;
+        }
+        return;
+    }
+    if (rb->abandoned) {
+        return;
+    }
+    if (rb->len + n > max_object_size) {
+        response_discard(rb);
+        return;
+    }
+    if (rb->len + n > rb->cap) {
+        size_t cap = rb->cap ? rb->cap : MAXLINE;
+        while (cap < rb->len + n) {
+            cap *= 2;
+        }
+        rb->cap = cap < max_object_size ? cap : max_object_size;
+        rb->data = Realloc(rb->data, rb->cap);
+    }
+    memcpy(rb->data + rb->len, data, n);
+    rb->len += n;
+}
+
+// whether a response head names a type worth compressing, and no encoding
+bool compressible(char *head, size_t head_len) {
+    bool text = false;
+    char *line = head;
+    while ((line = memchr(line, '\n', head + head_len - line))) {
+        line++;
+        if (!strncasecmp(line, "Content-Encoding:", 17)) {
+            return false;
+        }
+        if (!strncasecmp(line, "Content-Type:", 13)) {
+            char type[128] = "";
+            sscanf(line + 13, " %127[^;\r\n ]", type);
+            size_t len = strlen(type);
+            text = !strncasecmp(type, "text/", 5) ||
+                   (len >= 4 && !strcasecmp(type + len - 4, "json")) ||
+                   (len >= 3 && !strcasecmp(type + len - 3, "xml")) ||
+                   (len >= 10 && !strcasecmp(type + len - 10, "javascript"));
+        }
+    }
+    return text;
+}
+
+/*
+ * Makes the variant of a response the cache keeps compressed: its body in
+ * gzip, under its head with Content-Encoding and Vary added, and the ETag in
+ * f made weak as the bytes differ. Only a complete 200 of a compressible
+ * type framed by its Content-Length is compressed, and only if that saves at
+ * least an eighth. Returns the variant, to be freed, or NULL.
+ */
+char *compress_response(char *data, size_t len, struct freshness *f,
+                        size_t *out_len) {
+    char head[MAXLINE + 1];
+    size_t n = len < MAXLINE ? len : MAXLINE;
+    memcpy(head, data, n);
+    head[n] = '\0';
+    size_t head_len = rangeable_head(head, n, len);
+    size_t body_len = len - head_len;
+    if (!head_len || head_len + 128 > MAXLINE ||
+        body_len < COMPRESS_MIN_SIZE || !compressible(head, head_len)) {
+        return NULL;
+    }
+    size_t max = body_len - body_len / 8;
+    char *out = Malloc(head_len + 128 + max);
+    char *body = Malloc(max);
+    size_t gz_len = gzip_compress(data + head_len, body_len, body, max);
+    if (!gz_len) {
+        free(body);
+        free(out);
+        return NULL;
+    }
+    n = (char *)memchr(head, '\n', head_len) + 1 - head;
+    memcpy(out, head, n); // the status line
+    n += copy_header_lines(out + n, head, head_len, "ETag:");
+    if (*f->etag) {
+        n += sprintf(out + n, "ETag: %s%s\r\n",
+                     strncmp(f->etag, "W/", 2) ? "W/" : "", f->etag);
+    }
+    n += sprintf(out + n,
+                 "Content-Encoding: gzip\r\n"
+                 "Vary: Accept-Encoding\r\n"
+                 "Content-Length: %zu\r\n"
+                 "\r\n",
+                 gz_len);
+    memcpy(out + n, body, gz_len);
+    free(body);
+    *out_len = n + gz_len;
+    return out;
+}
+
+/*
+ * Stores a complete response in both tiers, unless it asks not to be, and
+ * compressed if it can be. Returns the entry in memory, pinned, or NULL if it
+ * is not kept there.
+ */
+struct cache_entry *cache_response(char *url, char *data, size_t len,
+                                   bool delimited) {
+    struct freshness f;
+    freshness_init(&f);
+    scan_freshness(data, len, &f);
+    if (f.no_store) {
+        return NULL;
+    }
+    time_t expires = freshness_expiry(&f, time(NULL));
+    char *compressed = NULL;
+    size_t compressed_len;
+    if (atomic_load_explicit(&compress_cache, memory_order_relaxed) &&
+        !f.no_transform &&
+        (compressed = compress_response(data, len, &f, &compressed_len))) {
+        metric_add(METRIC_COMPRESSED, 1);
+        metric_add(METRIC_COMPRESSION_SAVED, len - compressed_len);
+        data = compressed;
+        len = compressed_len;
+    }
+    struct cache_entry *entry = NULL;
+    if (len <= shards[0].cache.max_object_size &&
+        (entry = new_entry(url, data, len))) {
+        entry->delimited = delimited;
+        entry->compressed = compressed != NULL;
+        atomic_store(&entry->expires, expires);
+        pin_entry(entry);
+        cache_put(entry);
+    }
+    if (disk) {
+        disk_put(url, data, len, delimited, compressed != NULL, expires);
+    }
+    free(compressed);
+    return entry;
+}
+
+// hands a complete response over to the cache and its followers
+void response_commit(struct response_buf *rb, char *url, bool delimited) {
+    // the leader alone writes the flight's buffer, so it reads it unlocked
+    char *data = rb->flight ? rb->flight->data : rb->data;
+    size_t len = rb->flight ? rb->flight->len : rb->len;
+    if (rb->abandoned || !len) {
+        response_discard(rb);
+    } else {
+        struct cache_entry *entry =
+            cache_response(url, data, len, delimited);
+        if (entry) {
+            release_entry(entry);
+        }
+        free(rb->data);
+        rb->data = NULL;
+    }
+    if (rb->flight) {
+        flight_finish(rb->flight, true, delimited);
+        rb->flight = NULL;
+    }
+}
+
+// the response did not make it, so its followers fail too
+void response_fail(struct response_buf *rb) {
+    response_discard(rb);
+    if (rb->flight) {
+        flight_finish(rb->flight, false, false);
+        rb->flight = NULL;
+    }
+}
+
+// the origin response framer, as laid out with struct framer in proxy.h
+void framer_init(struct framer *f) {
+    f->state = FRAME_HEADERS;
+    f->line_len = 0;
+    f->status_line = true;
+    f->remaining = 0;
+    f->status = 0;
+    f->delimited = false;
+    f->keep_alive = false;
+    f->chunked = false;
+    f->content_length = -1;
+}
+
+bool is_blank_line(char *line) {
+    return !strcmp(line, "\r\n") || !strcmp(line, "\n");
+}
+
+void framer_end_headers(struct framer *f) {
+    f->delimited = true;
+    if (f->status / 100 == 1) {
+        // an interim response, the final one follows
+        framer_init(f);
+    } else if (f->status == 204 || f->status == 304) {
+        f->state = FRAME_DONE;
+    } else if (f->chunked) {
+        f->state = FRAME_CHUNK_SIZE;
+    } else if (f->content_length >= 0) {
+        f->remaining = f->content_length;
+        f->state = f->remaining ? FRAME_BODY : FRAME_DONE;
+    } else {
+        f->state = FRAME_UNTIL_CLOSE;
+        f->delimited = false;
+        f->keep_alive = false;
+    }
+}
+
+void framer_line(struct framer *f) {
+    char *line = f->line;
+    int minor;
+    switch (f->state) {
+    case FRAME_HEADERS:
+        if (f->status_line) {
+            if (sscanf(line, "HTTP/1.%d %d", &minor, &f->status) == 2) {
+                // persistent by default from HTTP/1.1 on
+                f->keep_alive = minor >= 1;
+            }
+            f->status_line = false;
+        } else if (is_blank_line(line)) {
+            framer_end_headers(f);
+        } else if (!strncasecmp(line, "Content-Length:", 15)) {
+            f->content_length = strtol(line + 15, NULL, 10);
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+            f->chunked = has_token(line + 18, strlen(line + 18), "chunked");
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            if (has_token(line + 11, strlen(line + 11), "close")) {
+                f->keep_alive = false;
+            } else if (has_token(line + 11, strlen(line + 11), "keep-alive")) {
+                f->keep_alive = true;
+            }
+        }
+        break;
+    case FRAME_CHUNK_SIZE:
+        f->remaining = strtol(line, NULL, 16);
+        f->state = f->remaining > 0 ? FRAME_CHUNK_DATA : FRAME_TRAILERS;
+        break;
+    case FRAME_CHUNK_END:
+        f->state = FRAME_CHUNK_SIZE;
+        break;
+    case FRAME_TRAILERS:
+        if (is_blank_line(line)) {
+            f->state = FRAME_DONE;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Feeds n relayed bytes through the framer and returns how many of them
+ * belong to the response. Anything after the end of the response is left
+ * unconsumed.
+ */
+size_t framer_feed(struct framer *f, char *data, size_t n) {
+    size_t i = 0;
+    while (i < n && f->state != FRAME_DONE) {
+        switch (f->state) {
+        case FRAME_BODY:
+        case FRAME_CHUNK_DATA: {
+            size_t take = n - i;
+            if ((long)take > f->remaining) {
+                take = f->remaining;
+            }
+            i += take;
+            f->remaining -= take;
+            if (!f->remaining) {
+                f->state =
+                    f->state == FRAME_BODY ? FRAME_DONE : FRAME_CHUNK_END;
+            }
+            break;
+        }
+        case FRAME_UNTIL_CLOSE:
+            i = n;
+            break;
+        default:
+            // overlong lines are cut short, only their start matters
+            if (f->line_len < sizeof(f->line) - 1) {
+                f->line[f->line_len++] = data[i];
+            }
+            if (data[i++] == '\n') {
+                f->line[f->line_len] = '\0';
+                f->line_len = 0;
+                framer_line(f);
+            }
+            break;
+        }
+    }
+    return i;
+}
+
+// accounts for n body bytes that were relayed without being fed through
+void framer_skip(struct framer *f, long n) {
+    if (f->state == FRAME_BODY && !(f->remaining -= n)) {
+        f->state = FRAME_DONE;
+    }
+}
+
+// the origin closed the connection, returns whether the response is complete
+bool framer_eof(struct framer *f) {
+    if (f->state == FRAME_UNTIL_CLOSE) {
+        f->state = FRAME_DONE;
+    }
+    return f->state == FRAME_DONE;
+}
+
+bool framer_reusable(struct framer *f) {
+    return f->state == FRAME_DONE && f->keep_alive;
+}
+
+// relayed response bytes go to the cache unless the body is declared too large
+void response_collect(struct response_buf *rb, struct framer *f, char *data,
+                      size_t n) {
+    if (f->content_length > (long)max_cacheable()) {
+        response_discard(rb);
+        // its followers fetch it themselves, and the leader splices it
+        if (rb->flight && !rb->flight->abandoned) {
+            flight_drop(rb->flight);
+        }
+    }
+    response_append(rb, data, n);
+}
+
+/*
+ * Idle keep-alive connections to origins, kept per host and port. Every
+ * origin holds at most MAX_IDLE_PER_ORIGIN of them with the most recently
+ * used on top, and connections that have been idle for longer than
+ * ORIGIN_IDLE_TIMEOUT are closed instead of reused.
+ */
+struct origin_pool {
+    char *host;
+    char *port;
+    int fds[MAX_IDLE_PER_ORIGIN];
+    time_t idle_since[MAX_IDLE_PER_ORIGIN];
+    int nidle;
+    struct origin_pool *next;
+};
+
+static struct origin_pool *pools[POOL_BUCKETS];
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct origin_pool *pool_of(char *host, char *port) {
+    unsigned long hash = hash_url(host) ^ hash_url(port);
+    struct origin_pool **bucket = &pools[hash % POOL_BUCKETS];
+    for (struct origin_pool *pool = *bucket; pool; pool = pool->next) {
+        if (!strcmp(pool->host, host) && !strcmp(pool->port, port)) {
+            return pool;
+        }
+    }
+    struct origin_pool *pool = Calloc(1, sizeof(*pool));
+    pool->host = strdup(host);
+    pool->port = strdup(port);
+    pool->next = *bucket;
+    *bucket = pool;
+    return pool;
+}
+
+// closes the connections at the bottom of the pool that have timed out
+void pool_expire(struct origin_pool *pool, time_t now) {
+    int expired = 0;
+    while (expired < pool->nidle &&
+           now - pool->idle_since[expired] > ORIGIN_IDLE_TIMEOUT) {
+        close(pool->fds[expired++]);
+    }
+    pool->nidle -= expired;
+    memmove(pool->fds, pool->fds + expired, pool->nidle * sizeof(int));
+    memmove(pool->idle_since, pool->idle_since + expired,
+            pool->nidle * sizeof(time_t));
+}
+
+/*
+ * Returns an idle connection to the origin, or -1 if there is none. A
+ * connection the origin has closed in the meantime reads as EOF and is
+ * dropped, though that can still race with the request being sent.
+ */
+int pool_checkout(char *host, char *port) {
+    while (1) {
+        int fd = -1;
+        pthread_mutex_lock(&pools_lock);
+        struct origin_pool *pool = pool_of(host, port);
+        pool_expire(pool, time(NULL));
+        if (pool->nidle) {
+            fd = pool->fds[--pool->nidle];
+        }
+        pthread_mutex_unlock(&pools_lock);
+        char c;
+        if (fd < 0 || (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+                       (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+void pool_checkin(char *host, char *port, int fd) {
+    pthread_mutex_lock(&pools_lock);
+    struct origin_pool *pool = pool_of(host, port);
+    time_t now = time(NULL);
+    pool_expire(pool, now);
+    if (pool->nidle == MAX_IDLE_PER_ORIGIN) {
+        // make room by dropping the longest idle one
+        pool->idle_since[0] = 0;
+        pool_expire(pool, now);
+    }
+    pool->fds[pool->nidle] = fd;
+    pool->idle_since[pool->nidle++] = now;
+    pthread_mutex_unlock(&pools_lock);
+}
+
+/*
+ * Resolved addresses of origin hosts. getaddrinfo does not report the TTL of
+ * the records it finds, so answers are kept for DNS_TTL and failures for
+ * DNS_NEGATIVE_TTL. Lookups run on a small pool of resolver threads, and
+ * however many requests miss on the same host at once, it is only resolved
+ * once: the first miss queues the entry and the others wait for it.
+ */
+enum dns_state { DNS_PENDING, DNS_RESOLVED, DNS_FAILED };
+
+struct dns_addrs {
+    struct sockaddr_storage addr[MAX_ORIGIN_ADDRS];
+    socklen_t len[MAX_ORIGIN_ADDRS];
+    int n;
+};
+
+// called on a resolver thread once the host it waited for is resolved
+struct dns_waiter {
+    void (*done)(void *arg);
+    void *arg;
+    struct dns_waiter *next;
+};
+
+struct dns_entry {
+    char *host;
+    enum dns_state state;
+    time_t expires; // 0 for entries from a hosts file, which never expire
+    struct dns_addrs addrs;
+    struct dns_waiter *waiters;
+    struct dns_entry *next;
+    struct dns_entry *queue_next;
+};
+
+static struct dns_entry *dns_buckets[DNS_BUCKETS];
+static struct dns_entry *dns_queue_head, *dns_queue_tail;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dns_resolved = PTHREAD_COND_INITIALIZER;
+
+struct dns_entry *dns_entry_of(char *host) {
+    struct dns_entry **bucket = &dns_buckets[hash_url(host) % DNS_BUCKETS];
+    for (struct dns_entry *e = *bucket; e; e = e->next) {
+        if (!strcasecmp(e->host, host)) {
+            return e;
+        }
+    }
+    struct dns_entry *e = Calloc(1, sizeof(*e));
+    e->host = strdup(host);
+    e->state = DNS_FAILED; // expired, so the first lookup resolves it
+    e->expires = 1;
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+/*
+ * Copies the addresses of host to out and returns 1, or returns -1 if it is
+ * known not to resolve. Otherwise the host is being resolved, and 0 is
+ * returned after done, if given, has been registered to be called once that
+ * is over. Call with dns_lock held.
+ */
+int dns_lookup_locked(char *host, struct dns_addrs *out, void (*done)(void *),
+                      void *arg) {
+    struct dns_entry *e = dns_entry_of(host);
+    if (e->state != DNS_PENDING && e->expires && e->expires <= time(NULL)) {
+        e->state = DNS_PENDING;
+        e->queue_next = NULL;
+        if (dns_queue_tail) {
+            dns_queue_tail->queue_next = e;
+        } else {
+            dns_queue_head = e;
+        }
+        dns_queue_tail = e;
+        pthread_cond_signal(&dns_queued);
+    }
+    if (e->state == DNS_RESOLVED) {
+        *out = e->addrs;
+        return 1;
+    }
+    if (e->state == DNS_FAILED) {
+        return -1;
+    }
+    if (done) {
+        struct dns_waiter *waiter = Malloc(sizeof(*waiter));
+        waiter->done = done;
+        waiter->arg = arg;
+        waiter->next = e->waiters;
+        e->waiters = waiter;
+    }
+    return 0;
+}
+
+// for the event loop, which gets called back through done instead of waiting
+int dns_lookup(char *host, struct dns_addrs *out, void (*done)(void *),
+               void *arg) {
+    pthread_mutex_lock(&dns_lock);
+    int rc = dns_lookup_locked(host, out, done, arg);
+    pthread_mutex_unlock(&dns_lock);
+    return rc;
+}
+
+// blocks until host is resolved, returning -1 if it does not resolve
+int dns_resolve(char *host, struct dns_addrs *out) {
+    int rc;
+    pthread_mutex_lock(&dns_lock);
+    while ((rc = dns_lookup_locked(host, out, NULL, NULL)) == 0) {
+        pthread_cond_wait(&dns_resolved, &dns_lock);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return rc;
+}
+
+void *resolver_thread(void *vargp) {
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&dns_lock);
+        while (!dns_queue_head) {
+            pthread_cond_wait(&dns_queued, &dns_lock);
+        }
+        struct dns_entry *e = dns_queue_head;
+        if (!(dns_queue_head = e->queue_next)) {
+            dns_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&dns_lock);
+
+        // the host never changes, and nothing else touches a pending entry
+        struct addrinfo hints, *listp, *p;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        struct dns_addrs addrs = {.n = 0};
+        if (getaddrinfo(e->host, NULL, &hints, &listp) == 0) {
+            for (p = listp; p && addrs.n < MAX_ORIGIN_ADDRS; p = p->ai_next) {
+                memcpy(&addrs.addr[addrs.n], p->ai_addr, p->ai_addrlen);
+                addrs.len[addrs.n++] = p->ai_addrlen;
+            }
+            freeaddrinfo(listp);
+        }
+
+        pthread_mutex_lock(&dns_lock);
+        e->addrs = addrs;
+        e->state = addrs.n ? DNS_RESOLVED : DNS_FAILED;
+        e->expires = time(NULL) + (addrs.n ? DNS_TTL : DNS_NEGATIVE_TTL);
+        struct dns_waiter *waiters = e->waiters;
+        e->waiters = NULL;
+        pthread_cond_broadcast(&dns_resolved);
+        pthread_mutex_unlock(&dns_lock);
+        while (waiters) {
+            struct dns_waiter *waiter = waiters;
+            waiters = waiter->next;
+            waiter->done(waiter->arg);
+            Free(waiter);
+        }
+    }
+    return NULL;
+}
+
+void init_resolver(void) {
+    pthread_t tid;
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+    }
+}
+
+/*
+ * Pins the names in an /etc/hosts style file to their addresses, so that they
+ * never reach the resolver. Returns -1 if the file cannot be read.
+ */
+int load_hosts_file(char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[MAXLINE];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#")] = '\0';
+        char *save;
+        char *address = strtok_r(line, " \t\r\n", &save);
+        if (!address) {
+            continue;
+        }
+        struct sockaddr_storage addr;
+        socklen_t len;
+        memset(&addr, 0, sizeof(addr));
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        if (inet_pton(AF_INET, address, &in->sin_addr) == 1) {
+            in->sin_family = AF_INET;
+            len = sizeof(*in);
+        } else if (inet_pton(AF_INET6, address, &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            len = sizeof(*in6);
+        } else {
+            continue;
+        }
+        pthread_mutex_lock(&dns_lock);
+        for (char *name; (name = strtok_r(NULL, " \t\r\n", &save));) {
+            struct dns_entry *e = dns_entry_of(name);
+            if (e->expires) {
+                e->state = DNS_RESOLVED;
+                e->expires = 0;
+                e->addrs.n = 0;
+            }
+            if (e->addrs.n < MAX_ORIGIN_ADDRS) {
+                e->addrs.addr[e->addrs.n] = addr;
+                e->addrs.len[e->addrs.n++] = len;
+            }
+        }
+        pthread_mutex_unlock(&dns_lock);
+    }
+    fclose(file);
+    return 0;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * A response goes to the client in several writes, a head and then the body
+ * as it arrives. Nagle's algorithm would hold back the second until the
+ * client acknowledged the first, which it delays by up to 40 ms.
+ */
+void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * Connects to the first of addrs that accepts on port. A non-blocking socket
+ * may still be connecting when this returns.
+ */
+int open_origin_fd(struct dns_addrs *addrs, char *port, bool nonblocking) {
+    unsigned short nport = htons(atoi(port));
+    for (int i = 0; i < addrs->n; i++) {
+        struct sockaddr_storage addr = addrs->addr[i];
+        if (addr.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&addr)->sin_port = nport;
+        } else {
+            ((struct sockaddr_in6 *)&addr)->sin6_port = nport;
+        }
+        int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            continue;
+        }
+        if ((!nonblocking || set_nonblocking(fd) == 0) &&
+            (connect(fd, (SA *)&addr, addrs->len[i]) == 0 ||
+             (nonblocking && errno == EINPROGRESS))) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/*
+ * splice(2) is only declared with _GNU_SOURCE, which conflicts with csapp.h's
+ * gai_error, so it is called through syscall.
+ */
+ssize_t splice_fds(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    return syscall(SYS_splice, fd_in, NULL, fd_out, NULL, len, flags);
+}
+
+/*
+ * Moves len bytes of a response, or everything up to EOF if len is negative,
+ * from serverfd to clientfd through a pipe without copying them into user
+ * space. Returns 0 on success and -1 on error.
+ */
+int relay_spliced(int serverfd, int clientfd, long len) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        return -1;
+    }
+    ssize_t n = 0;
+    while (len) {
+        size_t want = len < 0 || len > SPLICE_CHUNK ? SPLICE_CHUNK : len;
+        if ((n = splice_fds(serverfd, pipefd[1], want,
+                            SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+            break;
+        }
+        if (len > 0) {
+            len -= n;
+        }
+        metric_add(METRIC_ORIGIN_BYTES_IN, n);
+        while (n > 0) {
+            ssize_t written = splice_fds(pipefd[0], clientfd, n,
+                                         SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (written <= 0) {
+                n = -1;
+                break;
+            }
+            metric_add(METRIC_CLIENT_BYTES_OUT, written);
+            n -= written;
+        }
+        if (n < 0) {
+            break;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    // EOF is only expected when the length is unknown
+    return n < 0 || len > 0 ? -1 : 0;
+}
+
+enum relay_result {
+    RELAY_REUSABLE,    // complete, and the origin connection can be reused
+    RELAY_COMPLETE,    // complete, but the origin connection must be closed
+    RELAY_NO_RESPONSE, // the origin failed or closed before responding
+    RELAY_FAILED,
+};
+
+/*
+ * Relays one response from serverfd to clientfd while collecting it for the
+ * cache. Once the response is too large to cache, a body of known length or
+ * one that lasts until EOF is spliced through instead. Without a client,
+ * with clientfd -1, the response is only collected.
+ */
+enum relay_result relay_response(int serverfd, int clientfd,
+                                 struct framer *f,
+                                 struct response_buf *response) {
+    framer_init(f);
+    char buf[MAXLINE];
+    bool responded = false;
+    while (f->state != FRAME_DONE) {
+        if (clientfd >= 0 && use_splice && response_spliceable(response) &&
+            (f->state == FRAME_BODY || f->state == FRAME_UNTIL_CLOSE)) {
+            long len = f->state == FRAME_BODY ? f->remaining : -1;
+            if (relay_spliced(serverfd, clientfd, len) < 0) {
+                metric_add(METRIC_CLIENT_ERRORS, 1);
+                return RELAY_FAILED;
+            }
+            framer_skip(f, len);
+            break;
+        }
+        ssize_t n = read(serverfd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 && !responded) {
+            return RELAY_NO_RESPONSE;
+        }
+        if (n == 0 && framer_eof(f)) {
+            break;
+        }
+        if (n <= 0) {
+            metric_add(METRIC_ORIGIN_ERRORS, 1);
+            return RELAY_FAILED;
+        }
+        responded = true;
+        metric_add(METRIC_ORIGIN_BYTES_IN, n);
+        size_t used = framer_feed(f, buf, n);
+        if (used < (size_t)n) {
+            // more than the response was sent, the connection is unusable
+            f->keep_alive = false;
+        }
+        response_collect(response, f, buf, used);
+        if (clientfd < 0) {
+            continue;
+        }
+        if (rio_writen(clientfd, buf, used) < 0) {
+            metric_add(METRIC_CLIENT_ERRORS, 1);
+            return RELAY_FAILED;
+        }
+        metric_add(METRIC_CLIENT_BYTES_OUT, used);
+    }
+    return framer_reusable(f) ? RELAY_REUSABLE : RELAY_COMPLETE;
+}
+
+/*
+ * Streams the response another request is fetching to clientfd, and sets
+ * *status from its status line. Returns 1 if it was complete and delimited,
+ * 0 if not, and -1 if the flight dropped it before any of it was sent, so
+ * that the request has to fetch it itself.
+ */
+int follow_flight(int clientfd, struct flight *fl, int *status) {
+    char buf[MAXLINE];
+    struct flight_follower f = {.wake = NULL};
+    flight_follow(fl, &f);
+    ssize_t n;
+    while ((n = flight_read(fl, &f, buf, sizeof(buf), true)) > 0) {
+        if (f.off == (size_t)n) {
+            *status = status_of(buf, n);
+        }
+        if (rio_writen(clientfd, buf, n) < 0) {
+            break;
+        }
+        metric_add(METRIC_CLIENT_BYTES_OUT, n);
+    }
+    flight_unfollow(fl, &f);
+    int rc = n == FLIGHT_DROPPED ? -1 : n == 0 && fl->delimited;
+    flight_release(fl);
+    return rc;
+}
+
+/*
+ * Sends a request to the origin and relays the response, over a pooled
+ * connection if there is one. A pooled connection the origin has closed
+ * meanwhile only shows that once it is used, so the request then moves on
+ * to another connection.
+ */
+enum relay_result fetch_origin(struct destination *dest, char *request,
+                               int request_len, int clientfd,
+                               struct framer *framer,
+                               struct response_buf *response) {
+    struct dns_addrs addrs;
+    addrs.n = 0;
+    enum relay_result result = RELAY_NO_RESPONSE;
+    bool reused = true;
+    while (result == RELAY_NO_RESPONSE && reused) {
+        int serverfd = pool_checkout(dest->host, dest->port);
+        reused = serverfd >= 0;
+        if (reused && pool_nonblocking) {
+            fcntl(serverfd, F_SETFL, 0);
+        }
+        if (!reused && !addrs.n && dns_resolve(dest->host, &addrs) < 0) {
+            metric_add(METRIC_DNS_ERRORS, 1);
+            break;
+        }
+        unsigned long connect_start = monotonic_ns();
+        if (!reused &&
+            (serverfd = open_origin_fd(&addrs, dest->port, false)) < 0) {
+            metric_add(METRIC_CONNECT_ERRORS, 1);
+            break;
+        }
+        if (!reused) {
+            metric_add(METRIC_ORIGIN_CONNECTS, 1);
+            metric_observe(HIST_CONNECT, monotonic_ns() - connect_start);
+        }
+        if (rio_writen(serverfd, request, request_len) < 0) {
+            metric_add(METRIC_ORIGIN_ERRORS, 1);
+        } else {
+            metric_add(METRIC_ORIGIN_BYTES_OUT, request_len);
+            result = relay_response(serverfd, clientfd, framer, response);
+        }
+        if (result == RELAY_REUSABLE &&
+            (!pool_nonblocking || set_nonblocking(serverfd) == 0)) {
+            pool_checkin(dest->host, dest->port, serverfd);
+        } else {
+            close(serverfd);
+        }
+    }
+    return result;
+}
+
+/*
+ * A stale entry is revalidated by asking the origin for it again with the
+ * validators of the stored response. On a 304 the entry is current again
+ * and its expiry is refreshed in place, while any other response replaces
+ * it. One that cannot be cached is still served to the client waiting for
+ * it, rather than fetched again. Within stale_while_revalidate of its
+ * expiry, the stale entry is served and the revalidation runs in the
+ * background on a revalidator thread. Otherwise the client waits for it:
+ * the threaded server revalidates on the thread serving the client, and the
+ * event loop hands it to a revalidator thread.
+ */
+struct revalidation {
+    struct cache_entry *entry; // the stale copy, pinned
+    char host[MAX_URL_LEN];
+    struct destination dest; // points into host
+    char request[MAXLINE];
+    int request_len;
+    bool must_revalidate; // the stale copy may not be served on errors
+    bool current;         // the entry can be served after all
+    struct cache_entry *replacement; // pinned, what came instead of a 304
+    void (*done)(void *arg); // called when over, unless in the background
+    void *arg;
+    struct revalidation *next;
+};
+
+static struct revalidation *revalidation_head, *revalidation_tail;
+static pthread_mutex_t revalidation_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t revalidation_queued = PTHREAD_COND_INITIALIZER;
+
+atomic_bool *revalidating(struct cache_entry *entry) {
+    return entry->disk ? &entry->disk->revalidating : &entry->revalidating;
+}
+
+void revalidation_queue(struct revalidation *rv) {
+    pthread_mutex_lock(&revalidation_lock);
+    rv->next = NULL;
+    if (revalidation_tail) {
+        revalidation_tail->next = rv;
+    } else {
+        revalidation_head = rv;
+    }
+    revalidation_tail = rv;
+    pthread_cond_signal(&revalidation_queued);
+    pthread_mutex_unlock(&revalidation_lock);
+}
+
+/*
+ * Sets up revalidating a stale entry a client asked for. In the background,
+ * it is queued unless it already is, and NULL is returned to have the entry
+ * served as it is. Otherwise the revalidation, which takes over the caller's
+ * reference to the entry, is returned to be run or queued.
+ */
+struct revalidation *revalidation_start(struct cache_entry *entry,
+                                        char *uri_path, struct headers *hdr) {
+    int stale = atomic_load_explicit(&stale_while_revalidate,
+                                     memory_order_relaxed);
+    bool background = time(NULL) < atomic_load(&entry->expires) + stale;
+    if (background && atomic_exchange(revalidating(entry), true)) {
+        return NULL;
+    }
+    struct revalidation *rv = Calloc(1, sizeof(*rv));
+    char head[MAXLINE];
+    struct freshness f;
+    freshness_init(&f);
+    scan_freshness(head, entry_head(entry, head, sizeof(head)), &f);
+    rv->must_revalidate = f.must_revalidate;
+    int len = build_origin_request(rv->request, uri_path, hdr);
+    if (*f.etag) {
+        len = add_request_header(rv->request, len, "If-None-Match", f.etag);
+    }
+    if (*f.last_modified_value) {
+        len = add_request_header(rv->request, len, "If-Modified-Since",
+                                 f.last_modified_value);
+    }
+    rv->request_len = len;
+    snprintf(rv->host, sizeof(rv->host), "%s", hdr->host);
+    parse_host(rv->host, &rv->dest);
+    rv->entry = entry;
+    if (background) {
+        pin_entry(entry);
+        revalidation_queue(rv);
+        return NULL;
+    }
+    return rv;
+}
+
+void revalidate(struct revalidation *rv) {
+    struct cache_entry *entry = rv->entry;
+    struct framer framer;
+    struct response_buf response;
+    response_init(&response);
+    metric_add(METRIC_REVALIDATIONS, 1);
+    enum relay_result result = fetch_origin(
+        &rv->dest, rv->request, rv->request_len, -1, &framer, &response);
+    if (result != RELAY_REUSABLE && result != RELAY_COMPLETE) {
+        rv->current = !rv->must_revalidate;
+    } else if (framer.status == 304) {
+        // what the 304 sends updates what was stored
+        char head[MAXLINE];
+        struct freshness f;
+        freshness_init(&f);
+        scan_freshness(head, entry_head(entry, head, sizeof(head)), &f);
+        scan_freshness(response.data, response.len, &f);
+        time_t expires = freshness_expiry(&f, time(NULL));
+        atomic_store(&entry->expires, expires);
+        if (entry->disk) {
+            disk_refresh(entry->disk, expires);
+        }
+        rv->current = true;
+    } else if (!response.abandoned && response.len) {
+        rv->replacement = cache_response(entry->url, response.data,
+                                         response.len, framer.delimited);
+        if (!rv->replacement) {
+            rv->replacement = uncached_entry(entry->url, response.data,
+                                             response.len, framer.delimited);
+            response.data = NULL;
+        }
+    }
+    response_discard(&response);
+}
+
+// what to serve once rv is over, pinned, or NULL if it has to be fetched
+struct cache_entry *revalidation_finish(struct revalidation *rv) {
+    struct cache_entry *entry = rv->current ? rv->entry : rv->replacement;
+    if (!rv->current) {
+        release_entry(rv->entry);
+    }
+    Free(rv);
+    return entry;
+}
+
+void *revalidator_thread(void *vargp) {
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&revalidation_lock);
+        while (!revalidation_head) {
+            pthread_cond_wait(&revalidation_queued, &revalidation_lock);
+        }
+        struct revalidation *rv = revalidation_head;
+        if (!(revalidation_head = rv->next)) {
+            revalidation_tail = NULL;
+        }
+        pthread_mutex_unlock(&revalidation_lock);
+
+        revalidate(rv);
+        if (rv->done) {
+            // rv belongs to whoever is called back from here on
+            rv->done(rv->arg);
+            continue;
+        }
+        atomic_store(revalidating(rv->entry), false);
+        struct cache_entry *entry = revalidation_finish(rv);
+        if (entry) {
+            release_entry(entry);
+        }
+    }
+    return NULL;
+}
+
+void init_revalidators(void) {
+    pthread_t tid;
+    for (int i = 0; i < REVALIDATOR_THREADS; i++) {
+        Pthread_create(&tid, NULL, revalidator_thread, NULL);
+    }
+}
+
+/*
+ * The part of serve_request after the request has been read. Returns
+ * whether the response was complete and delimited.
+ */
+bool serve_traced(int clientfd, char *uri, char *uri_path,
+                  struct headers *hdr, struct trace *trace) {
+    char to_server_buf[MAXLINE];
+    struct cache_entry *entry = cache_get(uri);
+    struct revalidation *rv;
+    if (entry && !entry_fresh(entry, time(NULL)) &&
+        (rv = revalidation_start(entry, uri_path, hdr))) {
+        revalidate(rv);
+        entry = revalidation_finish(rv);
+    }
+    if (entry) {
+        struct reply reply;
+        plan_reply(&reply, entry, hdr);
+        trace->cache = CACHE_HIT;
+        trace->status = reply_status(entry, &reply);
+        bool delimited = write_reply_all(clientfd, entry, &reply) >= 0 &&
+                         entry->delimited;
+        Free(reply.head);
+        release_entry(entry);
+        return delimited;
+    }
+    // partial responses are neither cached nor shared
+    bool ranged = *hdr->range, leader = true;
+    struct flight *flight = ranged ? NULL : flight_join(uri, &leader);
+    int followed;
+    if (!leader &&
+        (followed = follow_flight(clientfd, flight, &trace->status)) >= 0) {
+        trace->cache = CACHE_COALESCED;
+        return followed;
+    }
+    if (!leader) {
+        flight = NULL; // too large to share, so it is fetched alone
+    }
+
+    struct destination dest;
+    parse_host(hdr->host, &dest);
+    int request_len = build_origin_request(to_server_buf, uri_path, hdr);
+    request_len = add_range_headers(to_server_buf, request_len, hdr);
+
+    struct response_buf response;
+    response_init(&response);
+    response.flight = flight;
+    if (ranged) {
+        response_discard(&response);
+    }
+    struct framer framer;
+    enum relay_result result = fetch_origin(&dest, to_server_buf, request_len,
+                                            clientfd, &framer, &response);
+    if (result == RELAY_REUSABLE || result == RELAY_COMPLETE) {
+        response_commit(&response, uri, framer.delimited);
+        trace->status = framer.status;
+        return framer.delimited;
+    }
+    response_fail(&response);
+    return false;
+}
+
+/*
+ * Serves one request on a client connection and returns whether the
+ * connection stays open for the next one.
+ */
+bool serve_request(int clientfd, rio_t *client_rio) {
+    // read request headers
+    // if no host header, attach www.cmu.edu host header
+    // always attach user-agent: <user_agent_hdr>
+    // always attach connection: keep-alive
+    // forward request as http/1.1 to server, over a pooled connection if any
+    // forward server response to client
+    char uri[MAX_URL_LEN];
+    struct request request;
+    int rc = read_request(client_rio, &request);
+    if (rc <= 0) {
+        // a timeout or EOF simply ends an idle connection
+        if (rc < 0) {
+            metric_add(METRIC_CLIENT_ERRORS, 1);
+        }
+        return false;
+    }
+    char *head = client_rio->rio_buf;
+    struct headers hdr;
+    char *uri_path;
+    if (slice_copy(uri, sizeof(uri), head, request.uri) < 0 ||
+        !(uri_path = uri_path_of(uri)) ||
+        scan_headers(&request, head, &hdr) < 0) {
+        metric_add(METRIC_BAD_REQUESTS, 1);
+        return false;
+    }
+    bool keep_alive = client_keep_alive(&request, head, &hdr);
+    struct trace trace;
+    trace_start(&trace, head + request.method.off, request.method.len,
+                request.pos);
+    // only this thread writes to the client, so its count is the request's
+    unsigned long sent = metric_own(METRIC_CLIENT_BYTES_OUT);
+    keep_alive = serve_traced(clientfd, uri, uri_path, &hdr, &trace) &&
+                 keep_alive;
+    trace.bytes = metric_own(METRIC_CLIENT_BYTES_OUT) - sent;
+    trace_end(&trace, uri);
+    return keep_alive;
+}
+
+/*
+ * Serves requests on a client connection until the client closes it, stays
+ * idle for client_idle_timeout or reaches max_client_requests. Pipelined
+ * requests simply wait in client_rio and are answered in order. Once
+ * draining, the connection closes after the requests already sent.
+ */
+void forward(int clientfd) {
+    rio_t client_rio;
+    rio_readinitb(&client_rio, clientfd);
+    struct timeval idle = {
+        .tv_sec = atomic_load_explicit(&client_idle_timeout,
+                                       memory_order_relaxed)};
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    set_nodelay(clientfd);
+    int served = 0;
+    while (serve_request(clientfd, &client_rio) &&
+           ++served < atomic_load_explicit(&max_client_requests,
+                                           memory_order_relaxed) &&
+           !(draining && !client_rio.rio_cnt)) {
+    }
+    close(clientfd);
+    atomic_fetch_sub(&open_clients, 1);
+}
+
+void sigchld_handler(int sig) {
+    while (waitpid(-1, 0, WNOHANG) > 0) {
+    }
+    return;
+}
+
+void *forward_thread(void *vargp) {
+    int clientfd = *(int *)vargp;
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    forward(clientfd);
+    return NULL;
+}
+
+/*
+ * A minimal io_uring, set up with the raw system calls as there is no
+ * liburing to lean on. Submissions are queued in the shared ring and go to
+ * the kernel all at once in uring_enter, which also waits for completions.
+ */
+struct uring {
+    int fd;
+    atomic_uint *sq_head;
+    atomic_uint *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int queued; // submissions the kernel has not seen yet
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/*
+ * Sets up a ring with room for entries submissions. Fails with ENOSYS on
+ * kernels that lack what the workers rely on: a single mapping for both
+ * rings, completions that are never dropped, operations that wait for their
+ * socket instead of failing with EAGAIN, timeouts when waiting, and taking
+ * what a submission points to at once, rather than when the operation runs.
+ */
+int uring_init(struct uring *u, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return -1;
+    }
+    unsigned int needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                          IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG |
+                          IORING_FEAT_SUBMIT_STABLE;
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings;
+    if ((p.features & needed) != needed) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    if ((rings = mmap(NULL, sq_len > cq_len ? sq_len : cq_len,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED ||
+        (u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        u->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sq_head = (atomic_uint *)(rings + p.sq_off.head);
+    u->sq_tail = (atomic_uint *)(rings + p.sq_off.tail);
+    u->sq_array = (unsigned int *)(rings + p.sq_off.array);
+    u->sq_mask = *(unsigned int *)(rings + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->queued = 0;
+    u->cq_head = (atomic_uint *)(rings + p.cq_off.head);
+    u->cq_tail = (atomic_uint *)(rings + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(rings + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Submits what is queued and waits for at least wait completions, for no
+ * longer than timeout_ms if that is not negative.
+ */
+int uring_enter(struct uring *u, unsigned int wait, int timeout_ms) {
+    struct __kernel_timespec ts = {timeout_ms / 1000,
+                                   timeout_ms % 1000 * 1000000L};
+    struct io_uring_getevents_arg arg = {0};
+    arg.ts = timeout_ms >= 0 ? (unsigned long)&ts : 0;
+    unsigned int flags =
+        IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+    int n = syscall(__NR_io_uring_enter, u->fd, u->queued, wait, flags, &arg,
+                    sizeof(arg));
+    if (n >= 0) {
+        u->queued -= n;
+    }
+    return n;
+}
+
+// queues a cleared submission for the caller to fill in
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned int tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(u->sq_head, memory_order_acquire) ==
+        u->sq_entries) {
+        // full, so make room
+        uring_enter(u, 0, -1);
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    // the kernel only looks at it in uring_enter, by when it is filled in
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+    u->queued++;
+    return sqe;
+}
+
+// the oldest completion not yet seen, or NULL
+struct io_uring_cqe *uring_peek(struct uring *u) {
+    unsigned int head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(u->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_seen(struct uring *u) {
+    atomic_fetch_add_explicit(u->cq_head, 1, memory_order_release);
+}
+
+/*
+ * Event-driven mode. Every worker owns an epoll instance and its own
+ * SO_REUSEPORT listener, so the kernel spreads new connections across the
+ * workers and the cache is the only state they share. Client and origin
+ * sockets are non-blocking and edge-triggered; a connection is a small state
+ * machine that is advanced until the socket it waits on would block. With
+ * -u, the workers drive the same state machine through io_uring instead, see
+ * conn_io.
+ */
+enum conn_state {
+    READ_REQUEST,
+    RESOLVING,     // waiting for the resolver, see conn_wake
+    REVALIDATING,  // waiting for a revalidator, see revalidation_start
+    FOLLOW_FLIGHT, // streaming another request's response, see flight_join
+    WRITE_ORIGIN,
+    RELAY_RESPONSE,
+    RELAY_SPLICED,
+    WRITE_CACHED,
+    DONE,
+};
+
+struct conn {
+    struct worker *worker;
+    enum conn_state state;
+    int clientfd;
+    int serverfd;
+    char uri[MAX_URL_LEN];
+    char in[MAXLINE]; // request line and headers read so far
+    size_t in_len;
+    struct request request; // parsed from in as it arrives
+    size_t request_end; // where the next pipelined request starts in in
+    bool keep_alive;    // the client connection outlives this request
+    int served;
+    bool idle; // waiting for a request, see idle_push
+    time_t idle_since;
+    struct conn *idle_prev;
+    struct conn *idle_next;
+    char host[MAX_URL_LEN];
+    char port[16];
+    char buf[MAXLINE]; // origin request, then response chunks
+    size_t request_len;
+    bool reused;    // serverfd came from the pool
+    bool responded; // the origin has sent part of a response
+    struct framer framer;
+    struct response_buf response;
+    struct cache_entry *hit; // pinned while it is written out
+    struct reply reply;      // what is written of it
+    struct revalidation *revalidation; // of a stale hit, in REVALIDATING
+    char *out;               // pending output, points into buf
+    size_t out_len;
+    size_t out_off;
+    int pipefd[2]; // for RELAY_SPLICED
+    size_t piped;  // bytes sitting in the pipe
+    struct flight *flight; // followed in FOLLOW_FLIGHT
+    struct flight_follower follower;
+    struct trace trace;
+    unsigned long connect_start; // ns, while a new origin connection connects
+    bool woken; // on the worker's woken list
+    struct conn *next_closed;
+    struct conn *next_woken;
+    // with io_uring, the operation under way, see conn_io
+    bool io_pending;
+    bool io_done;  // it is over, and its result is in io_res
+    int io_res;    // bytes moved, or a negative errno
+    struct msghdr io_msg; // for a hit, which the kernel reads on submission
+    struct iovec io_iov[ENTRY_IOV];
+};
+
+struct worker {
+    int listenfd; // -1 once draining
+    int epfd;
+    // connections closed during the current batch of events. They are freed
+    // once the batch is done, since a later event may still point to them.
+    struct conn *closed;
+    // connections waiting for a request, the longest waiting first
+    struct conn *idle_head;
+    struct conn *idle_tail;
+    // connections other threads have made progress for, such as resolving
+    // their origin host or relaying more of a flight they follow. They are
+    // handed back through notifyfd.
+    int notifyfd;
+    pthread_mutex_t woken_lock;
+    struct conn *woken;
+    struct uring *ring; // instead of epfd with -u
+};
+
+int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd, optval = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+        return -2;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) <
+            0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p) {
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0 || set_nonblocking(listenfd) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+void idle_push(struct worker *w, struct conn *c) {
+    c->idle = true;
+    c->idle_since = time(NULL);
+    c->idle_next = NULL;
+    c->idle_prev = w->idle_tail;
+    if (w->idle_tail) {
+        w->idle_tail->idle_next = c;
+    } else {
+        w->idle_head = c;
+    }
+    w->idle_tail = c;
+}
+
+void idle_remove(struct worker *w, struct conn *c) {
+    if (!c->idle) {
+        return;
+    }
+    if (c->idle_prev) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        w->idle_head = c->idle_next;
+    }
+    if (c->idle_next) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        w->idle_tail = c->idle_prev;
+    }
+    c->idle = false;
+}
+
+/*
+ * Stops following a flight. A connection that has been woken meanwhile is
+ * taken off the woken list again, since it might not survive until then.
+ */
+void conn_unfollow(struct worker *w, struct conn *c) {
+    if (!c->flight) {
+        return;
+    }
+    flight_unfollow(c->flight, &c->follower);
+    flight_release(c->flight);
+    c->flight = NULL;
+    pthread_mutex_lock(&w->woken_lock);
+    if (c->woken) {
+        struct conn **link = &w->woken;
+        while (*link != c) {
+            link = &(*link)->next_woken;
+        }
+        *link = c->next_woken;
+        c->woken = false;
+    }
+    pthread_mutex_unlock(&w->woken_lock);
+}
+
+/*
+ * With io_uring, a connection that still has an operation under way is only
+ * freed once that is over, see conn_complete. Shutting its sockets down ends
+ * the operation, which could otherwise wait on them for ever.
+ */
+void conn_close(struct worker *w, struct conn *c) {
+    if (c->trace.start) {
+        trace_end(&c->trace, c->uri);
+    }
+    idle_remove(w, c);
+    conn_unfollow(w, c);
+    if (c->io_pending) {
+        shutdown(c->clientfd, SHUT_RDWR);
+        if (c->serverfd >= 0) {
+            shutdown(c->serverfd, SHUT_RDWR);
+        }
+    }
+    close(c->clientfd);
+    if (c->serverfd >= 0) {
+        close(c->serverfd);
+    }
+    if (c->pipefd[0] >= 0) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    response_fail(&c->response);
+    c->state = DONE;
+    atomic_fetch_sub(&open_clients, 1);
+    if (!c->io_pending) {
+        c->next_closed = w->closed;
+        w->closed = c;
+    }
+}
+
+void conn_free(struct conn *c) {
+    if (c->hit) {
+        release_entry(c->hit);
+        Free(c->reply.head);
+    }
+    Free(c);
+}
+
+// counts bytes written to the client
+void conn_sent(struct conn *c, size_t n) {
+    c->trace.bytes += n;
+    metric_add(METRIC_CLIENT_BYTES_OUT, n);
+}
+
+/*
+ * With io_uring, the I/O calls of a connection submit an operation and fail
+ * with EAGAIN, as they would on a non-blocking socket. Once the operation is
+ * over, conn_advance runs again and makes the same call, which now returns
+ * what the operation did. A connection only ever waits for one thing, so it
+ * has one operation under way at most. Returns true if the call is to return
+ * n rather than submit an operation.
+ */
+bool conn_io(struct conn *c, ssize_t *n) {
+    if (c->io_pending) {
+        errno = EAGAIN;
+        *n = -1;
+        return true;
+    }
+    if (!c->io_done) {
+        return false;
+    }
+    c->io_done = false;
+    if (c->io_res < 0) {
+        errno = -c->io_res;
+        *n = -1;
+    } else {
+        *n = c->io_res;
+    }
+    return true;
+}
+
+/*
+ * Submits a send or receive of len bytes at buf, or for sendmsg of the
+ * msghdr at buf, and reports it under way.
+ */
+ssize_t conn_submit(struct conn *c, int opcode, int fd, const void *buf,
+                    size_t len) {
+    struct io_uring_sqe *sqe = uring_sqe(c->worker->ring);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = (unsigned long)c;
+    if (opcode != IORING_OP_RECV) {
+        // have the kernel finish a short send itself
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    }
+    c->io_pending = true;
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t conn_read(struct conn *c, int fd, void *buf, size_t len) {
+    ssize_t n;
+    if (!c->worker->ring) {
+        return read(fd, buf, len);
+    }
+    if (conn_io(c, &n)) {
+        return n;
+    }
+    return conn_submit(c, IORING_OP_RECV, fd, buf, len);
+}
+
+ssize_t conn_write(struct conn *c, int fd, const void *buf, size_t len) {
+    ssize_t n;
+    if (!c->worker->ring) {
+        return write(fd, buf, len);
+    }
+    if (conn_io(c, &n)) {
+        return n;
+    }
+    return conn_submit(c, IORING_OP_SEND, fd, buf, len);
+}
+
+// write_reply to the client, as a single sendmsg with io_uring
+ssize_t conn_write_reply(struct conn *c, size_t off) {
+    ssize_t n;
+    if (!c->worker->ring) {
+        return write_reply(c->clientfd, c->hit, &c->reply, off);
+    }
+    if (conn_io(c, &n)) {
+        return n;
+    }
+    memset(&c->io_msg, 0, sizeof(c->io_msg));
+    c->io_msg.msg_iov = c->io_iov;
+    c->io_msg.msg_iovlen = reply_iov(c->hit, &c->reply, off, c->io_iov);
+    return conn_submit(c, IORING_OP_SENDMSG, c->clientfd, &c->io_msg, 0);
+}
+
+/*
+ * Writes pending output to fd. Returns 1 once everything has been written, 0
+ * if fd would block and -1 on error.
+ */
+int flush_out(int fd, struct conn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n =
+            conn_write(c, fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (fd == c->clientfd) {
+            conn_sent(c, n);
+        } else {
+            metric_add(METRIC_ORIGIN_BYTES_OUT, n);
+        }
+        c->out_off += n;
+    }
+    return 1;
+}
+
+// flush_out for a cache hit, whose reply is written from c->hit
+int flush_entry(struct conn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = conn_write_reply(c, c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn_sent(c, n);
+        c->out_off += n;
+    }
+    return 1;
+}
+
+/*
+ * Reads from the client until the end of the request head, parsing what has
+ * arrived as it goes. Returns 1 when the whole head is in c->in, 0 if the
+ * client would block and -1 on error or if the request is malformed or does
+ * not fit.
+ */
+int read_request_nb(struct conn *c) {
+    int rc;
+    while ((rc = parse_request(&c->request, c->in, c->in_len)) == 0) {
+        if (c->in_len == sizeof(c->in)) {
+            return -1;
+        }
+        ssize_t n = conn_read(c, c->clientfd, c->in + c->in_len,
+                              sizeof(c->in) - c->in_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        c->in_len += n;
+    }
+    return rc;
+}
+
+// runs on a resolver thread or on the leader of a followed flight
+void conn_wake(void *arg) {
+    struct conn *c = arg;
+    struct worker *w = c->worker;
+    pthread_mutex_lock(&w->woken_lock);
+    bool notify = !c->woken;
+    if (notify) {
+        c->woken = true;
+        c->next_woken = w->woken;
+        w->woken = c;
+    }
+    pthread_mutex_unlock(&w->woken_lock);
+    if (notify) {
+        eventfd_write(w->notifyfd, 1);
+    }
+}
+
+/*
+ * Takes a pooled connection to the origin or starts connecting a new one, and
+ * sets up sending the request in c->buf on it. If the origin host has to be
+ * resolved first, the connection waits in RESOLVING and this is called again
+ * once the resolver is done.
+ */
+int connect_origin(struct worker *w, struct conn *c) {
+    c->serverfd = pool_checkout(c->host, c->port);
+    c->reused = c->serverfd >= 0;
+    if (!c->reused) {
+        struct dns_addrs addrs;
+        int rc = dns_lookup(c->host, &addrs, conn_wake, c);
+        if (rc == 0) {
+            c->state = RESOLVING;
+            return 0;
+        }
+        if (rc < 0) {
+            metric_add(METRIC_DNS_ERRORS, 1);
+            return -1;
+        }
+        c->connect_start = monotonic_ns();
+        if ((c->serverfd = open_origin_fd(&addrs, c->port, true)) < 0) {
+            metric_add(METRIC_CONNECT_ERRORS, 1);
+            return -1;
+        }
+        metric_add(METRIC_ORIGIN_CONNECTS, 1);
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET,
+                             .data.ptr = c};
+    if (!w->ring && epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->serverfd, &ev) < 0) {
+        return -1;
+    }
+    c->out = c->buf;
+    c->out_len = c->request_len;
+    c->out_off = 0;
+    c->responded = false;
+    framer_init(&c->framer);
+    c->state = WRITE_ORIGIN;
+    return 0;
+}
+
+/*
+ * A pooled connection the origin has closed meanwhile only shows that once it
+ * is used. Until the origin has responded, the request can move on to
+ * another connection.
+ */
+bool retry_origin(struct worker *w, struct conn *c) {
+    if (!c->reused || c->responded) {
+        return false;
+    }
+    close(c->serverfd);
+    c->serverfd = -1;
+    return connect_origin(w, c) == 0;
+}
+
+void conn_advance(struct worker *w, struct conn *c);
+
+/*
+ * Done with one request. A persistent client connection goes back to reading
+ * requests, starting with whatever the client has already pipelined, as long
+ * as the response it got was delimited. Once draining, only what it has
+ * pipelined is still served.
+ */
+void next_request(struct worker *w, struct conn *c, bool delimited) {
+    trace_end(&c->trace, c->uri);
+    if (!c->keep_alive || !delimited ||
+        ++c->served >= atomic_load_explicit(&max_client_requests,
+                                            memory_order_relaxed) ||
+        (draining && c->in_len == c->request_end)) {
+        conn_close(w, c);
+        return;
+    }
+    if (c->serverfd >= 0) {
+        close(c->serverfd);
+        c->serverfd = -1;
+    }
+    if (c->pipefd[0] >= 0) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+        c->pipefd[0] = c->pipefd[1] = -1;
+    }
+    if (c->hit) {
+        release_entry(c->hit);
+        Free(c->reply.head);
+        c->hit = NULL;
+    }
+    conn_unfollow(w, c);
+    response_init(&c->response);
+    c->in_len -= c->request_end;
+    memmove(c->in, c->in + c->request_end, c->in_len);
+    request_init(&c->request);
+    c->state = READ_REQUEST;
+    idle_push(w, c);
+    conn_advance(w, c);
+}
+
+// the origin connection goes back to the pool if the response allows it
+void finish_response(struct worker *w, struct conn *c) {
+    if (framer_reusable(&c->framer) &&
+        (w->ring ||
+         epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->serverfd, NULL) == 0)) {
+        pool_checkin(c->host, c->port, c->serverfd);
+        c->serverfd = -1;
+    }
+    response_commit(&c->response, c->uri, c->framer.delimited);
+    c->trace.status = c->framer.status;
+    next_request(w, c, c->framer.delimited);
+}
+
+void start_hit(struct conn *c, struct headers *hdr) {
+    plan_reply(&c->reply, c->hit, hdr);
+    c->trace.cache = CACHE_HIT;
+    c->trace.status = reply_status(c->hit, &c->reply);
+    c->out_len = reply_len(&c->reply);
+    c->out_off = 0;
+    c->state = WRITE_CACHED;
+}
+
+/*
+ * A miss joins the flight for its url, or leads it by asking the origin.
+ * Unless shared, as when the flight it followed dropped the response, it is
+ * fetched alone.
+ */
+int start_fetch(struct worker *w, struct conn *c, char *uri_path,
+                struct headers *hdr, bool share) {
+    // partial responses are neither cached nor shared
+    bool ranged = *hdr->range, leader = true;
+    struct flight *flight =
+        ranged || !share ? NULL : flight_join(c->uri, &leader);
+    if (!leader) {
+        c->trace.cache = CACHE_COALESCED;
+        c->flight = flight;
+        c->out_len = c->out_off = 0;
+        c->follower.wake = conn_wake;
+        c->follower.arg = c;
+        flight_follow(flight, &c->follower);
+        c->state = FOLLOW_FLIGHT;
+        return 0;
+    }
+    c->response.flight = flight;
+    if (ranged) {
+        response_discard(&c->response);
+    }
+
+    struct destination dest;
+    parse_host(hdr->host, &dest);
+    snprintf(c->host, sizeof(c->host), "%s", dest.host);
+    snprintf(c->port, sizeof(c->port), "%s", dest.port);
+    c->request_len = build_origin_request(c->buf, uri_path, hdr);
+    c->request_len = add_range_headers(c->buf, c->request_len, hdr);
+    return connect_origin(w, c);
+}
+
+// the revalidation of a stale hit is over, called on the worker
+int revalidated(struct worker *w, struct conn *c) {
+    c->hit = revalidation_finish(c->revalidation);
+    c->revalidation = NULL;
+    // the request parsed before, and still sits in c->in
+    struct headers hdr;
+    scan_headers(&c->request, c->in, &hdr);
+    if (c->hit) {
+        start_hit(c, &hdr);
+        return 0;
+    }
+    return start_fetch(w, c, uri_path_of(c->uri), &hdr, true);
+}
+
+// the flight followed dropped the response, so the origin is asked directly
+int fetch_dropped(struct worker *w, struct conn *c) {
+    conn_unfollow(w, c);
+    c->trace.cache = CACHE_MISS;
+    struct headers hdr;
+    scan_headers(&c->request, c->in, &hdr);
+    return start_fetch(w, c, uri_path_of(c->uri), &hdr, false);
+}
+
+/*
+ * Same steps as forward, but the origin connection is only started here and
+ * then driven by conn_advance.
+ */
+int start_request(struct worker *w, struct conn *c) {
+    idle_remove(w, c);
+    struct request *request = &c->request;
+    c->request_end = request->pos;
+    struct headers hdr;
+    char *uri_path;
+    if (slice_copy(c->uri, sizeof(c->uri), c->in, request->uri) < 0 ||
+        !(uri_path = uri_path_of(c->uri)) ||
+        scan_headers(request, c->in, &hdr) < 0) {
+        metric_add(METRIC_BAD_REQUESTS, 1);
+        return -1;
+    }
+    c->keep_alive = client_keep_alive(request, c->in, &hdr);
+    trace_start(&c->trace, c->in + request->method.off, request->method.len,
+                request->pos);
+
+    if ((c->hit = cache_get(c->uri)) && !entry_fresh(c->hit, time(NULL)) &&
+        (c->revalidation = revalidation_start(c->hit, uri_path, &hdr))) {
+        c->hit = NULL;
+        c->revalidation->done = conn_wake;
+        c->revalidation->arg = c;
+        revalidation_queue(c->revalidation);
+        c->state = REVALIDATING;
+        return 0;
+    }
+    if (c->hit) {
+        start_hit(c, &hdr);
+        return 0;
+    }
+    return start_fetch(w, c, uri_path, &hdr, true);
+}
+
+/*
+ * Both sockets of a connection point at the same conn, so this is called for
+ * events on either of them and simply makes as much progress as it can.
+ * Writing to an origin socket whose connect is still in progress fails with
+ * EAGAIN, which is why there is no separate connecting state.
+ */
+void conn_advance(struct worker *w, struct conn *c) {
+    int rc;
+    switch (c->state) {
+    case READ_REQUEST:
+        if ((rc = read_request_nb(c)) == 0) {
+            return;
+        }
+        if (rc < 0 || start_request(w, c) < 0) {
+            conn_close(w, c);
+            return;
+        }
+        conn_advance(w, c);
+        return;
+    case RESOLVING:
+    case REVALIDATING:
+        return;
+    case FOLLOW_FLIGHT:
+        while (1) {
+            if ((rc = flush_out(c->clientfd, c)) == 0) {
+                return;
+            }
+            if (rc < 0) {
+                conn_close(w, c);
+                return;
+            }
+            ssize_t n = flight_read(c->flight, &c->follower, c->buf,
+                                    sizeof(c->buf), false);
+            if (n == FLIGHT_PENDING) {
+                return;
+            }
+            if (n == FLIGHT_DROPPED) {
+                if (fetch_dropped(w, c) < 0) {
+                    conn_close(w, c);
+                    return;
+                }
+                conn_advance(w, c);
+                return;
+            }
+            if (n < 0) {
+                conn_close(w, c);
+                return;
+            }
+            if (n == 0) {
+                next_request(w, c, c->flight->delimited);
+                return;
+            }
+            if (c->follower.off == (size_t)n) {
+                c->trace.status = status_of(c->buf, n);
+            }
+            c->out = c->buf;
+            c->out_len = n;
+            c->out_off = 0;
+        }
+    case WRITE_ORIGIN:
+        if ((rc = flush_out(c->serverfd, c)) == 0) {
+            return;
+        }
+        if (rc > 0 && c->connect_start) {
+            // the request could only be written once the connect completed
+            metric_observe(HIST_CONNECT, monotonic_ns() - c->connect_start);
+        }
+        c->connect_start = 0;
+        if (rc < 0 && retry_origin(w, c)) {
+            conn_advance(w, c);
+            return;
+        }
+        if (rc < 0) {
+            metric_add(METRIC_ORIGIN_ERRORS, 1);
+            conn_close(w, c);
+            return;
+        }
+        c->out_len = c->out_off = 0;
+        c->state = RELAY_RESPONSE;
+        conn_advance(w, c);
+        return;
+    case RELAY_RESPONSE:
+        while (1) {
+            if ((rc = flush_out(c->clientfd, c)) == 0) {
+                return;
+            }
+            if (rc < 0) {
+                metric_add(METRIC_CLIENT_ERRORS, 1);
+                conn_close(w, c);
+                return;
+            }
+            if (c->framer.state == FRAME_DONE) {
+                finish_response(w, c);
+                return;
+            }
+            if (use_splice && !w->ring && response_spliceable(&c->response) &&
+                (c->framer.state == FRAME_BODY ||
+                 c->framer.state == FRAME_UNTIL_CLOSE) &&
+                pipe(c->pipefd) == 0) {
+                c->piped = 0;
+                c->state = RELAY_SPLICED;
+                conn_advance(w, c);
+                return;
+            }
+            ssize_t n = conn_read(c, c->serverfd, c->buf, MAXLINE);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 && retry_origin(w, c)) {
+                conn_advance(w, c);
+                return;
+            }
+            if (n == 0 && framer_eof(&c->framer)) {
+                continue;
+            }
+            if (n <= 0) {
+                metric_add(METRIC_ORIGIN_ERRORS, 1);
+                conn_close(w, c);
+                return;
+            }
+            c->responded = true;
+            metric_add(METRIC_ORIGIN_BYTES_IN, n);
+            size_t used = framer_feed(&c->framer, c->buf, n);
+            if (used < (size_t)n) {
+                // more than the response was sent, the connection is unusable
+                c->framer.keep_alive = false;
+            }
+            response_collect(&c->response, &c->framer, c->buf, used);
+            c->out_len = used;
+            c->out_off = 0;
+        }
+    case RELAY_SPLICED:
+        while (1) {
+            ssize_t n;
+            if (c->piped) {
+                n = splice_fds(c->pipefd[0], c->clientfd, c->piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n < 0 && errno == EAGAIN) {
+                    return;
+                }
+                if (n <= 0) {
+                    metric_add(METRIC_CLIENT_ERRORS, 1);
+                    conn_close(w, c);
+                    return;
+                }
+                conn_sent(c, n);
+                c->piped -= n;
+                continue;
+            }
+            if (c->framer.state == FRAME_DONE) {
+                finish_response(w, c);
+                return;
+            }
+            size_t want = SPLICE_CHUNK;
+            if (c->framer.state == FRAME_BODY &&
+                c->framer.remaining < SPLICE_CHUNK) {
+                want = c->framer.remaining;
+            }
+            n = splice_fds(c->serverfd, c->pipefd[1], want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EAGAIN) {
+                return;
+            }
+            if (n == 0 && framer_eof(&c->framer)) {
+                continue;
+            }
+            if (n <= 0) {
+                metric_add(METRIC_ORIGIN_ERRORS, 1);
+                conn_close(w, c);
+                return;
+            }
+            metric_add(METRIC_ORIGIN_BYTES_IN, n);
+            framer_skip(&c->framer, n);
+            c->piped = n;
+        }
+    case WRITE_CACHED:
+        if ((rc = flush_entry(c)) > 0) {
+            next_request(w, c, c->hit->delimited);
+        } else if (rc < 0) {
+            conn_close(w, c);
+        }
+        return;
+    case DONE:
+        return;
+    }
+}
+
+// sets up a connection for a client that has just been accepted
+void conn_open(struct worker *w, int clientfd) {
+    struct conn *c = Calloc(1, sizeof(*c));
+    c->worker = w;
+    c->state = READ_REQUEST;
+    c->clientfd = clientfd;
+    c->serverfd = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    request_init(&c->request);
+    response_init(&c->response);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET,
+                             .data.ptr = c};
+    set_nodelay(clientfd);
+    if (!w->ring && (set_nonblocking(clientfd) < 0 ||
+                     epoll_ctl(w->epfd, EPOLL_CTL_ADD, clientfd, &ev) < 0)) {
+        close(clientfd);
+        Free(c);
+        return;
+    }
+    atomic_fetch_add(&open_clients, 1);
+    idle_push(w, c);
+    if (w->ring) {
+        conn_advance(w, c); // to start reading its request
+    }
+}
+
+void accept_clients(struct worker *w) {
+    while (1) {
+        int clientfd = accept(w->listenfd, NULL, NULL);
+        if (clientfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                metric_add(METRIC_ACCEPT_ERRORS, 1);
+            }
+            return;
+        }
+        conn_open(w, clientfd);
+    }
+}
+
+// picks up the connections other threads have woken meanwhile
+void resume_woken(struct worker *w) {
+    eventfd_t count;
+    eventfd_read(w->notifyfd, &count);
+    while (1) {
+        pthread_mutex_lock(&w->woken_lock);
+        struct conn *c = w->woken;
+        if (c) {
+            w->woken = c->next_woken;
+            c->woken = false;
+        }
+        pthread_mutex_unlock(&w->woken_lock);
+        if (!c) {
+            return;
+        }
+        if ((c->state == RESOLVING && connect_origin(w, c) < 0) ||
+            (c->state == REVALIDATING && revalidated(w, c) < 0)) {
+            conn_close(w, c);
+        } else {
+            conn_advance(w, c);
+        }
+    }
+}
+
+/*
+ * Once draining, the worker stops accepting and closes the connections that
+ * are waiting for a request. Those a request has started on stay open.
+ */
+void worker_drain(struct worker *w) {
+    if (w->listenfd >= 0) {
+        if (w->ring) {
+            struct io_uring_sqe *sqe = uring_sqe(w->ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_ACCEPT;
+            sqe->user_data = URING_CANCEL;
+        } else {
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listenfd, NULL);
+        }
+        close(w->listenfd);
+        w->listenfd = -1;
+    }
+    struct conn *c = w->idle_head;
+    while (c) {
+        struct conn *next = c->idle_next;
+        if (!c->in_len) {
+            conn_close(w, c);
+        }
+        c = next;
+    }
+}
+
+// after a batch of events, drops idle clients and frees closed connections
+void worker_sweep(struct worker *w) {
+    if (draining) {
+        worker_drain(w);
+    }
+    time_t now = time(NULL);
+    int idle_timeout =
+        atomic_load_explicit(&client_idle_timeout, memory_order_relaxed);
+    while (w->idle_head && now - w->idle_head->idle_since >= idle_timeout) {
+        conn_close(w, w->idle_head);
+    }
+    while (w->closed) {
+        struct conn *c = w->closed;
+        w->closed = c->next_closed;
+        conn_free(c);
+    }
+}
+
+void *epoll_worker(void *vargp) {
+    struct worker *w = vargp;
+    if ((w->epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    // a NULL data pointer marks the listener
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    // and the worker itself marks its resolver notifications
+    ev.data.ptr = w;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->notifyfd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // wake up now and then to drop clients that stay idle for too long
+        int timeout = w->idle_head ? IDLE_SWEEP_MS : -1;
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(w);
+            } else if (events[i].data.ptr == w) {
+                resume_woken(w);
+            } else {
+                conn_advance(w, c);
+            }
+        }
+        worker_sweep(w);
+    }
+    return NULL;
+}
+
+// queues an accept on the listener, one that keeps accepting if multishot
+void uring_accept(struct worker *w, bool multishot) {
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listenfd;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// queues a wait for conn_wake to notify the worker
+void uring_poll_notify(struct worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->notifyfd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_NOTIFY;
+}
+
+// c's operation is over, having moved res bytes or failed with -res
+void conn_complete(struct worker *w, struct conn *c, int res) {
+    c->io_res = res;
+    c->io_pending = false;
+    c->io_done = true;
+    if (c->state == DONE) {
+        // closed meanwhile, see conn_close
+        c->next_closed = w->closed;
+        w->closed = c;
+        return;
+    }
+    conn_advance(w, c);
+}
+
+/*
+ * An io_uring worker. Accepts come from a multishot accept where the kernel
+ * has them, and one at a time elsewhere. Whatever the connections submit
+ * while a batch of completions is handled goes to the kernel in the same
+ * system call that waits for the next batch.
+ */
+void *uring_worker(void *vargp) {
+    struct worker *w = vargp;
+    w->ring = Malloc(sizeof(*w->ring));
+    if (uring_init(w->ring, URING_ENTRIES) < 0) {
+        unix_error("io_uring_setup error");
+    }
+    bool multishot = true;
+    uring_accept(w, multishot);
+    uring_poll_notify(w);
+
+    while (1) {
+        int timeout = w->idle_head ? IDLE_SWEEP_MS : -1;
+        if (uring_enter(w->ring, 1, timeout) < 0 && errno != ETIME &&
+            errno != EINTR) {
+            unix_error("io_uring_enter error");
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(w->ring))) {
+            unsigned long data = cqe->user_data;
+            int res = cqe->res;
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+            uring_seen(w->ring);
+            if (data == URING_ACCEPT) {
+                if (res >= 0) {
+                    conn_open(w, res);
+                } else if (res == -EINVAL && multishot) {
+                    multishot = false; // an older kernel
+                } else if (res != -ECANCELED) {
+                    metric_add(METRIC_ACCEPT_ERRORS, 1);
+                }
+                if (!more && w->listenfd >= 0) {
+                    uring_accept(w, multishot);
+                }
+            } else if (data == URING_NOTIFY) {
+                resume_woken(w);
+                uring_poll_notify(w);
+            } else if (data != URING_CANCEL) {
+                conn_complete(w, (struct conn *)data, res);
+            }
+        }
+        worker_sweep(w);
+    }
+    return NULL;
+}
+
+static struct worker *workers; // for drain to wake
+static int nworkers;
+
+// runs a worker of either kind, epoll_worker or uring_worker, per listener
+void run_workers(int *listenfds, int n, void *(*worker)(void *)) {
+    pool_nonblocking = true;
+    workers = Calloc(n, sizeof(*workers));
+    pthread_t *tids = Calloc(n, sizeof(*tids));
+    for (int i = 0; i < n; i++) {
+        struct worker *w = &workers[i];
+        w->listenfd = listenfds[i];
+        pthread_mutex_init(&w->woken_lock, NULL);
+        if ((w->notifyfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            unix_error("eventfd error");
+        }
+    }
+    nworkers = n;
+    for (int i = 0; i < n; i++) {
+        Pthread_create(&tids[i], NULL, worker, &workers[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+}
+
+/*
+ * Prethreaded mode. A fixed pool of threads serves the connections the
+ * listener hands them through a bounded ring, like the sbuf of CS:APP but
+ * without its mutex: every slot carries a sequence number that says whether
+ * it is free to fill or ready to take (Vyukov's bounded queue). Two
+ * semaphores count the free slots and the queued connections, so the
+ * listener and idle threads sleep instead of spinning. When the ring is
+ * full, the listener either turns the connection away at once with a 503,
+ * or stops accepting until a thread frees a slot and lets the kernel's
+ * backlog absorb the burst.
+ */
+struct fd_slot {
+    atomic_ulong seq;
+    int fd;
+};
+
+struct fd_ring {
+    struct fd_slot *slots;
+    unsigned long mask;
+    atomic_ulong head; // next slot to fill
+    atomic_ulong tail; // next slot to take
+    sem_t free_slots;
+    sem_t queued;
+};
+
+static struct fd_ring accept_ring;
+static int pool_threads = 0; // 0 for a thread per connection
+static int accept_queue_depth = 64;
+static atomic_bool shed_load = true; // 503 when the ring is full, else wait
+
+void fd_ring_init(struct fd_ring *r, int depth) {
+    unsigned long size = 1;
+    while (size < (unsigned long)depth) {
+        size <<= 1;
+    }
+    r->slots = Calloc(size, sizeof(*r->slots));
+    for (unsigned long i = 0; i < size; i++) {
+        atomic_init(&r->slots[i].seq, i);
+    }
+    r->mask = size - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    // the ring itself holds size, but the queue is as deep as asked
+    Sem_init(&r->free_slots, 0, depth);
+    Sem_init(&r->queued, 0, 0);
+}
+
+// the caller holds a free slot, so this always finds one
+void fd_ring_push(struct fd_ring *r, int fd) {
+    unsigned long pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while (1) {
+        struct fd_slot *slot = &r->slots[pos & r->mask];
+        unsigned long seq =
+            atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &r->head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                slot->fd = fd;
+                atomic_store_explicit(&slot->seq, pos + 1,
+                                      memory_order_release);
+                V(&r->queued);
+                return;
+            }
+        } else {
+            // a pusher got there first, or the slot is still being taken
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+}
+
+int fd_ring_pop(struct fd_ring *r) {
+    P(&r->queued);
+    unsigned long pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (1) {
+        struct fd_slot *slot = &r->slots[pos & r->mask];
+        unsigned long seq =
+            atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos + 1) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &r->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                int fd = slot->fd;
+                atomic_store_explicit(&slot->seq, pos + r->mask + 1,
+                                      memory_order_release);
+                V(&r->free_slots);
+                return fd;
+            }
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+}
+
+void *pool_thread(void *vargp) {
+    (void)vargp;
+    Pthread_detach(pthread_self());
+    while (1) {
+        forward(fd_ring_pop(&accept_ring));
+    }
+    return NULL;
+}
+
+// turns a connection away without reading its request
+void shed(int connfd) {
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "Retry-After: 1\r\n"
+                                   "Content-Length: 0\r\n"
+                                   "Connection: close\r\n"
+                                   "\r\n";
+    // a client that cannot take it at once is not waited for
+    send(connfd, response, sizeof(response) - 1, MSG_DONTWAIT);
+    close(connfd);
+    atomic_fetch_sub(&open_clients, 1);
+    metric_add(METRIC_SHED, 1);
+}
+
+/*
+ * Accepts the next client. The listener is non-blocking, as it may be shared
+ * with the workers of another proxy around a restart, so this waits for it
+ * with poll. Returns -1 once draining.
+ */
+int accept_client(int listenfd) {
+    struct pollfd fds[2] = {{.fd = listenfd, .events = POLLIN},
+                            {.fd = stop_fd, .events = POLLIN}};
+    while (1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd >= 0) {
+            atomic_fetch_add(&open_clients, 1);
+            return connfd;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            metric_add(METRIC_ACCEPT_ERRORS, 1);
+        }
+        if (poll(fds, 2, -1) > 0 && fds[1].revents) {
+            close(listenfd);
+            return -1;
+        }
+    }
+}
+
+void run_prethreaded(int listenfd) {
+    fd_ring_init(&accept_ring, accept_queue_depth);
+    pthread_t tid;
+    for (int i = 0; i < pool_threads; i++) {
+        Pthread_create(&tid, NULL, pool_thread, NULL);
+    }
+    while (1) {
+        // once, as a reload may change it
+        bool shedding = atomic_load_explicit(&shed_load, memory_order_relaxed);
+        if (!shedding) {
+            P(&accept_ring.free_slots);
+        }
+        int connfd = accept_client(listenfd);
+        if (connfd < 0) {
+            return;
+        }
+        if (shedding && sem_trywait(&accept_ring.free_slots) < 0) {
+            shed(connfd);
+            continue;
+        }
+        fd_ring_push(&accept_ring, connfd);
+    }
+}
+
+void run_threaded(int listenfd) {
+    pthread_t tid;
+    int connfd;
+    while ((connfd = accept_client(listenfd)) >= 0) {
+        int *connfdp = Malloc(sizeof(*connfdp));
+        *connfdp = connfd;
+        Pthread_create(&tid, NULL, forward_thread, connfdp);
+    }
+}
+
+/*
+ * Settings that can change while the proxy runs. With -f, they are read from
+ * a file after the command line, and again on SIGHUP. Each line of the file
+ * sets one, as in "cache_size 16777216", and # starts a comment. A file with
+ * a mistake in it is rejected as a whole, so a bad reload changes nothing.
+ */
+struct config {
+    unsigned long cache_size;      // -c
+    unsigned long max_object_size; // -m
+    const struct cache_policy *eviction; // -E
+    bool tinylfu;                        // -A
+    int idle_timeout;                    // -i
+    int max_requests;                    // -r
+    int stale_while_revalidate;          // -s
+    unsigned long log_sample;            // -l
+    bool shed_load;                      // -O
+    bool compress;                       // -z
+};
+
+static struct config config; // as it stands, only reloads change it
+
+// a whole number from min to max, returns -1 if value is not one
+int config_number(char *value, unsigned long min, unsigned long max,
+                  unsigned long *n) {
+    char *end;
+    errno = 0;
+    *n = strtoul(value, &end, 10);
+    return *value && !*end && !errno && *n >= min && *n <= max ? 0 : -1;
+}
+
+// returns -1 if there is no such setting or value does not suit it
+int config_set(struct config *cfg, char *name, char *value) {
+    unsigned long n;
+    if (!strcmp(name, "cache_size")) {
+        if (config_number(value, CACHE_SHARDS, UINT_MAX, &n) < 0) {
+            return -1;
+        }
+        cfg->cache_size = n;
+    } else if (!strcmp(name, "max_object_size")) {
+        if (config_number(value, 1, UINT_MAX, &n) < 0) {
+            return -1;
+        }
+        cfg->max_object_size = n;
+    } else if (!strcmp(name, "eviction")) {
+        if (!(cfg->eviction = find_policy(value))) {
+            return -1;
+        }
+    } else if (!strcmp(name, "admission")) {
+        if (strcmp(value, "all") && strcmp(value, "tinylfu")) {
+            return -1;
+        }
+        cfg->tinylfu = !strcmp(value, "tinylfu");
+    } else if (!strcmp(name, "idle_timeout")) {
+        if (config_number(value, 1, INT_MAX, &n) < 0) {
+            return -1;
+        }
+        cfg->idle_timeout = n;
+    } else if (!strcmp(name, "max_requests")) {
+        if (config_number(value, 1, INT_MAX, &n) < 0) {
+            return -1;
+        }
+        cfg->max_requests = n;
+    } else if (!strcmp(name, "stale_while_revalidate")) {
+        if (config_number(value, 0, INT_MAX, &n) < 0) {
+            return -1;
+        }
+        cfg->stale_while_revalidate = n;
+    } else if (!strcmp(name, "log_sample")) {
+        if (config_number(value, 1, ULONG_MAX, &cfg->log_sample) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(name, "overload")) {
+        if (strcmp(value, "shed") && strcmp(value, "wait")) {
+            return -1;
+        }
+        cfg->shed_load = !strcmp(value, "shed");
+    } else if (!strcmp(name, "compress")) {
+        if (strcmp(value, "on") && strcmp(value, "off")) {
+            return -1;
+        }
+        cfg->compress = !strcmp(value, "on");
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// reads path over cfg, returns -1 after saying what is wrong with it
+int load_config(char *path, struct config *cfg) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Could not read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[MAXLINE];
+    int rc = 0;
+    for (int lineno = 1; fgets(line, sizeof(line), f); lineno++) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *name = strtok(line, " \t\r\n");
+        char *value = strtok(NULL, " \t\r\n");
+        if (name && (!value || strtok(NULL, " \t\r\n") ||
+                     config_set(cfg, name, value) < 0)) {
+            printf("%s:%d: bad setting %s\n", path, lineno, name);
+            rc = -1;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+// sets the globals the settings live in, before the cache is set up
+void apply_config(struct config *cfg) {
+    cache_policy = cfg->eviction;
+    use_tinylfu = cfg->tinylfu;
+    // worker threads read these while a reload sets them
+    atomic_store_explicit(&client_idle_timeout, cfg->idle_timeout,
+                          memory_order_relaxed);
+    atomic_store_explicit(&max_client_requests, cfg->max_requests,
+                          memory_order_relaxed);
+    atomic_store_explicit(&stale_while_revalidate,
+                          cfg->stale_while_revalidate, memory_order_relaxed);
+    atomic_store_explicit(&access_log_sample, cfg->log_sample,
+                          memory_order_relaxed);
+    atomic_store_explicit(&shed_load, cfg->shed_load, memory_order_relaxed);
+    atomic_store_explicit(&compress_cache, cfg->compress,
+                          memory_order_relaxed);
+    config = *cfg;
+}
+
+/*
+ * Changes the settings of the running proxy. The other threads read them
+ * without a lock, so they see a change a little late at worst; the cache
+ * changes under the shards' locks.
+ */
+void reconfigure(struct config *cfg) {
+    if (cfg->cache_size != config.cache_size ||
+        cfg->max_object_size != config.max_object_size) {
+        resize_cache(cfg->cache_size, cfg->max_object_size);
+    }
+    if (cfg->eviction != config.eviction || cfg->tinylfu != config.tinylfu) {
+        for (int i = 0; i < CACHE_SHARDS; i++) {
+            pthread_rwlock_wrlock(&shards[i].lock);
+            cache_set_policy(&shards[i].cache, cfg->eviction, cfg->tinylfu);
+            pthread_rwlock_unlock(&shards[i].lock);
+        }
+    }
+    apply_config(cfg);
+}
+
+// SIGHUP is blocked in every thread, and this one waits for it
+void *reload_thread(void *vargp) {
+    char *path = vargp;
+    sigset_t mask;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGHUP);
+    while (1) {
+        int sig;
+        if (sigwait(&mask, &sig) != 0) {
+            continue;
+        }
+        struct config cfg = config;
+        if (load_config(path, &cfg) < 0) {
+            printf("Kept the settings as they were\n");
+            continue;
+        }
+        reconfigure(&cfg);
+        printf("Reloaded %s: cache of %lu bytes, %s%s\n", path,
+               cfg.cache_size, cfg.eviction->name,
+               cfg.tinylfu ? " with tinylfu" : "");
+    }
+    return NULL;
+}
+
+void init_reload(char *path) {
+    pthread_t tid;
+    Pthread_create(&tid, NULL, reload_thread, path);
+    Pthread_detach(tid);
+}
+
+/*
+ * Graceful restarts. With -U, the proxy waits on a Unix socket for a new
+ * proxy started with the same -U, and hands it its listening sockets, the
+ * admin port's among them, so that no client is refused in between. With
+ * -W, the new proxy also asks for a copy of the cache in memory, and starts
+ * warm. Once it is ready, the old proxy stops accepting, finishes the
+ * requests under way and exits. Should the new proxy fail before it is
+ * ready, the old one carries on, though without its disk tier, which it
+ * lets go of before the new proxy opens it.
+ *
+ * The new proxy sends one byte, W for the cache or H without, and gets the
+ * listeners in messages of up to HANDOVER_FDS, each a count with the fds
+ * attached, the last one short. Then come the entries, if asked for, each a
+ * snapshot_record followed by its url and content, and a record with no url
+ * ends them. A last byte from the new proxy says it is ready.
+ */
+struct snapshot_record {
+    unsigned int url_len; // with its NUL
+    unsigned int content_len;
+    long expires;
+    unsigned int delimited;
+    unsigned int compressed;
+};
+
+// opens the proxy's listeners, taking over the old proxy's where it can
+int *open_listeners(char *port, int n) {
+    int *fds = Calloc(n, sizeof(*fds));
+    for (int i = 0; i < n; i++) {
+        if ((fds[i] = take_listener(atoi(port))) < 0) {
+            if ((fds[i] = open_reuseport_listenfd(port)) < 0) {
+                unix_error("open_reuseport_listenfd error");
+            }
+            add_listener(fds[i]);
+        }
+    }
+    return fds;
+}
+
+int send_listeners(int fd) {
+    for (int sent = 0;; sent += HANDOVER_FDS) {
+        int n = nlisteners - sent < HANDOVER_FDS ? nlisteners - sent
+                                                 : HANDOVER_FDS;
+        char control[CMSG_SPACE(HANDOVER_FDS * sizeof(int))];
+        struct iovec iov = {&n, sizeof(n)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        if (n) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), listeners + sent, n * sizeof(int));
+        }
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(n)) {
+            return -1;
+        }
+        if (n < HANDOVER_FDS) {
+            return 0;
+        }
+    }
+}
+
+int receive_listeners(int fd) {
+    while (1) {
+        int n;
+        char control[CMSG_SPACE(HANDOVER_FDS * sizeof(int))];
+        struct iovec iov = {&n, sizeof(n)};
+        struct msghdr msg = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(n) || n < 0 ||
+            n > HANDOVER_FDS) {
+            return -1;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (n && (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+                  cmsg->cmsg_len != CMSG_LEN(n * sizeof(int)))) {
+            return -1;
+        }
+        inherited = Realloc(inherited, (ninherited + n) * sizeof(*inherited));
+        if (n) {
+            memcpy(inherited + ninherited, CMSG_DATA(cmsg), n * sizeof(int));
+        }
+        ninherited += n;
+        if (n < HANDOVER_FDS) {
+            return 0;
+        }
+    }
+}
+
+// writes out what is in the cache in memory, shard by shard
+int send_cache(int fd) {
+    int rc = 0;
+    for (int i = 0; i < CACHE_SHARDS && rc == 0; i++) {
+        // pinned, so the shard need not stay locked while they are written
+        struct cache *cache = &shards[i].cache;
+        pthread_rwlock_rdlock(&shards[i].lock);
+        unsigned long n = 0;
+        struct cache_entry **entries =
+            Malloc((cache->nentries + 1) * sizeof(*entries));
+        for (unsigned long b = 0; b < cache->nbuckets; b++) {
+            for (struct cache_entry *entry = cache->buckets[b]; entry;
+                 entry = entry->bucket_next) {
+                pin_entry(entry);
+                entries[n++] = entry;
+            }
+        }
+        pthread_rwlock_unlock(&shards[i].lock);
+        for (unsigned long j = 0; j < n; j++) {
+            struct cache_entry *entry = entries[j];
+            struct snapshot_record rec = {
+                .url_len = strlen(entry->url) + 1,
+                .content_len = entry->content_len,
+                .expires = atomic_load(&entry->expires),
+                .delimited = entry->delimited,
+                .compressed = entry->compressed};
+            char *content = Malloc(entry->content_len + 1);
+            entry_copy(entry, 0, entry->content_len, content);
+            if (rc == 0 &&
+                (rio_writen(fd, &rec, sizeof(rec)) < 0 ||
+                 rio_writen(fd, entry->url, rec.url_len) < 0 ||
+                 rio_writen(fd, content, rec.content_len) < 0)) {
+                rc = -1;
+            }
+            Free(content);
+            release_entry(entry);
+        }
+        Free(entries);
+    }
+    struct snapshot_record end = {0};
+    return rc == 0 ? rio_writen(fd, &end, sizeof(end)) : rc;
+}
+
+// caches what send_cache writes, returns the entries or -1
+long receive_cache(int fd) {
+    long n = 0;
+    while (1) {
+        struct snapshot_record rec;
+        if (rio_readn(fd, &rec, sizeof(rec)) != sizeof(rec) ||
+            rec.url_len > MAX_URL_LEN) {
+            return -1;
+        }
+        if (!rec.url_len) {
+            return n;
+        }
+        char url[MAX_URL_LEN];
+        if (rio_readn(fd, url, rec.url_len) != rec.url_len ||
+            url[rec.url_len - 1]) {
+            return -1;
+        }
+        if (rec.content_len > shards[0].cache.max_object_size) {
+            // larger than this proxy caches, so it is read past unseen
+            char buf[MAXLINE];
+            for (size_t left = rec.content_len, len; left; left -= len) {
+                len = left < sizeof(buf) ? left : sizeof(buf);
+                if (rio_readn(fd, buf, len) != (ssize_t)len) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+        char *content = Malloc(rec.content_len + 1);
+        if (rio_readn(fd, content, rec.content_len) != rec.content_len) {
+            Free(content);
+            return -1;
+        }
+        struct cache_entry *entry;
+        if ((entry = new_entry(url, content, rec.content_len))) {
+            entry->delimited = rec.delimited;
+            entry->compressed = rec.compressed;
+            atomic_store(&entry->expires, rec.expires);
+            cache_put(entry);
+            n++;
+        }
+        Free(content);
+    }
+}
+
+void handover_addr(char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        app_error("handover socket path too long");
+    }
+    strcpy(addr->sun_path, path);
+}
+
+/*
+ * Asks the proxy waiting on path to hand over, and takes its listeners, and
+ * its cache if warm. Returns the connection to it, to say when this proxy is
+ * ready, or -1 if there is no proxy to take over from.
+ */
+int handover_start(char *path, bool warm) {
+    struct sockaddr_un addr;
+    handover_addr(path, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        unix_error("socket error");
+    }
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    char request = warm ? 'W' : 'H';
+    long cached = 0;
+    if (rio_writen(fd, &request, 1) < 0 || receive_listeners(fd) < 0 ||
+        (warm && (cached = receive_cache(fd)) < 0)) {
+        app_error("handover from the running proxy failed");
+    }
+    printf("Took over %d listeners and %ld cached objects\n", ninherited,
+           cached);
+    return fd;
+}
+
+/*
+ * Stops accepting, and exits once the client connections under way are
+ * done, or DRAIN_TIMEOUT later at the latest.
+ */
+void drain(void) {
+    atomic_store(&draining, true);
+    eventfd_write(stop_fd, 1);
+    for (int i = 0; i < nworkers; i++) {
+        eventfd_write(workers[i].notifyfd, 1);
+    }
+    printf("Handed over, draining %d client connections\n",
+           atomic_load(&open_clients));
+    time_t deadline = time(NULL) + DRAIN_TIMEOUT;
+    while (atomic_load(&open_clients) > 0 && time(NULL) < deadline) {
+        usleep(10000);
+    }
+    printf("Drained, %d client connections cut off\n",
+           atomic_load(&open_clients));
+    exit(0);
+}
+
+/*
+ * Hands the listeners, and the cache if asked, to the new proxy on fd.
+ * Returns 0 once the new proxy is ready, or -1 if it went away before.
+ */
+int hand_over(int fd) {
+    char request, ready;
+    if (rio_readn(fd, &request, 1) != 1) {
+        return -1;
+    }
+    printf("Handing over to a new proxy\n");
+    if (disk) {
+        disk_detach();
+    }
+    if (send_listeners(fd) < 0 || (request == 'W' && send_cache(fd) < 0) ||
+        rio_readn(fd, &ready, 1) != 1) {
+        printf("The new proxy went away, carrying on%s\n",
+               disk ? " without the disk tier" : "");
+        return -1;
+    }
+    return 0;
+}
+
+void *handover_thread(void *vargp) {
+    int listenfd = (int)(long)vargp;
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        int rc = hand_over(fd);
+        close(fd);
+        if (rc == 0) {
+            close(listenfd);
+            drain();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Called once this proxy's listeners are open: closes those of the old
+ * proxy it had no use for, waits on path for the next proxy, and tells the
+ * old one, if any, to drain.
+ */
+void handover_ready(int old, char *path) {
+    for (int i = 0; i < ninherited; i++) {
+        close(inherited[i]);
+    }
+    ninherited = 0;
+    if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        unix_error("eventfd error");
+    }
+    struct sockaddr_un addr;
+    handover_addr(path, &addr);
+    long listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path); // the old proxy's, which it does not need any more
+    // only the same user may connect, and so take over
+    mode_t mask = umask(0177);
+    if (listenfd < 0 || bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1) < 0) {
+        unix_error("handover socket error");
+    }
+    umask(mask);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, handover_thread, (void *)listenfd);
+    Pthread_detach(tid);
+    if (old >= 0) {
+        char ready = 'R';
+        rio_writen(old, &ready, 1);
+        close(old);
+    }
+}
+
+void usage(char *prog) {
+    fprintf(stderr,
+            "usage: %s [-b] [-e] [-u] [-A policy] [-D bytes] [-E policy] "
+            "[-H hosts] [-L file] [-M port] [-O overload] [-U socket] [-W] "
+            "[-c bytes] [-d file] [-f file] [-i idle] [-l n] [-m bytes] "
+            "[-p threads] [-q depth] [-r requests] [-s seconds] "
+            "[-w workers] [-z] <port>\n",
+            prog);
+    fprintf(stderr, "   -b          relay uncacheable responses through user "
+                    "space instead of splice\n");
+    fprintf(stderr, "   -e          event-driven mode using epoll\n");
+    fprintf(stderr, "   -u          event-driven mode using io_uring\n");
+    fprintf(stderr, "   -A policy   cache admission, all or tinylfu "
+                    "(default: all)\n");
+    fprintf(stderr, "   -D bytes    size of the disk tier (default: 64 MiB)\n");
+    fprintf(stderr, "   -E policy   cache eviction, lru, gdsf or s3fifo "
+                    "(default: lru)\n");
+    fprintf(stderr, "   -H hosts    resolve the names in an /etc/hosts style "
+                    "file from it\n");
+    fprintf(stderr, "   -L file     append an access log to file, one JSON "
+                    "object per line\n");
+    fprintf(stderr, "   -M port     serve /metrics on this port of "
+                    "localhost\n");
+    fprintf(stderr, "   -O overload with -p and a full accept queue, shed "
+                    "with a 503 or wait (default: shed)\n");
+    fprintf(stderr, "   -U socket   take over from the proxy waiting on this "
+                    "Unix socket, then wait on it\n");
+    fprintf(stderr, "   -W          with -U, take a copy of the old proxy's "
+                    "cache\n");
+    fprintf(stderr, "   -c bytes    cache capacity in memory (default: 1 "
+                    "MiB)\n");
+    fprintf(stderr, "   -d file     keep a disk tier of the cache in file\n");
+    fprintf(stderr, "   -f file     read settings from file, and again on "
+                    "SIGHUP\n");
+    fprintf(stderr, "   -i idle     seconds a client connection may wait for "
+                    "a request (default: 15)\n");
+    fprintf(stderr, "   -l n        log one in n requests at random "
+                    "(default: 1)\n");
+    fprintf(stderr, "   -m bytes    largest object cached (default: 100 "
+                    "KiB)\n");
+    fprintf(stderr, "   -p threads  serve connections from a pool of this "
+                    "many threads (default: a thread each)\n");
+    fprintf(stderr, "   -q depth    connections queued for the pool "
+                    "(default: 64)\n");
+    fprintf(stderr, "   -r requests requests served per client connection "
+                    "(default: 100)\n");
+    fprintf(stderr, "   -s seconds  serve stale entries for this long while "
+                    "revalidating them (default: 0)\n");
+    fprintf(stderr,
+            "   -w workers  number of event-driven workers (default: "
+            "cores)\n");
+    fprintf(stderr, "   -z          keep text responses gzip compressed in "
+                    "the cache\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    void *(*event_worker)(void *) = NULL; // for event-driven mode
+    int event_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    struct config cfg = {
+        .cache_size = 1 << 20,
+        .max_object_size = MAX_OBJECT_SIZE,
+        .eviction = cache_policy,
+        .tinylfu = use_tinylfu,
+        .idle_timeout =
+            atomic_load_explicit(&client_idle_timeout, memory_order_relaxed),
+        .max_requests =
+            atomic_load_explicit(&max_client_requests, memory_order_relaxed),
+        .stale_while_revalidate = atomic_load_explicit(&stale_while_revalidate,
+                                                       memory_order_relaxed),
+        .log_sample =
+            atomic_load_explicit(&access_log_sample, memory_order_relaxed),
+        .shed_load = atomic_load_explicit(&shed_load, memory_order_relaxed),
+        .compress =
+            atomic_load_explicit(&compress_cache, memory_order_relaxed)};
+    char *config_path = NULL;
+    char *disk_path = NULL;
+    unsigned long disk_capacity = DISK_CAPACITY;
+    char *access_log_path = NULL;
+    int admin_port = 0;
+    char *handover_path = NULL;
+    bool warm = false;
+    int c;
+    while ((c = getopt(argc, argv,
+                       "beuzWA:D:E:H:L:M:O:U:c:d:f:i:l:m:p:q:r:s:w:")) !=
+           EOF) {
+        switch (c) {
+        case 'b':
+            use_splice = false;
+            break;
+        case 'e':
+            event_worker = epoll_worker;
+            break;
+        case 'u':
+            event_worker = uring_worker;
+            break;
+        case 'z':
+            cfg.compress = true;
+            break;
+        case 'W':
+            warm = true;
+            break;
+        case 'A':
+            if (!strcmp(optarg, "tinylfu")) {
+                cfg.tinylfu = true;
+            } else if (strcmp(optarg, "all")) {
+                usage(argv[0]);
+            }
+            break;
+        case 'D':
+            disk_capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'E':
+            if (!(cfg.eviction = find_policy(optarg))) {
+                usage(argv[0]);
+            }
+            break;
+        case 'H':
+            if (load_hosts_file(optarg) < 0) {
+                unix_error("load_hosts_file error");
+            }
+            break;
+        case 'L':
+            access_log_path = optarg;
+            break;
+        case 'M':
+            admin_port = atoi(optarg);
+            break;
+        case 'O':
+            if (!strcmp(optarg, "wait")) {
+                cfg.shed_load = false;
+            } else if (strcmp(optarg, "shed")) {
+                usage(argv[0]);
+            }
+            break;
+        case 'U':
+            handover_path = optarg;
+            break;
+        case 'c':
+            cfg.cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'f':
+            config_path = optarg;
+            break;
+        case 'i':
+            cfg.idle_timeout = atoi(optarg);
+            break;
+        case 'l':
+            cfg.log_sample = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            cfg.max_object_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            pool_threads = atoi(optarg);
+            break;
+        case 'q':
+            accept_queue_depth = atoi(optarg);
+            break;
+        case 'r':
+            cfg.max_requests = atoi(optarg);
+            break;
+        case 's':
+            cfg.stale_while_revalidate = atoi(optarg);
+            break;
+        case 'w':
+            event_workers = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (config_path && load_config(config_path, &cfg) < 0) {
+        exit(1);
+    }
+    if (optind != argc - 1 || event_workers < 1 || cfg.idle_timeout < 1 ||
+        cfg.max_requests < 1 || cfg.stale_while_revalidate < 0 ||
+        !cfg.log_sample || admin_port < 0 || admin_port > 65535 ||
+        pool_threads < 0 || accept_queue_depth < 1 ||
+        cfg.cache_size < CACHE_SHARDS || cfg.cache_size > UINT_MAX ||
+        !cfg.max_object_size || cfg.max_object_size > UINT_MAX ||
+        disk_capacity < 8 * DISK_ALIGN || (warm && !handover_path)) {
+        usage(argv[0]);
+    }
+    char *port = argv[optind];
+    apply_config(&cfg);
+
+    sigset_t mask;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGPIPE);
+    if (config_path) {
+        Sigaddset(&mask, SIGHUP); // for reload_thread
+    }
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+    Signal(SIGCHLD, sigchld_handler);
+    init_shards(cfg.cache_size, cfg.max_object_size);
+    int old = handover_path ? handover_start(handover_path, warm) : -1;
+    if (disk_path) {
+        disk_open(disk_path, disk_capacity, cfg.max_object_size);
+    }
+    init_resolver();
+    init_revalidators();
+    if (access_log_path) {
+        init_access_log(access_log_path);
+    }
+    if (admin_port) {
+        init_admin(admin_port);
+    }
+    if (config_path) {
+        init_reload(config_path);
+    }
+
+    int *listenfds = open_listeners(port, event_worker ? event_workers : 1);
+    if (handover_path) {
+        handover_ready(old, handover_path);
+    }
+    if (event_worker) {
+        run_workers(listenfds, event_workers, event_worker);
+    } else if (pool_threads) {
+        run_prethreaded(listenfds[0]);
+    } else {
+        run_threaded(listenfds[0]);
     }
+    // only draining stops the listeners, and it ends the process itself
+    pthread_exit(NULL);
 }
@@ -0,0 +1,363 @@
+/*
+ * proxy.h - what the proxy shares with the tools built around it.
+ *
+ * The benchmarks and tests link against proxy.c compiled with
+ * -Dmain=proxy_main, see meson.build, and reach the cache, the slab, the
+ * request parser, the response framer and the gzip codec through the types
+ * and functions declared here.
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+#define MAX_URL_LEN 2048
+#define MAX_HEADERS 64
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256
+#define URING_ACCEPT 1    /* user_data of the listener's accepts */
+#define URING_NOTIFY 2    /* and of the polls of a worker's notifyfd */
+#define URING_CANCEL 3    /* and of cancelling the accepts, once draining */
+#define CACHE_SHARDS 8
+#define EVICTION_POLICIES 3 /* lru, gdsf and s3fifo */
+#define SPLICE_CHUNK (1 << 16)
+#define POOL_BUCKETS 256
+#define MAX_IDLE_PER_ORIGIN 8
+#define ORIGIN_IDLE_TIMEOUT 30 /* seconds */
+#define IDLE_SWEEP_MS 1000
+#define DNS_BUCKETS 256
+#define DNS_TTL 60         /* seconds */
+#define DNS_NEGATIVE_TTL 5 /* seconds */
+#define MAX_ORIGIN_ADDRS 8
+#define RESOLVER_THREADS 4
+#define FLIGHT_BUCKETS 256
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096 /* a power of two */
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)
+#define GHOST_ENTRIES 1024
+#define SLAB_PAGE 4096
+#define SLAB_MIN_CHUNK 64
+#define SLAB_MAX_CHUNK (SLAB_PAGE / 2)
+#define SLAB_CLASSES 32
+#define SLAB_RESERVE (1UL << 32) /* room to grow, capacities are 32 bit */
+#define ENTRY_IOV 64
+#define MAX_RANGES 16
+#define DISK_CAPACITY (64UL << 20)
+#define DISK_HEADER 4096 /* the superblock, ahead of the records */
+#define DISK_ALIGN 64
+#define DISK_MAGIC "PXYDISK1"
+#define DISK_RECORD 0x52454331 /* "REC1" */
+#define DISK_WRAP 0x57524150   /* "WRAP", the rest of the area is unused */
+#define HEURISTIC_MAX_AGE 86400 /* seconds */
+#define REVALIDATOR_THREADS 4
+#define HIST_BUCKETS 26 /* up to 2^24 us, about 17 s, and one for longer */
+#define ACCESS_LOG_RING 1024
+#define ACCESS_LOG_LINE 1024
+#define GZIP_HASH_BITS 12 /* the match finder's table, as in LZ4 */
+#define GZIP_WINDOW 32768
+#define GZIP_MAX_MATCH 258
+#define COMPRESS_MIN_SIZE 256 /* smaller bodies are cached as they are */
+#define HANDOVER_FDS 64   /* listeners passed in one message */
+#define DRAIN_TIMEOUT 60  /* seconds */
+
+struct headers {
+    char host[MAX_URL_LEN];
+    char const *user_agent;
+    char const *connection;
+    bool client_close; // the client asked for its connection to be closed
+    char range[256];    // empty if not given, or too long to honour
+    char if_range[256];
+    bool accept_gzip; // the client takes Content-Encoding: gzip
+};
+
+struct destination {
+    char *host;
+    char *port;
+};
+
+// a part of a request head, as an offset into the buffer holding it
+struct slice {
+    size_t off;
+    size_t len;
+};
+
+struct header {
+    struct slice name;
+    struct slice value;
+};
+
+enum parse_state {
+    PARSE_METHOD,
+    PARSE_URI,
+    PARSE_VERSION,
+    PARSE_LF, // a CR was seen, next is its LF
+    PARSE_HEADER_START,
+    PARSE_NAME,
+    PARSE_VALUE_START,
+    PARSE_VALUE,
+    PARSE_DONE,
+};
+
+// a request head as parsed by parse_request
+struct request {
+    enum parse_state state;
+    enum parse_state after_lf;
+    size_t pos;  // how far the head has been scanned
+    size_t mark; // where the part being scanned started
+    struct slice method;
+    struct slice uri;
+    struct slice version;
+    struct header headers[MAX_HEADERS];
+    int nheaders;
+};
+
+/*
+ * Entries are immutable once cached and reference counted. The cache holds
+ * one reference, and readers pin an entry while they write it out with no
+ * lock held. Eviction only unlinks an entry; whoever drops the last
+ * reference frees it. An entry is a slab chunk holding the entry, its
+ * table of pieces and its url, followed by the content if it fits. Larger
+ * content goes in pieces of SLAB_MAX_CHUNK bytes, each a chunk of its own.
+ */
+struct cache_entry {
+    char *url;
+    unsigned long hash;
+    char **pieces;
+    unsigned int npieces;
+    bool chained; // the pieces are chunks of their own
+    unsigned int content_len;
+    unsigned int size;       // of its chunks, which is what the cache charges
+    char *mapped;            // content kept outside the slab: on disk,
+    struct disk_entry *disk; // pinned here, or else owned by the entry
+    atomic_long expires;     // when it goes stale, 0 if it never does
+    bool delimited; // the response carries its own length
+    bool compressed; // a gzip variant made by compress_response
+    atomic_bool revalidating; // a background revalidation is queued
+    atomic_bool referenced; // LRU
+    atomic_uint freq;       // hits, as counted by GDSF and S3-FIFO
+    atomic_uint refs;
+    struct cache_entry *next;
+    struct cache_entry *prev;
+    struct cache_entry *bucket_next;
+    bool small;              // S3-FIFO: in the small queue
+    double worth;            // GDSF: its key in the heap
+    unsigned int worth_freq; // GDSF: hits when worth was last computed
+    unsigned int heap_index; // GDSF
+};
+
+struct cache;
+
+/*
+ * How a cache picks what to evict. add and remove link entries into and out
+ * of the policy's own structures, victim names the entry to evict next
+ * without removing it, and evict removes it. hit runs under a shared lock,
+ * so it may only touch atomics.
+ */
+struct cache_policy {
+    char *name;
+    void (*add)(struct cache *cache, struct cache_entry *entry);
+    void (*remove)(struct cache *cache, struct cache_entry *entry);
+    struct cache_entry *(*victim)(struct cache *cache);
+    void (*evict)(struct cache *cache, struct cache_entry *entry);
+    void (*hit)(struct cache_entry *entry);
+};
+
+struct frequency_sketch {
+    atomic_uchar counters[SKETCH_DEPTH][SKETCH_WIDTH];
+    atomic_uint additions;
+};
+
+/*
+ * Entries are kept in a chained hash table keyed by url for lookups, and in
+ * whatever the eviction policy orders them by. The table doubles whenever it
+ * holds more entries than buckets, so the chains stay short.
+ */
+struct cache {
+    unsigned int capacity_bytes;
+    unsigned int used_bytes;
+    unsigned int max_object_size;
+    const struct cache_policy *policy;
+    struct frequency_sketch *sketch; // TinyLFU admission, if enabled
+    struct cache_entry *head;        // LRU list, or the S3-FIFO main queue
+    struct cache_entry *tail;
+    struct cache_entry *small_head; // S3-FIFO
+    struct cache_entry *small_tail;
+    unsigned int small_bytes;
+    unsigned long ghost[GHOST_ENTRIES];
+    unsigned int ghost_next;
+    struct cache_entry **heap; // GDSF
+    unsigned int nheap;
+    unsigned int heap_cap;
+    double inflation;
+    struct cache_entry **buckets;
+    unsigned long nbuckets;
+    unsigned long nentries;
+};
+
+/*
+ * The proxy's cache is split into shards by url hash, each guarded by its own
+ * reader-writer lock, so hits on different threads do not serialize.
+ */
+struct cache_shard {
+    pthread_rwlock_t lock;
+    struct cache cache;
+};
+
+extern struct cache_shard shards[CACHE_SHARDS];
+
+/*
+ * Cached objects live in a slab allocator with a budget, so churn in the
+ * cache does not fragment the heap. The budget is cut into SLAB_PAGE
+ * sized pages, and each page in use is cut into chunks of one size class,
+ * the chunk sizes growing by a quarter from one class to the next. A page
+ * goes back to the pool as soon as its last chunk is freed, so memory
+ * follows the mix of object sizes. No chunk is larger than half a page, and
+ * larger objects are chained from several, the way memcached stores them:
+ * any free page can then serve any allocation, where a run of pages for
+ * each large object would soon be ruled out by fragmentation.
+ */
+struct slab_page {
+    int class;          // -1 while the page is free, -2 past the budget
+    unsigned int used;  // chunks handed out
+    void *free;         // free chunks, linked through their first word
+    long prev;          // pages of the class with free chunks
+    long next;          // or the next free page
+};
+
+struct slab_class {
+    unsigned int size;
+    unsigned int chunks; // per page
+    long partial;        // the first page with free chunks, or -1
+};
+
+struct slab {
+    pthread_mutex_t lock;
+    char *base; // SLAB_RESERVE bytes of address space
+    unsigned long npages; // mapped so far
+    unsigned long limit;  // the budget, see slab_resize
+    struct slab_page *pages;
+    long free_page; // a stack of free pages
+    atomic_ulong free_pages;
+    struct slab_class classes[SLAB_CLASSES];
+    int nclasses;
+    unsigned long chunks;
+    unsigned long chunk_bytes;
+};
+
+extern struct slab slab;
+
+extern const struct cache_policy eviction_policies[EVICTION_POLICIES];
+extern const struct cache_policy *cache_policy;
+extern bool use_tinylfu;
+
+/*
+ * Freshness of stored responses, after RFC 9111. The lifetime comes from
+ * Cache-Control s-maxage or max-age, or else Expires, or else is a tenth of
+ * the time since Last-Modified, up to HEURISTIC_MAX_AGE. The age already
+ * spent comes from Date and Age. A response that says nothing about any of
+ * these never goes stale, as every response used to.
+ */
+struct freshness {
+    long max_age;        // -1 if not given
+    bool shared_max_age; // from s-maxage, which takes precedence
+    time_t expires;      // 0 if not given, in the past if invalid
+    time_t date;
+    time_t last_modified;
+    long age;
+    bool no_store; // or private, since this is a shared cache
+    bool no_cache;
+    bool must_revalidate;
+    bool no_transform; // the response may not be compressed
+    char etag[256]; // validators as sent, empty if not
+    char last_modified_value[64];
+};
+
+/*
+ * What a hit writes out: the content from start to end, after a head of its
+ * own if the reply has one, such as the head of a 206.
+ */
+struct reply {
+    char *head; // NULL for the response as it was cached
+    size_t head_len;
+    size_t start;
+    size_t end;
+};
+
+/*
+ * Tracks where a response from an origin ends, so that its connection can be
+ * reused for the next request. Bytes are fed in as they are relayed. The
+ * status line, headers, chunk sizes and trailers are parsed a line at a time,
+ * while bodies and chunks of known length are skipped over in bulk.
+ */
+enum frame_state {
+    FRAME_HEADERS,
+    FRAME_BODY, // Content-Length bytes
+    FRAME_CHUNK_SIZE,
+    FRAME_CHUNK_DATA,
+    FRAME_CHUNK_END, // the CRLF after a chunk's data
+    FRAME_TRAILERS,
+    FRAME_UNTIL_CLOSE, // no framing, the body ends when the origin closes
+    FRAME_DONE,
+};
+
+struct framer {
+    enum frame_state state;
+    char line[MAXLINE];
+    size_t line_len;
+    bool status_line; // the next line in FRAME_HEADERS is a status line
+    long remaining;   // of the body or the current chunk
+    int status;
+    bool delimited; // the end is known without the origin closing
+    bool keep_alive;
+    bool chunked;
+    long content_length;
+};
+
+/* The cache */
+unsigned long hash_url(char *url);
+void init_slab(size_t budget);
+void free_slab(void);
+const struct cache_policy *find_policy(char *name);
+void init_cache(struct cache *cache, unsigned int capacity,
+                unsigned int max_object_size);
+void init_shards(unsigned int capacity, unsigned int max_object_size);
+void release_entry(struct cache_entry *entry);
+void remove_entry(struct cache_entry *entry, struct cache *cache);
+bool insert(struct cache_entry *entry, struct cache *cache);
+struct cache_entry *get(char *url, unsigned long hash, struct cache *cache);
+struct cache_entry *new_entry(char *url, void *content, size_t content_len);
+void cache_put(struct cache_entry *entry);
+struct cache_entry *cache_get(char *url);
+
+/* Requests */
+void request_init(struct request *r);
+int parse_request(struct request *r, const char *buf, size_t len);
+int slice_copy(char *dst, size_t size, const char *buf, struct slice s);
+bool has_token(const char *value, size_t len, const char *token);
+int scan_headers(struct request *r, const char *buf, struct headers *hdr);
+int read_request(rio_t *rp, struct request *r);
+bool client_keep_alive(struct request *r, const char *buf,
+                       struct headers *hdr);
+char *uri_path_of(char *uri);
+int build_origin_request(char *buf, char *uri_path, struct headers *hdr);
+
+/* Responses */
+void freshness_init(struct freshness *f);
+size_t gzip_compress(const char *in, size_t len, char *out, size_t max);
+int gzip_inflate(const char *in, size_t len, char *out, size_t out_len);
+void inflate_reply(struct reply *r, struct cache_entry *entry);
+char *compress_response(char *data, size_t len, struct freshness *f,
+                        size_t *out_len);
+void framer_init(struct framer *f);
+size_t framer_feed(struct framer *f, char *data, size_t n);
+bool framer_eof(struct framer *f);
+bool framer_reusable(struct framer *f);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,471 @@
+/*
+ * proxy_bench - throughput, latency and cache hit ratio of the proxy under
+ * load from many clients.
+ *
+ * Starts a local origin that serves objects /obj/0 to /obj/<urls - 1>, runs
+ * the proxy as a child process in front of it and has a number of clients
+ * request objects through the proxy for a while. The objects are picked from
+ * a Zipf distribution, so a few are popular and most are rarely asked for,
+ * and object i is sizes[i % nsizes] bytes long. Clients keep their
+ * connection to the proxy open across requests, or with -C connect anew for
+ * each one. The hit ratio is the share of requests that never reached the
+ * origin.
+ *     gcc -O2 -o proxy_bench proxy_bench.c csapp.c -lpthread -lm
+ *     ./proxy_bench [-C] [-c clients] [-d seconds] [-u urls] [-z exponent]
+ *                   [-s size[,size...]] [-j file] <proxy> <port>
+ *                   [proxy options...]
+ * With -j, the results are also written to file as JSON, or to stdout for
+ * "-", so runs can be compared across commits.
+ *
+ * Requests a proxy sheds with a 503 are counted apart from errors, and only
+ * the requests served count towards the latencies. To overload a pool of 8
+ * threads, compare shedding against waiting for the queue:
+ *     ./proxy_bench -C -c 256 ./proxy 15213 -p 8 -q 32
+ *     ./proxy_bench -C -c 256 ./proxy 15213 -p 8 -q 32 -O wait
+ * The event-driven workers compare the same way, with epoll or io_uring:
+ *     ./proxy_bench -u 100 ./proxy 15213 -e
+ *     ./proxy_bench -u 100 ./proxy 15213 -u
+ */
+#include "csapp.h"
+#include <math.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define MAX_CLIENTS 1024
+#define MAX_SIZES 16
+#define ORIGIN_MAX_AGE 3600
+
+struct client {
+    pthread_t tid;
+    unsigned long seed;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long rejected; // with a 503, by a proxy shedding load
+    unsigned long long bytes;
+    unsigned long *latencies; // in ns, one per request
+    size_t cap;
+};
+
+static char *origin_port;
+static char *proxy_port;
+static bool close_mode;
+static int nclients = 16;
+static int duration = 10;
+static unsigned int nurls = 10000;
+static double zipf_exponent = 0.99;
+static unsigned long sizes[MAX_SIZES] = {4096};
+static int nsizes = 1;
+
+static char *body;
+static double *zipf_cdf;
+static atomic_ulong origin_requests;
+static atomic_bool stopping;
+
+static double seconds_of(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// answers the requests on one proxy connection until the proxy closes it
+static void *origin_conn_thread(void *vargp) {
+    int connfd = (int)(long)vargp;
+    Pthread_detach(pthread_self());
+    // the head and body go out in two writes, which Nagle would hold back
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_t rio;
+    rio_readinitb(&rio, connfd);
+    char line[MAXLINE], head[MAXLINE];
+    while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+        unsigned int i = 0;
+        sscanf(line, "GET /obj/%u", &i);
+        bool close = false;
+        while (rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n")) {
+            if (!strncasecmp(line, "Connection: close", 17)) {
+                close = true;
+            }
+        }
+        atomic_fetch_add(&origin_requests, 1);
+        unsigned long size = sizes[i % nsizes];
+        int n = sprintf(head,
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Cache-Control: max-age=%d\r\n"
+                        "Content-Length: %lu\r\n"
+                        "\r\n",
+                        ORIGIN_MAX_AGE, size);
+        if (rio_writen(connfd, head, n) != n ||
+            rio_writen(connfd, body, size) != (ssize_t)size || close) {
+            break;
+        }
+    }
+    Close(connfd);
+    return NULL;
+}
+
+static void *origin_thread(void *vargp) {
+    int listenfd = *(int *)vargp;
+    while (1) {
+        long connfd = Accept(listenfd, NULL, NULL);
+        pthread_t tid;
+        Pthread_create(&tid, NULL, origin_conn_thread, (void *)connfd);
+    }
+    return NULL;
+}
+
+static pid_t start_proxy(char **argv, int argc, char *port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *args[argc + 2];
+        for (int i = 0; i < argc; i++) {
+            args[i] = argv[i];
+        }
+        args[argc] = port;
+        args[argc + 1] = NULL;
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(args[0], args);
+        unix_error("execv error");
+    }
+    return pid;
+}
+
+// the cumulative distribution of a Zipf law over the urls
+static void init_zipf(void) {
+    zipf_cdf = Malloc(nurls * sizeof(*zipf_cdf));
+    double sum = 0;
+    for (unsigned int i = 0; i < nurls; i++) {
+        sum += 1 / pow(i + 1, zipf_exponent);
+        zipf_cdf[i] = sum;
+    }
+    for (unsigned int i = 0; i < nurls; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static unsigned int zipf_next(unsigned long *seed) {
+    *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+    double u = (*seed >> 11) * (1.0 / (1UL << 53));
+    unsigned int lo = 0, hi = nurls - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int connect_proxy(void) {
+    int fd;
+    // the proxy may still be starting up
+    for (int tries = 0; (fd = open_clientfd("localhost", proxy_port)) < 0;
+         tries++) {
+        if (tries == 100) {
+            app_error("could not connect to the proxy");
+        }
+        usleep(10000);
+    }
+    return fd;
+}
+
+/*
+ * Sends one request and reads the response, returns the body length, -1 if
+ * the request failed, -2 if the connection closed before any response, or
+ * -3 if the proxy turned it away with a 503. Sets *open to whether the
+ * connection can be used for another request.
+ */
+static long fetch(int fd, rio_t *rio, unsigned int i, bool *open) {
+    char buf[MAXLINE];
+    int n = sprintf(buf,
+                    "GET http://localhost:%s/obj/%u HTTP/1.1\r\n"
+                    "Host: localhost:%s\r\n"
+                    "%s"
+                    "\r\n",
+                    origin_port, i, origin_port,
+                    close_mode ? "Connection: close\r\n" : "");
+    *open = false;
+    int status;
+    if (rio_writen(fd, buf, n) != n || rio_readlineb(rio, buf, MAXLINE) <= 0) {
+        return -2;
+    }
+    if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+    long len = -1;
+    bool close = close_mode;
+    while (1) {
+        if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
+            return -1;
+        }
+        if (!strcmp(buf, "\r\n")) {
+            break;
+        }
+        if (!strncasecmp(buf, "Content-Length:", 15)) {
+            len = strtol(buf + 15, NULL, 10);
+        } else if (!strncasecmp(buf, "Connection: close", 17)) {
+            close = true;
+        }
+    }
+    long total = 0;
+    // without a length, the body runs to the end of the connection
+    while (len < 0 || total < len) {
+        size_t want = len < 0 || len - total > MAXLINE ? MAXLINE : len - total;
+        ssize_t read = rio_readnb(rio, buf, want);
+        if (read <= 0) {
+            break;
+        }
+        total += read;
+    }
+    if (len >= 0 && total < len) {
+        return -1;
+    }
+    if (status != 200) {
+        return status == 503 ? -3 : -1;
+    }
+    *open = len >= 0 && !close;
+    return total;
+}
+
+static void *client_thread(void *vargp) {
+    struct client *c = vargp;
+    int fd = -1;
+    bool reused = false;
+    rio_t rio;
+    while (!atomic_load(&stopping)) {
+        unsigned int i = zipf_next(&c->seed);
+        // a new connection counts towards the latency
+        unsigned long start = now_ns();
+        if (fd < 0) {
+            fd = connect_proxy();
+            rio_readinitb(&rio, fd);
+            reused = false;
+        }
+        bool open;
+        long len = fetch(fd, &rio, i, &open);
+        if (len == -2 && reused) {
+            // the proxy may close an idle connection, or one that served
+            // its share of requests, as the request is sent: try anew
+            Close(fd);
+            fd = connect_proxy();
+            rio_readinitb(&rio, fd);
+            len = fetch(fd, &rio, i, &open);
+        }
+        reused = true;
+        unsigned long latency = now_ns() - start;
+        if (!open) {
+            Close(fd);
+            fd = -1;
+        }
+        if (len == -3) {
+            c->rejected++;
+            continue;
+        }
+        if (len < 0) {
+            c->errors++;
+            continue;
+        }
+        if (c->requests == c->cap) {
+            c->cap = c->cap ? 2 * c->cap : 4096;
+            c->latencies = Realloc(c->latencies, c->cap * sizeof(long));
+        }
+        c->latencies[c->requests++] = latency;
+        c->bytes += len;
+    }
+    if (fd >= 0) {
+        Close(fd);
+    }
+    return NULL;
+}
+
+static int compare_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// the latency, in microseconds, that a share p of requests stayed within
+static double percentile(unsigned long *sorted, size_t n, double p) {
+    if (!n) {
+        return 0;
+    }
+    size_t i = (size_t)ceil(p * n);
+    return sorted[i ? i - 1 : 0] / 1e3;
+}
+
+static void parse_sizes(char *arg) {
+    nsizes = 0;
+    for (char *size = strtok(arg, ","); size; size = strtok(NULL, ",")) {
+        if (nsizes == MAX_SIZES) {
+            app_error("too many sizes");
+        }
+        sizes[nsizes++] = strtoul(size, NULL, 10);
+    }
+}
+
+static void bench_usage(char *prog) {
+    fprintf(stderr,
+            "usage: %s [-C] [-c clients] [-d seconds] [-u urls] "
+            "[-z exponent] [-s size[,size...]] [-j file] <proxy> <port> "
+            "[proxy options...]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *json = NULL;
+    int opt;
+    // options after the proxy are the proxy's own
+    while ((opt = getopt(argc, argv, "+Cc:d:u:z:s:j:")) != EOF) {
+        switch (opt) {
+        case 'C':
+            close_mode = true;
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'u':
+            nurls = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            zipf_exponent = strtod(optarg, NULL);
+            break;
+        case 's':
+            parse_sizes(optarg);
+            break;
+        case 'j':
+            json = optarg;
+            break;
+        default:
+            bench_usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || nclients < 1 || nclients > MAX_CLIENTS ||
+        duration < 1 || !nurls || !nsizes) {
+        bench_usage(argv[0]);
+    }
+    proxy_port = argv[optind + 1];
+    unsigned long max_size = 0;
+    for (int i = 0; i < nsizes; i++) {
+        max_size = sizes[i] > max_size ? sizes[i] : max_size;
+    }
+    body = Malloc(max_size ? max_size : 1);
+    memset(body, 'x', max_size);
+    init_zipf();
+    signal(SIGPIPE, SIG_IGN);
+
+    int listenfd = Open_listenfd("0");
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char port[NI_MAXSERV];
+    getsockname(listenfd, (SA *)&addr, &addrlen);
+    getnameinfo((SA *)&addr, addrlen, NULL, 0, port, sizeof(port),
+                NI_NUMERICSERV);
+    origin_port = port;
+    pthread_t tid;
+    Pthread_create(&tid, NULL, origin_thread, &listenfd);
+
+    // proxy options go before the port
+    int proxy_argc = argc - optind - 1;
+    char *proxy_argv[proxy_argc];
+    proxy_argv[0] = argv[optind];
+    for (int i = 1; i < proxy_argc; i++) {
+        proxy_argv[i] = argv[optind + 1 + i];
+    }
+    pid_t pid = start_proxy(proxy_argv, proxy_argc, proxy_port);
+    Close(connect_proxy());
+
+    static struct client clients[MAX_CLIENTS];
+    unsigned long start = now_ns();
+    for (int i = 0; i < nclients; i++) {
+        clients[i].seed = i + 1;
+        Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+    sleep(duration);
+    atomic_store(&stopping, true);
+    unsigned long requests = 0, errors = 0, rejected = 0;
+    unsigned long long bytes = 0;
+    for (int i = 0; i < nclients; i++) {
+        Pthread_join(clients[i].tid, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        rejected += clients[i].rejected;
+        bytes += clients[i].bytes;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    kill(pid, SIGKILL);
+    struct rusage usage;
+    wait4(pid, NULL, 0, &usage);
+    double cpu = seconds_of(&usage.ru_utime) + seconds_of(&usage.ru_stime);
+
+    unsigned long *latencies = Malloc((requests ? requests : 1) * sizeof(long));
+    size_t n = 0;
+    for (int i = 0; i < nclients; i++) {
+        memcpy(latencies + n, clients[i].latencies,
+               clients[i].requests * sizeof(long));
+        n += clients[i].requests;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, n, sizeof(long), compare_ulong);
+    double p50 = percentile(latencies, n, 0.5);
+    double p99 = percentile(latencies, n, 0.99);
+    double p999 = percentile(latencies, n, 0.999);
+    double max = n ? latencies[n - 1] / 1e3 : 0;
+    // the proxy's connection checks and errors reach the origin as well
+    unsigned long misses = atomic_load(&origin_requests);
+    double hit_ratio =
+        requests ? 1 - (double)(misses < requests ? misses : requests) /
+                           requests
+                 : 0;
+
+    printf("%d %s clients, %u urls (zipf %.2f), %.1fs\n", nclients,
+           close_mode ? "close" : "keep-alive", nurls, zipf_exponent,
+           elapsed);
+    printf("%lu requests, %lu errors, %lu rejected: %.0f req/s, %.1f MiB/s\n",
+           requests, errors, rejected, requests / elapsed,
+           bytes / elapsed / (1 << 20));
+    printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", p50, p99,
+           p999, max);
+    printf("hit ratio %.4f, proxy cpu %.2fs (%.1f us/request)\n", hit_ratio,
+           cpu, requests ? cpu * 1e6 / requests : 0);
+
+    if (json) {
+        FILE *out = strcmp(json, "-") ? fopen(json, "w") : stdout;
+        if (!out) {
+            unix_error("fopen error");
+        }
+        fprintf(out, "{\"clients\": %d, \"mode\": \"%s\", \"urls\": %u, ",
+                nclients, close_mode ? "close" : "keep-alive", nurls);
+        fprintf(out, "\"zipf\": %.2f, \"sizes\": [", zipf_exponent);
+        for (int i = 0; i < nsizes; i++) {
+            fprintf(out, i ? ", %lu" : "%lu", sizes[i]);
+        }
+        fprintf(out,
+                "], \"seconds\": %.3f, \"requests\": %lu, \"errors\": %lu, "
+                "\"rejected\": %lu, "
+                "\"requests_per_second\": %.1f, \"bytes_per_second\": %.0f, "
+                "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+                "\"p999\": %.1f, \"max\": %.1f}, \"hit_ratio\": %.4f, "
+                "\"origin_requests\": %lu, \"proxy_cpu_seconds\": %.3f}\n",
+                elapsed, requests, errors, rejected, requests / elapsed,
+                bytes / elapsed, p50, p99, p999, max, hit_ratio, misses, cpu);
+        if (out != stdout) {
+            fclose(out);
+        }
+    }
+    Free(latencies);
+    return 0;
+}
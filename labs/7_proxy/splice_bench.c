@@ -0,0 +1,141 @@
+/*
+ * splice_bench - download throughput through the proxy for responses too
+ * large to cache, and the CPU time the proxy spends per byte.
+ *
+ * Starts a local origin that answers every request with a body of the given
+ * size, runs the proxy as a child process in front of it and downloads the
+ * body repeatedly through the proxy. Compare a default run against one with
+ * -b, which makes the proxy copy through user space instead of splicing:
+ *     gcc -O2 -o splice_bench splice_bench.c csapp.c -lpthread
+ *     ./splice_bench ./proxy 15213
+ *     ./splice_bench ./proxy 15213 -b
+ */
+#include "csapp.h"
+#include <sys/resource.h>
+#include <time.h>
+
+#define BODY_MB 64
+#define REQUESTS 32
+
+static char body[1 << 20];
+
+static double seconds_of(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void *origin_thread(void *vargp) {
+    int listenfd = *(int *)vargp;
+    char buf[MAXLINE];
+    while (1) {
+        int connfd = Accept(listenfd, NULL, NULL);
+        rio_t rio;
+        rio_readinitb(&rio, connfd);
+        while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+        }
+        int n = sprintf(buf,
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Length: %d\r\n"
+                        "\r\n",
+                        BODY_MB << 20);
+        if (rio_writen(connfd, buf, n) == n) {
+            for (int i = 0; i < BODY_MB; i++) {
+                if (rio_writen(connfd, body, sizeof(body)) < 0) {
+                    break;
+                }
+            }
+        }
+        Close(connfd);
+    }
+    return NULL;
+}
+
+static pid_t start_proxy(char **argv, int argc, char *port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *args[argc + 2];
+        for (int i = 0; i < argc; i++) {
+            args[i] = argv[i];
+        }
+        args[argc] = port;
+        args[argc + 1] = NULL;
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(args[0], args);
+        unix_error("execv error");
+    }
+    return pid;
+}
+
+static long download(char *proxy_port, char *origin_port) {
+    int fd;
+    // the proxy may still be starting up
+    for (int tries = 0; (fd = open_clientfd("localhost", proxy_port)) < 0;
+         tries++) {
+        if (tries == 100) {
+            app_error("could not connect to the proxy");
+        }
+        usleep(10000);
+    }
+    char buf[MAXLINE];
+    int n = sprintf(buf,
+                    "GET http://localhost:%s/large HTTP/1.0\r\n"
+                    "Host: localhost:%s\r\n"
+                    "\r\n",
+                    origin_port, origin_port);
+    Rio_writen(fd, buf, n);
+    long total = 0;
+    ssize_t read;
+    while ((read = Rio_readn(fd, buf, MAXLINE)) > 0) {
+        total += read;
+    }
+    Close(fd);
+    return total;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <proxy> <port> [proxy options...]\n",
+                argv[0]);
+        exit(1);
+    }
+    char *proxy_port = argv[2];
+    memset(body, 'x', sizeof(body));
+    signal(SIGPIPE, SIG_IGN);
+
+    int listenfd = Open_listenfd("0");
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char origin_port[NI_MAXSERV];
+    getsockname(listenfd, (SA *)&addr, &addrlen);
+    getnameinfo((SA *)&addr, addrlen, NULL, 0, origin_port,
+                sizeof(origin_port), NI_NUMERICSERV);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, origin_thread, &listenfd);
+
+    // proxy options go before the port
+    char *proxy_argv[argc];
+    proxy_argv[0] = argv[1];
+    for (int i = 3; i < argc; i++) {
+        proxy_argv[i - 2] = argv[i];
+    }
+    pid_t pid = start_proxy(proxy_argv, argc - 2, proxy_port);
+
+    struct timespec start, end;
+    long bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < REQUESTS; i++) {
+        bytes += download(proxy_port, origin_port);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    kill(pid, SIGKILL);
+    struct rusage usage;
+    wait4(pid, NULL, 0, &usage);
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double cpu = seconds_of(&usage.ru_utime) + seconds_of(&usage.ru_stime);
+    printf("%ld MiB in %.2fs: %.1f MiB/s, proxy cpu %.2fs (%.2f ns/byte)\n",
+           bytes >> 20, elapsed, (bytes >> 20) / elapsed, cpu,
+           cpu * 1e9 / bytes);
+    return 0;
+}